@@ -10,10 +10,6 @@
 #include "SDL3/SDL.h"
 
 
-unsigned int debugLineVAO = 0;
-unsigned int debugLineVBO = 0;
-
-
 // 1. The Vertex Shader Source
 //    It takes a generic 3D point (aPos) and multiplies it by our 3 matrices.
 const char* vertexShaderSource = 
@@ -142,16 +138,49 @@ unsigned int CreateShaderProgram()
 
 
 //
-// Function initializes the debug line buffers
+// Starts a render context with its own shader program, the debug lines are made when they're first needed
+//
+void InitRenderContextGL(GLRenderContext* ctx)
+{
+    ctx->shaderProgram = CreateShaderProgram();
+    ctx->debugLineVAO = 0;
+    ctx->debugLineVBO = 0;
+}
+
+
+
+//
+// Deletes the shader program and debug line buffers of a context
+//
+void FreeRenderContextGL(GLRenderContext* ctx)
+{
+    if (ctx->debugLineVAO != 0)
+    {
+        glDeleteVertexArrays(1, &ctx->debugLineVAO);
+        glDeleteBuffers(1, &ctx->debugLineVBO);
+        ctx->debugLineVAO = ctx->debugLineVBO = 0;
+    }
+
+    glDeleteProgram(ctx->shaderProgram);
+    ctx->shaderProgram = 0;
+}
+
+
+
+//
+// Function initializes the debug line buffers (once per context)
 //
-void InitDebugLine()
+void InitDebugLine(GLRenderContext* ctx)
 {
-    glGenVertexArrays(1, &debugLineVAO);
-    glGenBuffers(1, &debugLineVBO);
+    if (ctx->debugLineVAO != 0)
+        return;
+
+    glGenVertexArrays(1, &ctx->debugLineVAO);
+    glGenBuffers(1, &ctx->debugLineVBO);
 
-    glBindVertexArray(debugLineVAO);
+    glBindVertexArray(ctx->debugLineVAO);
 
-    glBindBuffer(GL_ARRAY_BUFFER, debugLineVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, ctx->debugLineVBO);
     glBufferData(
         GL_ARRAY_BUFFER,
         sizeof(Vector3) * 2 * 10000,
@@ -170,7 +199,7 @@ void InitDebugLine()
 //
 // Use this to update all debug rays at once
 //
-void UpdateDebugRay(Ray* rays, int rayCount)
+void UpdateDebugRay(GLRenderContext* ctx, Ray* rays, int rayCount)
 {
     if (rayCount > 10000) rayCount = 10000;
     if (rayCount == 0) return;
@@ -183,7 +212,7 @@ void UpdateDebugRay(Ray* rays, int rayCount)
         lineVerts[i*2+1] = Vector3Add(rays[i].origin, Vector3Scale(rays[i].direction, 100.0f));
     }
 
-    glBindBuffer(GL_ARRAY_BUFFER, debugLineVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, ctx->debugLineVBO);
 
     glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vector3) * 2 * rayCount, lineVerts);
 
@@ -195,23 +224,23 @@ void UpdateDebugRay(Ray* rays, int rayCount)
 //
 // Function to draw all debug rays
 //
-void DrawDebugRay(unsigned int shaderProgram, Matrix4 view, Matrix4 projection, int rayCount)
+void DrawDebugRay(GLRenderContext* ctx, Matrix4 view, Matrix4 projection, int rayCount)
 {
     if (rayCount > 10000) rayCount = 10000;
     if (rayCount == 0) return;
     
-    glUseProgram(shaderProgram);
+    glUseProgram(ctx->shaderProgram);
 
     glLineWidth(1.0f);
 
-    glUniform1i(glGetUniformLocation(shaderProgram, "renderMode"), 1);
+    glUniform1i(glGetUniformLocation(ctx->shaderProgram, "renderMode"), 1);
     
     Matrix4 model = Mat4Identity();
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, (float*)&model);
+    glUniformMatrix4fv(glGetUniformLocation(ctx->shaderProgram, "model"), 1, GL_FALSE, (float*)&model);
     
-    glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 1.0f, 0.0f, 0.0f);
+    glUniform3f(glGetUniformLocation(ctx->shaderProgram, "objectColor"), 1.0f, 0.0f, 0.0f);
 
-    glBindVertexArray(debugLineVAO);
+    glBindVertexArray(ctx->debugLineVAO);
     
     // DRAW COMMAND: Draw 2 vertices for every ray
     glDrawArrays(GL_LINES, 0, rayCount * 2);
@@ -232,9 +261,13 @@ void UploadMeshToGPU(Mesh* mesh)
     // gpu->cpuMesh = cpuMesh; // Store the reference
     mesh->gpuMesh = malloc(sizeof(GPUMesh));
 
-    // 1. Calculate Normals (Temp buffer)
-    Vector3* normals = malloc(mesh->vertexCount * sizeof(Vector3));
-    CalculateNormals(mesh->vertices, mesh->vertexCount, (int*)mesh->faces, mesh->facesCount * 3, normals);
+    // 1. Normals (made at load, a temp buffer only if that failed)
+    Vector3* normals = mesh->normals;
+    if (normals == NULL)
+    {
+        normals = malloc(mesh->vertexCount * sizeof(Vector3));
+        CalculateNormals(mesh->vertices, mesh->vertexCount, (int*)mesh->faces, mesh->facesCount * 3, normals);
+    }
 
     // 2. Generate Handles
     glGenVertexArrays(1, &mesh->gpuMesh->VAO);
@@ -262,7 +295,8 @@ void UploadMeshToGPU(Mesh* mesh)
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->facesCount * 3 * sizeof(int), mesh->faces, GL_STATIC_DRAW);
 
     glBindVertexArray(0);
-    free(normals);
+    if (normals != mesh->normals)
+        free(normals);
 
     // return gpu;
 }
@@ -341,7 +375,7 @@ void CalculateNormals(Vector3* vertices, int vCount, int* indices, int iCount, V
 // Main openGL render function.
 // Renders all objects in the given scene in a specified mode.
 //
-void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram, Vector3 WorldLight, int renderMode, bool debugRays, int debugRayCount)
+void RenderSceneGL(GLRenderContext* ctx, SDL_Window* window, Scene* scene, Vector3 WorldLight, int renderMode, bool debugRays, int debugRayCount)
 {
     // printf("starting rendering\n");
     // 1. Clear Screen and Depth Buffer Depth buffer is what stops triangles drawing over each other (Z-sorting)
@@ -349,7 +383,7 @@ void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram,
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // 2. Activate Shader
-    glUseProgram(shaderProgram);
+    glUseProgram(ctx->shaderProgram);
 
     // Use specified render mode
     switch(renderMode)
@@ -376,15 +410,15 @@ void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram,
     // printf("Assigning shader variables\n");
     // float lightDir[3] = {0.0f, -1.0f, -0.2f};
     float lightDir[3] = {WorldLight.x, WorldLight.y, WorldLight.z};
-    int lightLoc = glGetUniformLocation(shaderProgram, "lightDir");
+    int lightLoc = glGetUniformLocation(ctx->shaderProgram, "lightDir");
     glUniform3fv(lightLoc, 1, lightDir);
 
-    int wfLoc = glGetUniformLocation(shaderProgram, "renderMode");
+    int wfLoc = glGetUniformLocation(ctx->shaderProgram, "renderMode");
     glUniform1i(wfLoc, (renderMode > 0) ? 1 : 0);
 
     // 3. Calculate & Send View Matrix (Camera)
     Matrix4 view = GetViewMatrix(cam);
-    int viewLoc = glGetUniformLocation(shaderProgram, "view");
+    int viewLoc = glGetUniformLocation(ctx->shaderProgram, "view");
     glUniformMatrix4fv(viewLoc, 1, GL_FALSE, (float*)&view);
 
     // 4. Calculate & Send Projection Matrix (Lens)
@@ -395,7 +429,7 @@ void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram,
     // FOV: 1.57 rads (~90 deg), Near: 0.05, Far: 100.0
     Matrix4 proj = Mat4Perspective(1.57f, aspectRatio, 0.05f, 100.0f);
     
-    int projLoc = glGetUniformLocation(shaderProgram, "projection");
+    int projLoc = glGetUniformLocation(ctx->shaderProgram, "projection");
     glUniformMatrix4fv(projLoc, 1, GL_FALSE, (float*)&proj);
 
     // printf("\n----- Starting object drawing -----\n");
@@ -426,11 +460,11 @@ void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram,
         // A. Send Model Matrix (Position/Rotation/Scale)
         Matrix4 model = GetModelMatrix(obj->transform);
         
-        int modelLoc = glGetUniformLocation(shaderProgram, "model");
+        int modelLoc = glGetUniformLocation(ctx->shaderProgram, "model");
         glUniformMatrix4fv(modelLoc, 1, GL_FALSE, (float*)&model);
 
         // B. Send Color
-        int colorLoc = glGetUniformLocation(shaderProgram, "objectColor");
+        int colorLoc = glGetUniformLocation(ctx->shaderProgram, "objectColor");
         glUniform3f(colorLoc, 
                     obj->mesh->color.r / 255.0f, 
                     obj->mesh->color.g / 255.0f, 
@@ -448,7 +482,7 @@ void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram,
     if (debugRays == true && debugRayCount > 0)
     {
         glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        DrawDebugRay(shaderProgram, view, proj, debugRayCount);
+        DrawDebugRay(ctx, view, proj, debugRayCount);
     }
 
     if (renderMode != 0)
@@ -6,21 +6,36 @@
 
 
 
+// Everything one GL renderer draws with. GL objects belong to the GL context that was current when they were made,
+// so every window (or thread) drawing with its own GL context needs its own render context.
+typedef struct GLRenderContext
+{
+    unsigned int shaderProgram;
+    unsigned int debugLineVAO;      // Debug ray lines (0 until InitDebugLine)
+    unsigned int debugLineVBO;
+} GLRenderContext;
+
+
+
 //////////////////////
 // Rendering functions
 //////////////////////
 
 unsigned int CreateShaderProgram();
 
-void InitDebugLine();
-void UpdateDebugRay(Ray* rays, int rayCount);
-void DrawDebugRay(unsigned int shaderProgram, Matrix4 view, Matrix4 projection, int rayCount);
+// Makes the shader program of a context, and deletes its GL objects (its GL context has to be current for both)
+void InitRenderContextGL(GLRenderContext* ctx);
+void FreeRenderContextGL(GLRenderContext* ctx);
+
+void InitDebugLine(GLRenderContext* ctx);
+void UpdateDebugRay(GLRenderContext* ctx, Ray* rays, int rayCount);
+void DrawDebugRay(GLRenderContext* ctx, Matrix4 view, Matrix4 projection, int rayCount);
 
 
 
 void UploadMeshToGPU(Mesh* mesh);
 void CalculateNormals(Vector3* vertices, int vCount, int* indices, int iCount, Vector3* outNormals);
-void RenderSceneGL(SDL_Window* window, Scene* scene, unsigned int shaderProgram, Vector3 WorldLight, int renderMode, bool debugRays, int debugRayCount);
+void RenderSceneGL(GLRenderContext* ctx, SDL_Window* window, Scene* scene, Vector3 WorldLight, int renderMode, bool debugRays, int debugRayCount);
 
 
 #endif
\ No newline at end of file
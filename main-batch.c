@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+
+#include "SDL3/SDL.h"
+
+#include "structures.h"
+#include "softwareRender.h"
+#include "rasterizer.h"
+#include "offlineRender.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Batch offline renderer: one image per camera pose, on several threads //
+///////////////////////////////////////////////////////////////////////////
+
+// One camera pose, the same "x y z yaw pitch" as a headless camera path key
+typedef struct CameraPose
+{
+    Vector3 position;
+    float yaw;
+    float pitch;
+} CameraPose;
+
+
+// Everything the worker threads share. The scene is only read while they run.
+typedef struct BatchJob
+{
+    Scene* scene;
+    CameraPose* poses;
+    int poseCount;
+    WindowInfo program;
+    int renderMode;
+    bool smoothShading;
+    int layout;
+    const char* output;
+    SDL_AtomicInt nextPose;
+} BatchJob;
+
+
+// One worker thread, with its own render context and surface so it never waits for the others
+typedef struct BatchWorker
+{
+    BatchJob* job;
+    SDL_Thread* thread;
+    SDL_Surface* surface;
+    int images;
+    double renderMs;    // Time spent in RenderScene, without clearing or saving
+    bool failed;
+} BatchWorker;
+
+
+
+void PrintUsage(const char* name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("  -s, --scene <file.obj|penguin>  Add an object to the scene (can be repeated)\n");
+    printf("                                  Default: penguin and SampleObjects/Sword-lowpoly.obj\n");
+    printf("  -p, --poses <file>              Camera poses, one \"x y z yaw pitch\" per line, one image each\n");
+    printf("      --orbit <radius>            Turntable instead: -n poses evenly around the scene\n");
+    printf("  -n, --count <count>             Number of turntable poses (default 36)\n");
+    printf("  -w, --size <width>x<height>     Image size (default 256x256)\n");
+    printf("  -m, --mode <mode>               zbuffer, spans or visibility (default zbuffer)\n");
+    printf("  -o, --output <pattern>          Save images, e.g. thumb%%04d.ppm (.ppm or raw .rgba)\n");
+    printf("  -j, --threads <count>           Worker threads (default one per core)\n");
+    printf("      --smooth                    Gouraud shading with the meshes' vertex normals (z-buffer mode)\n");
+    printf("      --layout <layout>           Z-buffer memory layout: linear or blocked (8x8 pixel blocks, default linear)\n");
+}
+
+
+
+//
+// Reads a pose file, returns the number of poses (0 on failure)
+//
+int LoadCameraPoses(const char* filename, CameraPose** poses)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("Could not open pose file %s\n", filename);
+        return 0;
+    }
+
+    int count = 0;
+    int capacity = 0;
+    char line[256];
+
+    while (fgets(line, sizeof(line), file))
+    {
+        CameraPose pose = {0};
+        if (line[0] == '#' ||
+            sscanf(line, "%f %f %f %f %f", &pose.position.x, &pose.position.y, &pose.position.z, &pose.yaw, &pose.pitch) < 3)
+            continue;
+
+        if (count >= capacity)
+        {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            *poses = realloc(*poses, sizeof(CameraPose) * capacity);
+        }
+
+        (*poses)[count++] = pose;
+    }
+
+    fclose(file);
+    return count;
+}
+
+
+
+//
+// Points a camera the way a pose says (same yaw then pitch order as Camera_MouseLook)
+//
+void PlaceCamera(Camera* cam, CameraPose pose)
+{
+    cam->transform.position = pose.position;
+
+    Quaternion yawQ   = QuaternionFromAxisAngle(0.0f, 1.0f, 0.0f, pose.yaw);
+    Quaternion pitchQ = QuaternionFromAxisAngle(1.0f, 0.0f, 0.0f, pose.pitch);
+    cam->rotation = QuaternionNormalize(QuaternionMultiply(yawQ, pitchQ));
+}
+
+
+
+//
+// Worker thread: takes the next pose until there are none left, renders it and saves it.
+// The meshes are shared, only the camera and the render context are the worker's own.
+//
+int BatchWorkerMain(void* data)
+{
+    BatchWorker* worker = data;
+    BatchJob* job = worker->job;
+
+    RenderContext context;
+    InitRenderContext(&context);
+    SetSmoothShading(&context, job->smoothShading);
+    SetRasterLayout(&context.raster, job->layout);
+
+    Camera cam = {0};
+    Scene scene = *job->scene;
+    scene.mainCam = &cam;
+
+    Vector3 lightDirWorld = Vector3Normalize((Vector3){0.5f, -1.0f, 0.5f});
+    Color background = {40, 40, 40, 255};
+    char filename[512];
+
+    while (true)
+    {
+        int index = SDL_AddAtomicInt(&job->nextPose, 1);
+        if (index >= job->poseCount)
+            break;
+
+        PlaceCamera(&cam, job->poses[index]);
+        FillRasterSurface(worker->surface, NULL, background);
+
+        // No SDL renderer: it only works on the main thread, and the native rasterizer modes don't need one
+        Uint64 start = SDL_GetPerformanceCounter();
+        RenderScene(&context, NULL, worker->surface, job->program, &scene, lightDirWorld, job->renderMode);
+        worker->renderMs += (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+        worker->images++;
+
+        if (job->output != NULL)
+        {
+            snprintf(filename, sizeof(filename), job->output, index);
+            if (!SaveFrame(worker->surface, filename))
+                worker->failed = true;
+        }
+    }
+
+    FreeRenderContext(&context);
+    return 0;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    WindowInfo program = {256, 256, 120};
+    int renderMode = SOFTWARE_MODE_ZBUFFER;
+    int layout = RASTER_LAYOUT_LINEAR;
+    const char* poseFile = NULL;
+    const char* output = NULL;
+    const char* sceneFiles[16];
+    int sceneFileCount = 0;
+    float orbit = 0;
+    int turntableCount = 36;
+    int threadCount = SDL_GetNumLogicalCPUCores();
+    bool smoothShading = false;
+
+    // Read the command line
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
+        {
+            PrintUsage(argv[0]);
+            return 0;
+        }
+        else if (strcmp(arg, "--smooth") == 0)
+        {
+            smoothShading = true;
+            continue;
+        }
+
+        if (value == NULL)
+        {
+            printf("Missing value for %s\n", arg);
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        i++;
+
+        if (strcmp(arg, "-s") == 0 || strcmp(arg, "--scene") == 0)
+        {
+            if (sceneFileCount < 16)
+                sceneFiles[sceneFileCount++] = value;
+        }
+        else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--poses") == 0)
+            poseFile = value;
+        else if (strcmp(arg, "--orbit") == 0)
+            orbit = atof(value);
+        else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--count") == 0)
+            turntableCount = atoi(value);
+        else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--threads") == 0)
+            threadCount = atoi(value);
+        else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0)
+        {
+            if (!IsFramePattern(value))
+            {
+                printf("Output pattern needs exactly one %%d for the image number (e.g. image%%04d.ppm): %s\n", value);
+                return 1;
+            }
+            output = value;
+        }
+        else if (strcmp(arg, "-w") == 0 || strcmp(arg, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &program.width, &program.height) != 2 || program.width <= 0 || program.height <= 0)
+            {
+                printf("Size should look like 800x600\n");
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--mode") == 0)
+        {
+            if      (strcmp(value, "zbuffer") == 0)    renderMode = SOFTWARE_MODE_ZBUFFER;
+            else if (strcmp(value, "spans") == 0)      renderMode = SOFTWARE_MODE_SPANS;
+            else if (strcmp(value, "visibility") == 0) renderMode = SOFTWARE_MODE_VISIBILITY;
+            else
+            {
+                printf("Unknown render mode: %s (the batch renderer only has the native rasterizer modes)\n", value);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--layout") == 0)
+        {
+            if      (strcmp(value, "linear") == 0)  layout = RASTER_LAYOUT_LINEAR;
+            else if (strcmp(value, "blocked") == 0) layout = RASTER_LAYOUT_BLOCKED;
+            else
+            {
+                printf("Unknown layout: %s\n", value);
+                return 1;
+            }
+        }
+        else
+        {
+            printf("Unknown option: %s\n", arg);
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (threadCount < 1)
+        threadCount = 1;
+    if (turntableCount < 1)
+        turntableCount = 1;
+
+
+
+    // Build the scene
+    // -----------------------------------------------------------------------
+    Scene scene = {0};
+    LoadSceneFiles(&scene, sceneFiles, sceneFileCount);
+
+    if (scene.objectCount == 0)
+    {
+        printf("Nothing to render\n");
+        return 1;
+    }
+
+
+
+    // Camera poses
+    // -----------------------------------------------------------------------
+    CameraPose* poses = NULL;
+    int poseCount = 0;
+
+    if (poseFile != NULL)
+    {
+        poseCount = LoadCameraPoses(poseFile, &poses);
+        if (poseCount == 0)
+        {
+            printf("Pose file %s has no poses\n", poseFile);
+            return 1;
+        }
+    }
+    else
+    {
+        // Turntable: evenly around the middle of the scene, always looking at it
+        if (orbit <= 0)
+            orbit = 3.0f;
+
+        poseCount = turntableCount;
+        poses = malloc(sizeof(CameraPose) * poseCount);
+        Vector3 center = {0, 0, -1.5f};
+
+        for (int k = 0; k < poseCount; ++k)
+        {
+            float angle = 2.0f * 3.14159265f * k / poseCount;
+            poses[k].position = (Vector3){center.x + orbit * sinf(angle), center.y, center.z + orbit * cosf(angle)};
+            poses[k].yaw = angle;
+            poses[k].pitch = 0;
+        }
+    }
+
+    if (threadCount > poseCount)
+        threadCount = poseCount;
+
+
+
+    // Render
+    // -----------------------------------------------------------------------
+    BatchJob job = {0};
+    job.scene = &scene;
+    job.poses = poses;
+    job.poseCount = poseCount;
+    job.program = program;
+    job.renderMode = renderMode;
+    job.smoothShading = smoothShading;
+    job.layout = layout;
+    job.output = output;
+    SDL_SetAtomicInt(&job.nextPose, 0);
+
+    // Surfaces are made here, the workers only draw into them
+    BatchWorker* workers = calloc(threadCount, sizeof(BatchWorker));
+    for (int i = 0; i < threadCount; ++i)
+    {
+        workers[i].job = &job;
+        workers[i].surface = SDL_CreateSurface(program.width, program.height, SDL_PIXELFORMAT_RGBA8888);
+        if (!workers[i].surface)
+        {
+            printf("Could not create a surface: %s\n", SDL_GetError());
+            return 1;
+        }
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    // Worker 0 is this thread
+    for (int i = 1; i < threadCount; ++i)
+    {
+        workers[i].thread = SDL_CreateThread(BatchWorkerMain, "BatchWorker", &workers[i]);
+        if (workers[i].thread == NULL)
+            printf("Failed to create batch thread %d, the others take its share\n", i);
+    }
+    BatchWorkerMain(&workers[0]);
+
+    int images = 0;
+    int threadsUsed = 0;
+    double renderMs = 0;
+    bool failed = false;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        if (i > 0 && workers[i].thread != NULL)
+            SDL_WaitThread(workers[i].thread, NULL);
+
+        images += workers[i].images;
+        renderMs += workers[i].renderMs;
+        failed |= workers[i].failed;
+        if (i == 0 || workers[i].thread != NULL)
+            threadsUsed++;
+    }
+
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    // Per core: the threads can't run on more cores than there are
+    int cores = SDL_min(threadsUsed, SDL_GetNumLogicalCPUCores());
+    double fps = images / seconds;
+    printf("%d images at %dx%d on %d threads in %.3f s: %.1f fps, %.1f fps per core (%d cores)\n",
+           images, program.width, program.height, threadsUsed, seconds, fps, fps / cores, cores);
+    printf("RenderScene alone: average %.3f ms per image (the rest is clearing%s)\n", renderMs / images, (output != NULL) ? " and saving" : "");
+
+
+
+    // Exiting functions
+    for (int i = 0; i < threadCount; ++i)
+        SDL_DestroySurface(workers[i].surface);
+    free(workers);
+    free(poses);
+    SDL_Quit();
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+
+#include "SDL3/SDL.h"
+
+#include "structures.h"
+#include "softwareRender.h"
+#include "rasterizer.h"
+#include "offlineRender.h"
+
+
+
+///////////////////////////////////////////////////////////////////
+// Headless software renderer: no window, renders into a surface //
+///////////////////////////////////////////////////////////////////
+
+// One point of a camera path
+typedef struct CameraKey
+{
+    Vector3 position;
+    float yaw;
+    float pitch;
+} CameraKey;
+
+
+
+void PrintUsage(const char* name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("  -s, --scene <file.obj|penguin>  Add an object to the scene (can be repeated)\n");
+    printf("                                  Default: penguin and SampleObjects/Sword-lowpoly.obj\n");
+    printf("  -c, --camera <file>             Camera path, one \"x y z yaw pitch\" key per line,\n");
+    printf("                                  spread evenly over the frames\n");
+    printf("      --orbit <radius>            Circle the camera around the scene instead\n");
+    printf("  -n, --frames <count>            Number of frames to render (default 60)\n");
+    printf("  -w, --size <width>x<height>     Surface size (default 800x800)\n");
+    printf("  -m, --mode <mode>               mesh, wireframe, zbuffer, tiled, spans or visibility (default zbuffer)\n");
+    printf("  -j, --threads <count>           Threads drawing the tiles in the tiled mode (default one per core)\n");
+    printf("  -o, --output <pattern>          Save frames, e.g. frame%%04d.ppm (.ppm or raw .rgba)\n");
+    printf("      --still                     Don't spin the objects between frames\n");
+    printf("      --spin <index>              Only spin one object (the others stay still)\n");
+    printf("      --static <index>            Object never moves and is drawn from the static BSP tree in the mesh and spans modes\n");
+    printf("      --dirty                     Only redraw the parts of the screen that changed (z-buffer modes)\n");
+    printf("      --pipeline                  Build the next frame's triangles on another thread (one frame of latency)\n");
+    printf("      --coherent-sort             Start the mesh mode's sort from the last frame's order\n");
+    printf("      --smooth                    Gouraud shading with the meshes' vertex normals (mesh and z-buffer modes)\n");
+    printf("      --dynamic <fps>             Lower the internal resolution to hold this frame rate, frames are scaled up to --size\n");
+    printf("      --upscale <filter>          nearest or bilinear (default bilinear)\n");
+    printf("      --layout <layout>           Z-buffer memory layout: linear or blocked (8x8 pixel blocks, default linear)\n");
+    printf("      --state <flags>             Z-buffer render state, a comma separated list of nodepth, wireframe and blend\n");
+}
+
+
+
+//
+// Reads a camera path file, returns the number of keys (0 on failure)
+//
+int LoadCameraPath(const char* filename, CameraKey** keys)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("Could not open camera path %s\n", filename);
+        return 0;
+    }
+
+    int count = 0;
+    int capacity = 0;
+    char line[256];
+
+    while (fgets(line, sizeof(line), file))
+    {
+        CameraKey key = {0};
+        if (line[0] == '#' ||
+            sscanf(line, "%f %f %f %f %f", &key.position.x, &key.position.y, &key.position.z, &key.yaw, &key.pitch) < 3)
+            continue;
+
+        if (count >= capacity)
+        {
+            capacity = (capacity == 0) ? 8 : capacity * 2;
+            *keys = realloc(*keys, sizeof(CameraKey) * capacity);
+        }
+
+        (*keys)[count++] = key;
+    }
+
+    fclose(file);
+    return count;
+}
+
+
+
+//
+// Puts the camera where the path says it is at time t (0 to 1)
+//
+void PlaceCamera(Camera* cam, CameraKey* keys, int keyCount, float t)
+{
+    CameraKey key = keys[0];
+
+    if (keyCount > 1)
+    {
+        float position = t * (keyCount - 1);
+        int i = (int)position;
+        if (i >= keyCount - 1)
+            i = keyCount - 2;
+
+        float f = position - i;
+        key.position = Vector3Lerp(keys[i].position, keys[i + 1].position, f);
+        key.yaw = keys[i].yaw + (keys[i + 1].yaw - keys[i].yaw) * f;
+        key.pitch = keys[i].pitch + (keys[i + 1].pitch - keys[i].pitch) * f;
+    }
+
+    cam->transform.position = key.position;
+
+    // Same yaw then pitch order as Camera_MouseLook
+    Quaternion yawQ   = QuaternionFromAxisAngle(0.0f, 1.0f, 0.0f, key.yaw);
+    Quaternion pitchQ = QuaternionFromAxisAngle(1.0f, 0.0f, 0.0f, key.pitch);
+    cam->rotation = QuaternionNormalize(QuaternionMultiply(yawQ, pitchQ));
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    WindowInfo program = {800, 800, 120};
+    int frames = 60;
+    int renderMode = SOFTWARE_MODE_ZBUFFER;
+    const char* cameraFile = NULL;
+    const char* output = NULL;
+    const char* sceneFiles[16];
+    int sceneFileCount = 0;
+    float orbit = 0;
+    bool animate = true;
+    int spinOnly = -1;
+    Uint32 staticObjects = 0;   // Bit per object index
+    int dynamicFPS = 0;
+    SDL_ScaleMode upscale = SDL_SCALEMODE_LINEAR;
+
+    // Buffers and settings of the software renderer (the options below change its settings)
+    RenderContext context;
+    InitRenderContext(&context);
+
+    // Read the command line
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
+        {
+            PrintUsage(argv[0]);
+            return 0;
+        }
+        else if (strcmp(arg, "--still") == 0)
+        {
+            animate = false;
+            continue;
+        }
+        else if (strcmp(arg, "--dirty") == 0)
+        {
+            SetDirtyRectRedraw(&context, true);
+            continue;
+        }
+        else if (strcmp(arg, "--pipeline") == 0)
+        {
+            SetFramePipelining(&context, true);
+            continue;
+        }
+        else if (strcmp(arg, "--coherent-sort") == 0)
+        {
+            SetCoherentSort(&context, true);
+            continue;
+        }
+        else if (strcmp(arg, "--smooth") == 0)
+        {
+            SetSmoothShading(&context, true);
+            continue;
+        }
+
+        if (value == NULL)
+        {
+            printf("Missing value for %s\n", arg);
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        i++;
+
+        if (strcmp(arg, "-s") == 0 || strcmp(arg, "--scene") == 0)
+        {
+            if (sceneFileCount < 16)
+                sceneFiles[sceneFileCount++] = value;
+        }
+        else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--camera") == 0)
+            cameraFile = value;
+        else if (strcmp(arg, "--orbit") == 0)
+            orbit = atof(value);
+        else if (strcmp(arg, "--spin") == 0)
+            spinOnly = atoi(value);
+        else if (strcmp(arg, "--static") == 0)
+        {
+            int index = atoi(value);
+            if (index < 0 || index >= 32)
+            {
+                printf("Static object index out of range: %s\n", value);
+                return 1;
+            }
+            staticObjects |= 1u << index;
+            SetStaticBSP(&context, true);
+        }
+        else if (strcmp(arg, "--dynamic") == 0)
+            dynamicFPS = atoi(value);
+        else if (strcmp(arg, "--layout") == 0)
+        {
+            if      (strcmp(value, "linear") == 0)  SetRasterLayout(&context.raster, RASTER_LAYOUT_LINEAR);
+            else if (strcmp(value, "blocked") == 0) SetRasterLayout(&context.raster, RASTER_LAYOUT_BLOCKED);
+            else
+            {
+                printf("Unknown layout: %s\n", value);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--state") == 0)
+        {
+            int state = RASTER_STATE_DEFAULT;
+
+            for (const char* flag = value; *flag != '\0'; )
+            {
+                size_t length = strcspn(flag, ",");
+
+                if      (length == 7 && strncmp(flag, "nodepth", 7) == 0)   state |= RASTER_STATE_NO_DEPTH;
+                else if (length == 9 && strncmp(flag, "wireframe", 9) == 0) state |= RASTER_STATE_WIREFRAME;
+                else if (length == 5 && strncmp(flag, "blend", 5) == 0)     state |= RASTER_STATE_BLEND;
+                else
+                {
+                    printf("Unknown render state: %.*s\n", (int)length, flag);
+                    return 1;
+                }
+
+                flag += length;
+                if (*flag == ',')
+                    flag++;
+            }
+
+            // Smooth shading has its own option, it needs the vertices lit too
+            SetRasterState(&context.raster, state | (GetSmoothShading(&context) ? RASTER_STATE_SMOOTH : 0));
+        }
+        else if (strcmp(arg, "--upscale") == 0)
+        {
+            if      (strcmp(value, "nearest") == 0)  upscale = SDL_SCALEMODE_NEAREST;
+            else if (strcmp(value, "bilinear") == 0) upscale = SDL_SCALEMODE_LINEAR;
+            else
+            {
+                printf("Unknown upscale filter: %s\n", value);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--threads") == 0)
+            SetRasterThreadCount(&context.raster, atoi(value));
+        else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--frames") == 0)
+            frames = atoi(value);
+        else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0)
+        {
+            if (!IsFramePattern(value))
+            {
+                printf("Output pattern needs exactly one %%d for the frame number (e.g. frame%%04d.ppm): %s\n", value);
+                return 1;
+            }
+            output = value;
+        }
+        else if (strcmp(arg, "-w") == 0 || strcmp(arg, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &program.width, &program.height) != 2 || program.width <= 0 || program.height <= 0)
+            {
+                printf("Size should look like 800x600\n");
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--mode") == 0)
+        {
+            if      (strcmp(value, "mesh") == 0)      renderMode = SOFTWARE_MODE_MESH;
+            else if (strcmp(value, "wireframe") == 0) renderMode = SOFTWARE_MODE_WIREFRAME;
+            else if (strcmp(value, "zbuffer") == 0)   renderMode = SOFTWARE_MODE_ZBUFFER;
+            else if (strcmp(value, "tiled") == 0)     renderMode = SOFTWARE_MODE_TILED;
+            else if (strcmp(value, "spans") == 0)     renderMode = SOFTWARE_MODE_SPANS;
+            else if (strcmp(value, "visibility") == 0) renderMode = SOFTWARE_MODE_VISIBILITY;
+            else
+            {
+                printf("Unknown render mode: %s\n", value);
+                return 1;
+            }
+        }
+        else
+        {
+            printf("Unknown option: %s\n", arg);
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (frames <= 0)
+        frames = 1;
+
+    // No window, so any video driver that doesn't need a display will do
+    SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "offscreen,dummy");
+    if (!SDL_Init(SDL_INIT_VIDEO))
+    {
+        printf("Error init: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    // With dynamic resolution the scene is drawn into a smaller surface and scaled up into outputSurface
+    DynamicResolution dynamicRes;
+    if (dynamicFPS > 0)
+        program.FPS = dynamicFPS;
+    InitDynamicResolution(&dynamicRes, program);
+    dynamicRes.enabled = (dynamicFPS > 0);
+    dynamicRes.filter = upscale;
+
+    SDL_Surface* surface = SDL_CreateSurface(program.width, program.height, SDL_PIXELFORMAT_RGBA8888);
+    SDL_Surface* outputSurface = dynamicRes.enabled ? SDL_CreateSurface(program.width, program.height, SDL_PIXELFORMAT_RGBA8888) : surface;
+    SDL_Renderer* renderer = SDL_CreateSoftwareRenderer(surface);
+    if (!surface || !outputSurface || !renderer)
+    {
+        printf("Could not create the offscreen renderer: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+
+
+    // Build the scene
+    // -----------------------------------------------------------------------
+    Scene scene = {0};
+    LoadSceneFiles(&scene, sceneFiles, sceneFileCount);
+    for (int i = 0; i < scene.objectCount; ++i)
+        scene.objects[i].isStatic = (staticObjects >> i) & 1;
+
+    if (scene.objectCount == 0)
+    {
+        printf("Nothing to render\n");
+        SDL_Quit();
+        return 1;
+    }
+
+
+
+    // Camera path
+    // -----------------------------------------------------------------------
+    Camera cam = {0};
+    scene.mainCam = &cam;
+
+    CameraKey* keys = NULL;
+    int keyCount = 0;
+
+    if (cameraFile != NULL)
+    {
+        keyCount = LoadCameraPath(cameraFile, &keys);
+        if (keyCount == 0)
+        {
+            printf("Camera path %s has no keys\n", cameraFile);
+            SDL_Quit();
+            return 1;
+        }
+    }
+    else if (orbit > 0)
+    {
+        // Once around the middle of the scene, always looking at it
+        keyCount = 33;
+        keys = malloc(sizeof(CameraKey) * keyCount);
+        Vector3 center = {0, 0, -1.5f};
+
+        for (int k = 0; k < keyCount; ++k)
+        {
+            float angle = 2.0f * 3.14159265f * k / (keyCount - 1);
+            keys[k].position = (Vector3){center.x + orbit * sinf(angle), center.y, center.z + orbit * cosf(angle)};
+            keys[k].yaw = angle;
+            keys[k].pitch = 0;
+        }
+    }
+    else
+    {
+        keyCount = 1;
+        keys = calloc(1, sizeof(CameraKey));
+    }
+
+
+
+    // Render
+    // -----------------------------------------------------------------------
+    Vector3 lightDirWorld = Vector3Normalize((Vector3){0.5f, -1.0f, 0.5f});
+    const float dt = 1.0f / 60.0f;
+    double totalMs = 0, minMs = 1e9, maxMs = 0;
+    char filename[512];
+
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        PlaceCamera(&cam, keys, keyCount, (frames > 1) ? (float)frame / (frames - 1) : 0.0f);
+
+        // Same spin as the windowed renderer, with a fixed time step so runs can be compared
+        if (animate)
+        {
+            float angle = 100.0f * (3.14159265f / 180.0f) * dt;
+            for (int i = 0; i < scene.objectCount; ++i)
+            {
+                if ((spinOnly < 0 || spinOnly == i) && !scene.objects[i].isStatic)
+                    RotateObjectY(&scene.objects[i], (i % 2 == 0) ? -angle : angle);
+            }
+        }
+
+        Uint64 start = SDL_GetPerformanceCounter();
+
+        WindowInfo view = program;
+        GetDynamicResolutionSize(&dynamicRes, program, &view.width, &view.height);
+        if (surface->w != view.width || surface->h != view.height)
+        {
+            SDL_DestroyRenderer(renderer);
+            SDL_DestroySurface(surface);
+            surface = SDL_CreateSurface(view.width, view.height, SDL_PIXELFORMAT_RGBA8888);
+            renderer = SDL_CreateSoftwareRenderer(surface);
+        }
+
+        SDL_SetRenderDrawColor(renderer, 40, 40, 40, 255);
+        if (GetDirtyRectRedraw(&context) == false)
+            ClearRenderSurface(renderer, surface, NULL);
+        RenderScene(&context, renderer, surface, view, &scene, lightDirWorld, renderMode);
+        SDL_RenderPresent(renderer);
+
+        if (dynamicRes.enabled)
+            PresentDynamicResolution(&dynamicRes, surface, outputSurface);
+
+        double ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+        UpdateDynamicResolution(&dynamicRes, ms);
+        totalMs += ms;
+        if (ms < minMs) minMs = ms;
+        if (ms > maxMs) maxMs = ms;
+
+        if (output != NULL)
+        {
+            snprintf(filename, sizeof(filename), output, frame);
+            SaveFrame(outputSurface, filename);
+        }
+    }
+
+    printf("%d frames at %dx%d: average %.3f ms (%.1f fps), min %.3f ms, max %.3f ms\n",
+           frames, program.width, program.height, totalMs / frames, 1000.0 * frames / totalMs, minMs, maxMs);
+    if (dynamicRes.enabled)
+        printf("Dynamic resolution: budget %.3f ms, last scale %.3f (%dx%d)\n", dynamicRes.budgetMs, dynamicRes.scale, surface->w, surface->h);
+
+
+
+    // Exiting functions
+    free(keys);
+    FreeRenderContext(&context);
+    SDL_DestroyRenderer(renderer);
+    if (outputSurface != surface)
+        SDL_DestroySurface(outputSurface);
+    SDL_DestroySurface(surface);
+    SDL_Quit();
+
+    return 0;
+}
@@ -7,6 +7,7 @@
 
 #include "structures.h"
 #include "softwareRender.h"
+#include "rasterizer.h"
 #include "penguin.h"
 #include "cube.h"
 
@@ -141,6 +142,7 @@ int main(int argc, char *argv[])
     Camera cam;
     cam.transform.position = (Vector3){0, 0, 0};
     cam.rotation = (Quaternion){0, 0, 0, 1};
+    cam.dirty = true;
     testScene.mainCam = &cam;
     // -----------------------------------------------------------------------
 
@@ -168,7 +170,7 @@ int main(int argc, char *argv[])
 
     // Values for camera speed
     float speed;
-    int forward, right, up;
+    int forward = 0, right = 0, up = 0;
 
     // Values for keyboard input:
     bool key_w = false;
@@ -183,10 +185,27 @@ int main(int argc, char *argv[])
     printf("Starting main loop\n");
     int quit = 0;
     bool mouseGrabbed = false;
-    bool Wireframe = false;
+    int renderMode = SOFTWARE_MODE_MESH;
     bool renderDebugRays = false;
+    bool validateSIMD = false;
+    bool drawToWindow = true;
     SDL_Event event;
 
+    // Drawing on demand (off until I is pressed): the loop sleeps until an event comes in and only draws a frame
+    // when the scene, the camera or a setting changed. The animation is paused while it's on.
+    bool onDemand = false;
+    bool redraw = true;
+    int framesToDraw = 0;
+
+    // Buffers and settings of the software renderer
+    RenderContext context;
+    InitRenderContext(&context);
+
+    // Internal resolution that follows the frame time (off until G is pressed)
+    DynamicResolution dynamicRes;
+    InitDynamicResolution(&dynamicRes, program);
+    WindowInfo view = program;
+
     // Variables for delta time
     uint64_t currentTime = SDL_GetPerformanceCounter();
     uint64_t lastTime = 0;
@@ -194,12 +213,23 @@ int main(int argc, char *argv[])
 
     while (quit == 0)
     {
+        // Nothing left to draw and no movement key held, so wait for the next event (the sleep doesn't count as frame time)
+        if (onDemand == true && framesToDraw == 0 && forward == 0 && right == 0 && up == 0)
+        {
+            SDL_WaitEventTimeout(NULL, 500);
+            currentTime = SDL_GetPerformanceCounter();
+        }
+
         lastTime = currentTime;
         currentTime = SDL_GetPerformanceCounter();
         dt = (double)((currentTime - lastTime) / (double)SDL_GetPerformanceFrequency());
 
         while (SDL_PollEvent(&event))
         {
+            // Everything but mouse movement can change what's on screen (Camera_MouseLook marks the camera itself)
+            if (event.type != SDL_EVENT_MOUSE_MOTION)
+                redraw = true;
+
             // If the window gets closed
             if (event.type == SDL_EVENT_QUIT)
                 quit = 1;
@@ -212,10 +242,12 @@ int main(int argc, char *argv[])
                 // For Software Renderer
                 if (SDL_GetRendererName(renderer)[0] == 's')
                 {
+                    // The old window surface is freed by SDL, the rendering section switches back to drawing into the new one
+                    SDL_DestroyRenderer(renderer);
+                    if (surface != windowSurface)
+                        SDL_DestroySurface(surface);
                     windowSurface = SDL_GetWindowSurface(window);
-                    SDL_DestroySurface(surface);
                     surface = SDL_CreateSurface(program.width, program.height, SDL_PIXELFORMAT_RGBA8888);
-                    SDL_DestroyRenderer(renderer);
                     renderer = SDL_CreateSoftwareRenderer(surface);
                 }
             }
@@ -230,10 +262,131 @@ int main(int argc, char *argv[])
                 }
                 if (event.key.scancode == SDL_SCANCODE_P)
                 {
-                    Wireframe = !Wireframe;
+                    renderMode = (renderMode + 1) % SOFTWARE_MODE_COUNT;
+                    printf("Render mode is now: ");
+                    if (renderMode == SOFTWARE_MODE_MESH)           printf("Mesh\n");
+                    else if (renderMode == SOFTWARE_MODE_WIREFRAME) printf("Wireframe\n");
+                    else if (renderMode == SOFTWARE_MODE_ZBUFFER)   printf("Z-buffer\n");
+                    else if (renderMode == SOFTWARE_MODE_SPANS)     printf("Span buffer\n");
+                    else if (renderMode == SOFTWARE_MODE_VISIBILITY) printf("Visibility buffer\n");
+                    else                                            printf("Tiled z-buffer (%d threads)\n", SDL_GetNumLogicalCPUCores());
+                }
+                if (event.key.scancode == SDL_SCANCODE_K)
+                {
+                    // Cycle scalar -> SSE2 -> AVX2 (skipping what the CPU doesn't have)
+                    int level = GetRasterSIMD() + 1;
+                    if (level > GetBestRasterSIMD())
+                        level = RASTER_SIMD_SCALAR;
+                    SetRasterSIMD(level);
+
+                    printf("Rasterizer kernel: ");
+                    if (level == RASTER_SIMD_AVX2)      printf("AVX2\n");
+                    else if (level == RASTER_SIMD_SSE2) printf("SSE2\n");
+                    else                                printf("Scalar\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_T)
+                {
+                    if (GetRasterLayout(&context.raster) == RASTER_LAYOUT_LINEAR) SetRasterLayout(&context.raster, RASTER_LAYOUT_BLOCKED);
+                    else                                                          SetRasterLayout(&context.raster, RASTER_LAYOUT_LINEAR);
+
+                    printf("Z-buffer memory layout: ");
+                    if (GetRasterLayout(&context.raster) == RASTER_LAYOUT_BLOCKED) printf("8x8 blocks\n");
+                    else                                                           printf("Linear\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_O)
+                {
+                    drawToWindow = !drawToWindow;
+                    printf("Draw straight into the window surface: ");
+                    if (drawToWindow == false)                         printf("Off\n");
+                    else if (CanDrawToWindowSurface(windowSurface))    printf("On\n");
+                    else                                               printf("On (not supported by this window, copying instead)\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_V)
+                {
+                    validateSIMD = !validateSIMD;
+                    SetRasterValidateSIMD(&context.raster, validateSIMD);
+                    printf("SIMD validation (z-buffer mode): ");
+                    if (validateSIMD == true) printf("On\n");
+                    else                      printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_X)
+                {
+                    SetRasterState(&context.raster, GetRasterState(&context.raster) ^ RASTER_STATE_WIREFRAME);
+                    printf("Rasterizer wireframe (z-buffer modes): ");
+                    if (GetRasterState(&context.raster) & RASTER_STATE_WIREFRAME) printf("On\n");
+                    else                                           printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_H)
+                {
+                    SetRasterHiZ(&context.raster, !GetRasterHiZ(&context.raster));
+                    printf("Hi-z culling: ");
+                    if (GetRasterHiZ(&context.raster) == true) printf("On\n");
+                    else                        printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_B)
+                {
+                    SetBackFaceCulling(&context, !GetBackFaceCulling(&context));
+                    printf("Back-face culling: ");
+                    if (GetBackFaceCulling(&context) == true) printf("On\n");
+                    else                              printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_N)
+                {
+                    SetSmoothShading(&context, !GetSmoothShading(&context));
+                    printf("Smooth shading: ");
+                    if (GetSmoothShading(&context) == true) printf("On\n");
+                    else                            printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_R)
+                {
+                    SetDirtyRectRedraw(&context, !GetDirtyRectRedraw(&context));
+                    printf("Dirty rectangle redraw (z-buffer modes): ");
+                    if (GetDirtyRectRedraw(&context) == true) printf("On\n");
+                    else                              printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_C)
+                {
+                    SetCoherentSort(&context, !GetCoherentSort(&context));
+                    printf("Coherent sort (mesh mode): ");
+                    if (GetCoherentSort(&context) == true) printf("On\n");
+                    else                           printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_F)
+                {
+                    SetFramePipelining(&context, !GetFramePipelining(&context));
+                    printf("Pipelined frames: ");
+                    if (GetFramePipelining(&context) == true) printf("On\n");
+                    else                              printf("Off\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_G)
+                {
+                    // Off -> nearest -> bilinear -> off
+                    if (dynamicRes.enabled == false)
+                    {
+                        InitDynamicResolution(&dynamicRes, program);
+                        dynamicRes.enabled = true;
+                        dynamicRes.filter = SDL_SCALEMODE_NEAREST;
+                    }
+                    else if (dynamicRes.filter == SDL_SCALEMODE_NEAREST)
+                        dynamicRes.filter = SDL_SCALEMODE_LINEAR;
+                    else
+                        dynamicRes.enabled = false;
+
+                    printf("Dynamic resolution: ");
+                    if (dynamicRes.enabled == false)                       printf("Off\n");
+                    else if (dynamicRes.filter == SDL_SCALEMODE_NEAREST)   printf("On (nearest)\n");
+                    else                                                   printf("On (bilinear)\n");
+                }
+                if (event.key.scancode == SDL_SCANCODE_I)
+                {
+                    onDemand = !onDemand;
+                    printf("Draw on demand: ");
+                    if (onDemand == true) printf("On\n");
+                    else                  printf("Off\n");
                 }
                 if (event.key.scancode == SDL_SCANCODE_L)
                 {
+                    InvalidateDirtyRects(&context);
                     renderDebugRays = !renderDebugRays;
                     printf("Render Debug Rays: ");
                     if (renderDebugRays == true) printf("On\n");
@@ -254,10 +407,18 @@ int main(int argc, char *argv[])
                     Ray ray = CreateRay(&cam);
                     // ray.direction = Vector3Scale(ray.direction, -1.0f);
                     float dist;
-                    Object* hitObj = RaycastScene(ray, GlobalObjects, GlobalObjectCount, &dist);
-
-                    if (hitObj)
-                        printf("Hit object: %s at distance: %f\n", hitObj->name, dist);
+                    int hitIndex, hitFace;
+
+                    // The visibility buffer already knows what's in the middle of the last frame
+                    if (renderMode == SOFTWARE_MODE_VISIBILITY && PickVisibilityBuffer(&context, view.width / 2, view.height / 2, &hitIndex, &hitFace))
+                        printf("Hit object: %s face: %d\n", testScene.objects[hitIndex].name, hitFace);
+                    else
+                    {
+                        Object* hitObj = RaycastScene(ray, GlobalObjects, GlobalObjectCount, &dist);
+
+                        if (hitObj)
+                            printf("Hit object: %s at distance: %f\n", hitObj->name, dist);
+                    }
                     
                     AddRay(ray);
                 }
@@ -303,29 +464,76 @@ int main(int argc, char *argv[])
         // angle = 3.14159265 / 128;
         angle = 100.0f * (3.14159265f / 180.0f) * dt;
 
+        //  Rotate object for an animation
+        // RotateObjectZ(&GlobalObjects[0], -angle);
+        if (onDemand == false)
+        {
+            RotateObjectX(&testScene.objects[1], angle);
+            RotateObjectY(&testScene.objects[0], -angle);
+        }
+
+        // Anything that changed needs a frame, two with pipelined frames since they show the scene one frame late
+        if (IsSceneDirty(&testScene) == true)
+        {
+            ClearSceneDirty(&testScene);
+            redraw = true;
+        }
+        if (redraw == true)
+        {
+            framesToDraw = (GetFramePipelining(&context) == true) ? 2 : 1;
+            redraw = false;
+        }
+        if (onDemand == true && framesToDraw == 0)
+            continue;
+        if (framesToDraw > 0)
+            framesToDraw--;
+
 
 
         /////////////////////////
         /// Rendering section ///
         /////////////////////////
 
-        // Set Background
-        SDL_SetRenderDrawColor(renderer, 40, 40, 40, 255);
-        SDL_RenderClear(renderer);
+        Uint64 renderStart = SDL_GetPerformanceCounter();
 
-        //  Rotate object for an animation
-        // RotateObjectZ(&GlobalObjects[0], -angle);
-        RotateObjectX(&testScene.objects[1], angle);
-        RotateObjectY(&testScene.objects[0], -angle);
+        // The software renderer draws at the dynamic resolution size (the window size when it's off).
+        // At full size it draws straight into the window surface when it can, so there's nothing to copy or convert.
+        view = program;
+        if (SDL_GetRendererName(renderer)[0] == 's')
+        {
+            GetDynamicResolutionSize(&dynamicRes, program, &view.width, &view.height);
+            bool direct = drawToWindow && view.width == windowSurface->w && view.height == windowSurface->h &&
+                          CanDrawToWindowSurface(windowSurface);
+
+            if (direct ? surface != windowSurface : (surface == windowSurface || surface->w != view.width || surface->h != view.height))
+            {
+                SDL_DestroyRenderer(renderer);
+                if (surface != windowSurface)
+                    SDL_DestroySurface(surface);
+                surface = direct ? windowSurface : SDL_CreateSurface(view.width, view.height, SDL_PIXELFORMAT_RGBA8888);
+                renderer = SDL_CreateSoftwareRenderer(surface);
+            }
+        }
 
+        // Set Background (with dirty rectangles RenderScene clears only what it redraws)
+        SDL_SetRenderDrawColor(renderer, 40, 40, 40, 255);
+        if (GetDirtyRectRedraw(&context) == false)
+            ClearRenderSurface(renderer, (SDL_GetRendererName(renderer)[0] == 's') ? surface : NULL, NULL);
 
-        if (renderDebugRays == true && GlobalRayCount > 0)
+        if (renderDebugRays == true && GlobalRayCount > 0 && GetDirtyRectRedraw(&context) == false)
         {
-            RenderDebugRays(renderer, program, testScene.mainCam, GlobalRays, GlobalRayCount);
+            RenderDebugRays(renderer, view, testScene.mainCam, GlobalRays, GlobalRayCount);
         }
         
         // Render all objects
-        RenderScene(renderer, program, &testScene, lightDirWorld, Wireframe);
+        RenderScene(&context, renderer, surface, view, &testScene, lightDirWorld, renderMode);
+
+        // RenderScene would clear the rays away, so they go on top and the next frame is drawn in full
+        if (renderDebugRays == true && GlobalRayCount > 0 && GetDirtyRectRedraw(&context) == true)
+        {
+            RenderDebugRays(renderer, view, testScene.mainCam, GlobalRays, GlobalRayCount);
+            InvalidateDirtyRects(&context);
+        }
         
 
 
@@ -336,17 +544,30 @@ int main(int argc, char *argv[])
         
         if (SDL_GetRendererName(renderer)[0] == 's')
         {
-            SDL_BlitSurface(surface, NULL, windowSurface, NULL);
+            if (surface != windowSurface)
+                PresentDynamicResolution(&dynamicRes, surface, windowSurface);
             SDL_UpdateWindowSurface(window);
         }
 
-        SDL_Delay(1000/program.FPS);
+        // With dynamic resolution the frame time drives the internal size, and only what's left of the budget is waited
+        double frameMs = (double)(SDL_GetPerformanceCounter() - renderStart) * 1000.0 / SDL_GetPerformanceFrequency();
+        if (dynamicRes.enabled == true)
+        {
+            UpdateDynamicResolution(&dynamicRes, frameMs);
+            if (frameMs < dynamicRes.budgetMs)
+                SDL_Delay((Uint32)(dynamicRes.budgetMs - frameMs));
+        }
+        else
+            SDL_Delay(1000/program.FPS);
     }
 
 
     // Exiting functions
     printf("Quitting SDL\n");
+    FreeRenderContext(&context);
     SDL_DestroyRenderer(renderer);
+    if (surface != windowSurface)
+        SDL_DestroySurface(surface);
     SDL_DestroyWindow(window);
 
     SDL_Quit();
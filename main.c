@@ -98,7 +98,8 @@ int main(int argc, char *argv[])
     glDepthFunc(GL_LESS);
     printf("Loaded GLAD and enabled depth testing\n");
 
-    unsigned int shaderProgram = CreateShaderProgram();
+    GLRenderContext renderContext;
+    InitRenderContextGL(&renderContext);
     printf("set up chaders\n");
 
 
@@ -155,6 +156,7 @@ int main(int argc, char *argv[])
     Camera cam;
     cam.transform.position = (Vector3){0, 0, 0};
     cam.rotation = (Quaternion){0, 0, 0, 1};
+    cam.dirty = true;
     testScene.mainCam = &cam;
     // -----------------------------------------------------------------------
 
@@ -181,7 +183,7 @@ int main(int argc, char *argv[])
 
     // Values for camera speed
     float speed;
-    int forward, right, up;
+    int forward = 0, right = 0, up = 0;
 
     // Values for keyboard input:
     bool key_w = false;
@@ -200,6 +202,11 @@ int main(int argc, char *argv[])
     bool renderDebugRays = false;
     SDL_Event event;
 
+    // Drawing on demand (off until I is pressed): the loop sleeps until an event comes in and only draws a frame
+    // when the scene, the camera or a setting changed. The animation is paused while it's on.
+    bool onDemand = false;
+    bool redraw = true;
+
     // Variables for delta time
     uint64_t currentTime = SDL_GetPerformanceCounter();
     uint64_t lastTime = 0;
@@ -207,6 +214,13 @@ int main(int argc, char *argv[])
 
     while (quit == false)
     {
+        // Nothing left to draw and no movement key held, so wait for the next event (the sleep doesn't count as frame time)
+        if (onDemand == true && redraw == false && forward == 0 && right == 0 && up == 0)
+        {
+            SDL_WaitEventTimeout(NULL, 500);
+            currentTime = SDL_GetPerformanceCounter();
+        }
+
         lastTime = currentTime;
         currentTime = SDL_GetPerformanceCounter();
         dt = (double)((currentTime - lastTime) / (double)SDL_GetPerformanceFrequency());
@@ -214,6 +228,10 @@ int main(int argc, char *argv[])
         // printf("Polling events\n");
         while (SDL_PollEvent(&event))
         {
+            // Everything but mouse movement can change what's on screen (Camera_MouseLook marks the camera itself)
+            if (event.type != SDL_EVENT_MOUSE_MOTION)
+                redraw = true;
+
             // If the window gets closed
             if (event.type == SDL_EVENT_QUIT)
                 quit = true;
@@ -244,6 +262,13 @@ int main(int argc, char *argv[])
                     else if (renderMode == 1) printf("Wireframe\n");
                     else                      printf("Dots\n");
                 }
+                if (event.key.scancode == SDL_SCANCODE_I)
+                {
+                    onDemand = !onDemand;
+                    printf("Draw on demand: ");
+                    if (onDemand == true) printf("On\n");
+                    else                  printf("Off\n");
+                }
                 if (event.key.scancode == SDL_SCANCODE_L)
                 {
                     renderDebugRays = !renderDebugRays;
@@ -252,7 +277,7 @@ int main(int argc, char *argv[])
                     else                         printf("Off\n");
 
                     if (renderDebugRays == true)
-                        InitDebugLine();
+                        InitDebugLine(&renderContext);
                 }
             }
 
@@ -293,10 +318,6 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (mouseGrabbed == true)
-            SDL_WarpMouseInWindow(window, program.width/2, program.height/2);
-
-
         // printf("Getting keyboard input\n");
         // Get keyboard state and determine input
         const bool* state = SDL_GetKeyboardState(NULL);
@@ -319,23 +340,40 @@ int main(int argc, char *argv[])
         // Setting animation variables
         angle = 100.0f * (3.14159265f / 180.0f) * (float)dt;
 
+        //  Rotate object for an animation
+        // RotateObjectZ(&GlobalObjects[1], -angle);
+        if (onDemand == false)
+        {
+            RotateObjectX(&testScene.objects[1], angle);
+            RotateObjectY(&testScene.objects[0], -angle);
+        }
+
+        // Only draw when something changed
+        if (IsSceneDirty(&testScene) == true)
+        {
+            ClearSceneDirty(&testScene);
+            redraw = true;
+        }
+        if (onDemand == true && redraw == false)
+            continue;
+        redraw = false;
+
+        // Warping the mouse back can send another motion event, so it's only done for frames that get drawn
+        if (mouseGrabbed == true)
+            SDL_WarpMouseInWindow(window, program.width/2, program.height/2);
+
 
 
         /////////////////////////
         /// Rendering section ///
         /////////////////////////
 
-        //  Rotate object for an animation
-        // RotateObjectZ(&GlobalObjects[1], -angle);
-        RotateObjectX(&testScene.objects[1], angle);
-        RotateObjectY(&testScene.objects[0], -angle);
-
         // // Render all objects
         if (renderDebugRays == true && GlobalRayCount > 0)
         {
-            UpdateDebugRay(GlobalRays, GlobalRayCount);
+            UpdateDebugRay(&renderContext, GlobalRays, GlobalRayCount);
         }
-        RenderSceneGL(window, &testScene, shaderProgram, lightDirWorld, renderMode, renderDebugRays, GlobalRayCount);
+        RenderSceneGL(&renderContext, window, &testScene, lightDirWorld, renderMode, renderDebugRays, GlobalRayCount);
 
         SDL_Delay(1000/program.FPS);
     }
@@ -343,6 +381,7 @@ int main(int argc, char *argv[])
 
     // Exiting functions
     printf("Quitting SDL\n");
+    FreeRenderContextGL(&renderContext);
     SDL_DestroyWindow(window);
 
     SDL_Quit();
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "structures.h"
+#include "offlineRender.h"
+#include "rasterizer.h"
+#include "penguin.h"
+#include "SDL3/SDL.h"
+
+
+//
+// Builds the scene out of the files given on the command line
+//
+int LoadSceneFiles(Scene* scene, const char** files, int fileCount)
+{
+    const char* defaultFiles[2] = {"penguin", "SampleObjects/Sword-lowpoly.obj"};
+    Color colors[4] = {{240, 10, 10, 255}, {10, 245, 10, 255}, {40, 80, 240, 255}, {240, 200, 40, 255}};
+
+    if (fileCount == 0)
+    {
+        files = defaultFiles;
+        fileCount = 2;
+    }
+
+    for (int i = 0; i < fileCount; ++i)
+    {
+        Color color = colors[i % 4];
+        Object obj = CreateObject((char*)files[i]);
+
+        if (strcmp(files[i], "penguin") == 0)
+        {
+            obj.mesh = CreateMesh(verts, sizeof(verts) / sizeof(verts[0]), faces, sizeof(faces) / sizeof(faces[0]), color);
+        }
+        else
+        {
+            // load_obj_mesh doesn't check the file, so do it here
+            FILE* check = fopen(files[i], "r");
+            if (!check)
+            {
+                printf("Could not open %s, skipping it\n", files[i]);
+                continue;
+            }
+            fclose(check);
+
+            obj.mesh = load_obj_mesh(files[i], color);
+
+            // Files come in all sizes, scale them so the biggest side is 1 unit
+            Vector3 low = obj.mesh->vertices[0], high = obj.mesh->vertices[0];
+            for (int k = 1; k < obj.mesh->vertexCount; ++k)
+            {
+                Vector3 v = obj.mesh->vertices[k];
+                low  = (Vector3){fminf(low.x, v.x), fminf(low.y, v.y), fminf(low.z, v.z)};
+                high = (Vector3){fmaxf(high.x, v.x), fmaxf(high.y, v.y), fmaxf(high.z, v.z)};
+            }
+            float size = fmaxf(high.x - low.x, fmaxf(high.y - low.y, high.z - low.z));
+            if (size > 0)
+                obj.transform.scale = (Vector3){1.0f / size, 1.0f / size, 1.0f / size};
+        }
+
+        // Line the objects up next to each other
+        obj.transform.position.x = 1.5f * (scene->objectCount - (fileCount - 1) * 0.5f);
+        AddObjectToScene(scene, &obj);
+        printf("Added %s (%d faces)\n", obj.name, obj.mesh->facesCount);
+    }
+
+    return scene->objectCount;
+}
+
+
+
+//
+// Checks that an output pattern only has one %d in it (or %04d and so on)
+//
+bool IsFramePattern(const char* pattern)
+{
+    int conversions = 0;
+
+    for (const char* c = pattern; *c != '\0'; ++c)
+    {
+        if (*c != '%')
+            continue;
+
+        c++;
+        if (*c == '%')
+            continue;
+
+        if (*c == '0')
+            c++;
+        while (*c >= '0' && *c <= '9')
+            c++;
+
+        if (*c != 'd')
+            return false;
+        conversions++;
+    }
+
+    return conversions == 1;
+}
+
+
+
+//
+// Writes a surface as a binary PPM (P6) or as raw RGBA bytes
+//
+bool SaveFrame(SDL_Surface* surface, const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+    {
+        printf("Could not write %s\n", filename);
+        return false;
+    }
+
+    const char* extension = strrchr(filename, '.');
+    bool raw = (extension != NULL && strcmp(extension, ".rgba") == 0);
+
+    if (!raw)
+        fprintf(file, "P6\n%d %d\n255\n", surface->w, surface->h);
+
+    const SDL_PixelFormatDetails* format = SDL_GetPixelFormatDetails(surface->format);
+    Color* colors = malloc(surface->w * sizeof(Color));
+    Uint8* row = malloc(surface->w * 3);
+
+    for (int y = 0; y < surface->h; ++y)
+    {
+        Uint32* pixels = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch);
+        UnmapRasterPixels(format, pixels, colors, surface->w);
+
+        // Color is already r, g, b, a in memory, PPM only wants r, g, b
+        if (raw)
+        {
+            fwrite(colors, sizeof(Color), surface->w, file);
+            continue;
+        }
+
+        for (int x = 0; x < surface->w; ++x)
+        {
+            row[x * 3 + 0] = colors[x].r;
+            row[x * 3 + 1] = colors[x].g;
+            row[x * 3 + 2] = colors[x].b;
+        }
+        fwrite(row, 1, surface->w * 3, file);
+    }
+
+    free(colors);
+    free(row);
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef OFFLINERENDER_H
+#define OFFLINERENDER_H
+
+#include "structures.h"
+#include "SDL3/SDL.h"
+
+
+// Helpers shared by the renderers without a window (PrismCoreHeadless and PrismCoreBatch):
+// building a scene from the command line's files and saving what was rendered.
+
+
+// Adds an object for every file ("penguin" is the built in model), scaled so its biggest side is 1 unit
+// and lined up next to the others. With no files it loads the penguin and the low poly sword.
+// Files that can't be opened are skipped, returns the number of objects in the scene.
+int LoadSceneFiles(Scene* scene, const char** files, int fileCount);
+
+// True if an output pattern has exactly one integer conversion (%d, with an optional width like %04d)
+// and nothing else but %%, so it's safe to hand to snprintf and every image gets its own file
+bool IsFramePattern(const char* pattern);
+
+// Writes a surface as a binary PPM (P6), or as raw RGBA bytes if the file name ends in .rgba
+bool SaveFrame(SDL_Surface* surface, const char* filename);
+
+
+#endif
@@ -0,0 +1,2666 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "structures.h"
+#include "rasterizer.h"
+#include "SDL3/SDL.h"
+#include "SDL3/SDL_intrin.h"
+
+
+// Worker thread for tiled rasterizing, with its own tile of color, depth and hi-z memory
+struct RasterWorker
+{
+    SDL_Thread* thread;
+    RasterContext* ctx;
+    Uint32 color[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+    float depth[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+    RasterHiZCell hiz[(RASTER_TILE_SIZE / RASTER_HIZ_SIZE) * (RASTER_TILE_SIZE / RASTER_HIZ_SIZE)];
+};
+
+// Steps of a tiled frame, every worker does its part of one before the next one starts
+enum
+{
+    RASTER_PHASE_SETUP,     // Set up slices of the triangles and count them into each slice's bins
+    RASTER_PHASE_BIN,       // File the same slices into the bins
+    RASTER_PHASE_DRAW       // Draw tiles
+};
+
+// Which inner loop to use, for every context (-1 picks the best one the first time it's needed).
+// Atomic since contexts on different threads can be the first to need it at the same time.
+SDL_AtomicInt rasterSIMD = { -1 };
+
+
+
+////////////////////////////
+// Depth buffer functions //
+////////////////////////////
+
+
+//
+// Fills in a raster target from a surface.
+// The depth buffer is shared between frames and only reallocated when the size changes.
+//
+bool GetRasterTarget(RasterContext* ctx, SDL_Surface* surface, RasterTarget* target)
+{
+    if (surface == NULL || surface->pixels == NULL)
+        return false;
+
+    if (SDL_BYTESPERPIXEL(surface->format) != 4)
+    {
+        printf("Rasterizer needs a 32 bit surface\n");
+        return false;
+    }
+
+    return GetRasterBufferTarget(ctx, (Uint32*)surface->pixels, surface->pitch / 4, surface->w, surface->h, target);
+}
+
+
+
+//
+// Same as GetRasterTarget for any buffer of 32 bit values (pitch is in values, not bytes)
+//
+bool GetRasterBufferTarget(RasterContext* ctx, Uint32* pixels, int pitch, int width, int height, RasterTarget* target)
+{
+    if (pixels == NULL || width <= 0 || height <= 0)
+        return false;
+
+    // Big enough for the blocked layout too, which pads the edges out to whole cells
+    int cells = ((width + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE) * ((height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE);
+    int size = cells * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE;
+    if (size > ctx->depthBufferSize)
+    {
+        free(ctx->depthBuffer);
+        ctx->depthBuffer = malloc(sizeof(float) * size);
+
+        if (!ctx->depthBuffer)
+        {
+            printf("Failed to allocate depth buffer\n");
+            ctx->depthBufferSize = 0;
+            return false;
+        }
+
+        ctx->depthBufferSize = size;
+    }
+
+    if (cells > ctx->hizBufferSize)
+    {
+        free(ctx->hizBuffer);
+        ctx->hizBuffer = malloc(sizeof(RasterHiZCell) * cells);
+        ctx->hizBufferSize = ctx->hizBuffer ? cells : 0;
+    }
+
+    target->pixels = pixels;
+    target->pitch = pitch;
+    target->depth = ctx->depthBuffer;
+    target->hiz = ctx->hiZ ? ctx->hizBuffer : NULL;
+    target->originX = 0;
+    target->originY = 0;
+    target->width = width;
+    target->height = height;
+    target->blocked = false;
+
+    return true;
+}
+
+
+
+//
+// Clears the depth buffer. 0 is "infinitely far", since the buffer holds 1/z
+// A blocked target with hi-z only resets the cells, each cell's depth is cleared
+// the first time something is drawn into it (see RasterBlockVisible).
+//
+void ClearDepthBuffer(RasterTarget* target)
+{
+    int cells = ((target->width + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE) * ((target->height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE);
+
+    if (!target->blocked)
+        FillRasterDepth(target->depth, target->width * target->height, 0.0f);
+    else if (target->hiz == NULL)
+        FillRasterDepth(target->depth, cells * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE, 0.0f);
+
+    if (target->hiz != NULL)
+        memset(target->hiz, 0, sizeof(RasterHiZCell) * cells);
+}
+
+
+
+//
+// Turns hierarchical depth culling on or off. The picture is the same either way.
+//
+void SetRasterHiZ(RasterContext* ctx, bool enabled)
+{
+    ctx->hiZ = enabled;
+}
+
+bool GetRasterHiZ(const RasterContext* ctx)
+{
+    return ctx->hiZ;
+}
+
+
+
+//
+// Starts a context with no buffers or workers yet, in the default state with hi-z on
+//
+void InitRasterContext(RasterContext* ctx)
+{
+    memset(ctx, 0, sizeof(RasterContext));
+    ctx->hiZ = true;
+    ctx->layout = RASTER_LAYOUT_LINEAR;
+    ctx->state = RASTER_STATE_DEFAULT;
+    ctx->spanFree = -1;
+}
+
+
+
+//
+// Frees the depth buffer, the tile bins, and stops the worker threads. The settings stay.
+//
+void FreeRasterContext(RasterContext* ctx)
+{
+    SetRasterThreadCount(ctx, 0);
+
+    free(ctx->depthBuffer);
+    ctx->depthBuffer = NULL;
+    ctx->depthBufferSize = 0;
+
+    free(ctx->blockedColor);
+    ctx->blockedColor = NULL;
+    ctx->blockedColorSize = 0;
+
+    free(ctx->hizBuffer);
+    ctx->hizBuffer = NULL;
+    ctx->hizBufferSize = 0;
+
+    free(ctx->setupBuffer);
+    ctx->setupBuffer = NULL;
+    ctx->setupCount = ctx->setupCapacity = 0;
+
+    free(ctx->binStart);
+    free(ctx->binFill);
+    free(ctx->binTris);
+    ctx->binStart = NULL;
+    ctx->binFill = NULL;
+    ctx->binTris = NULL;
+    ctx->binTileCapacity = ctx->binFillCapacity = ctx->binTrisCapacity = 0;
+
+    free(ctx->spanRows);
+    free(ctx->spanPool);
+    ctx->spanRows = NULL;
+    ctx->spanPool = NULL;
+    ctx->spanRowCapacity = ctx->spanPoolCount = ctx->spanPoolCapacity = 0;
+    ctx->spanFree = -1;
+
+    SetRasterValidateSIMD(ctx, false);
+}
+
+
+
+
+
+
+
+
+
+
+//////////////////////////
+// Triangle rasterizing //
+//////////////////////////
+
+
+//
+// Projects a camera space triangle to the screen and computes its edge functions.
+// Returns false if the triangle has no area or is completely off screen.
+//
+bool SetupRasterTriangle(const RasterContext* ctx, const RenderTriangle* tri, WindowInfo program, Uint32 color, RasterSetup* setup)
+{
+    // Same projection as Screen(), done inline since clipped vertices can sit on the near plane
+    float scale = (program.width < program.height) ? program.width / 2.0f : program.height / 2.0f;
+
+    float sx[3], sy[3], iz[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        iz[k] = 1.0f / tri->v[k].z;
+        sx[k] =  tri->v[k].x * iz[k] * scale + program.width / 2.0f;
+        sy[k] = -tri->v[k].y * iz[k] * scale + program.height / 2.0f;
+    }
+
+    // Signed area, flip the winding so it's always positive
+    float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sy[1] - sy[0]) * (sx[2] - sx[0]);
+    if (area == 0.0f || isnan(area))
+        return false;
+
+    bool flipped = area < 0;
+    if (flipped)
+    {
+        float t;
+        t = sx[1]; sx[1] = sx[2]; sx[2] = t;
+        t = sy[1]; sy[1] = sy[2]; sy[2] = t;
+        t = iz[1]; iz[1] = iz[2]; iz[2] = t;
+        area = -area;
+    }
+
+    // Bounding box, clamped to the screen
+    float minX = fminf(sx[0], fminf(sx[1], sx[2]));
+    float maxX = fmaxf(sx[0], fmaxf(sx[1], sx[2]));
+    float minY = fminf(sy[0], fminf(sy[1], sy[2]));
+    float maxY = fmaxf(sy[0], fmaxf(sy[1], sy[2]));
+
+    if (maxX < 0 || maxY < 0 || minX >= program.width || minY >= program.height)
+        return false;
+
+    setup->minX = (minX < 0) ? 0 : (int)minX;
+    setup->minY = (minY < 0) ? 0 : (int)minY;
+    setup->maxX = (maxX > program.width - 1)  ? program.width - 1  : (int)maxX;
+    setup->maxY = (maxY > program.height - 1) ? program.height - 1 : (int)maxY;
+
+    // Edge functions (edge i is opposite vertex i)
+    for (int i = 0; i < 3; ++i)
+    {
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+
+        setup->A[i] = sy[a] - sy[b];
+        setup->B[i] = sx[b] - sx[a];
+        setup->C[i] = sx[a] * sy[b] - sy[a] * sx[b];
+
+        // Top-left fill rule so shared edges are only drawn once
+        setup->topLeft[i] = (setup->A[i] > 0) || (setup->A[i] == 0 && setup->B[i] > 0);
+    }
+
+    // Plane equation for 1/z, which is linear in screen space
+    setup->x0 = sx[0];
+    setup->y0 = sy[0];
+    setup->z0 = iz[0];
+    setup->zdx = (setup->A[0] * iz[0] + setup->A[1] * iz[1] + setup->A[2] * iz[2]) / area;
+    setup->zdy = (setup->B[0] * iz[0] + setup->B[1] * iz[1] + setup->B[2] * iz[2]) / area;
+
+    // For hi-z: covers rounding in the biggest terms of the per pixel plane math
+    setup->zPad = 1e-5f * (fabsf(setup->z0) + fabsf(setup->zdx) * (maxX - minX + 1) + fabsf(setup->zdy) * (maxY - minY + 1));
+
+    setup->color = color;
+    setup->state = ctx->state;
+    setup->invAlpha = 255 - tri->color.a;
+
+    // Color planes for Gouraud shading, in the same vertex order as the edges (blended colors are premultiplied)
+    if (ctx->state & RASTER_STATE_SMOOTH)
+    {
+        int order[3] = { 0, flipped ? 2 : 1, flipped ? 1 : 2 };
+        float alpha = (ctx->state & RASTER_STATE_BLEND) ? tri->color.a / 255.0f : 1.0f;
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float value[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                Color vc = tri->vertexColors[order[k]];
+                value[k] = ((c == 0) ? vc.r : (c == 1) ? vc.g : vc.b) * alpha;
+            }
+
+            setup->shade0[c] = value[0];
+            setup->shadeDx[c] = (setup->A[0] * value[0] + setup->A[1] * value[1] + setup->A[2] * value[2]) / area;
+            setup->shadeDy[c] = (setup->B[0] * value[0] + setup->B[1] * value[1] + setup->B[2] * value[2]) / area;
+        }
+    }
+
+    // Turns edge values into distances in pixels
+    if (ctx->state & RASTER_STATE_WIREFRAME)
+    {
+        for (int i = 0; i < 3; ++i)
+            setup->edgeScale[i] = 1.0f / sqrtf(setup->A[i] * setup->A[i] + setup->B[i] * setup->B[i]);
+    }
+
+    return true;
+}
+
+
+
+//
+// Formats with 8 bits per channel (and 8 or no bits of alpha) are just the bytes of a Color
+// moved around, everything else goes through SDL one pixel at a time.
+//
+static bool IsByteChannelFormat(const SDL_PixelFormatDetails* format)
+{
+    return format != NULL && format->bytes_per_pixel == 4 &&
+           format->Rbits == 8 && format->Gbits == 8 && format->Bbits == 8 && (format->Abits == 8 || format->Abits == 0);
+}
+
+
+
+//
+// Where the smooth state puts the interpolated channels in a pixel. Formats that aren't 8 bits per channel
+// draw the triangle flat instead, with the color it was set up with.
+//
+void SetupRasterShading(const SDL_PixelFormatDetails* format, RasterSetup* setup)
+{
+    if (!(setup->state & RASTER_STATE_SMOOTH))
+        return;
+
+    if (!IsByteChannelFormat(format))
+    {
+        setup->state &= ~RASTER_STATE_SMOOTH;
+        return;
+    }
+
+    setup->shadeShift[0] = format->Rshift;
+    setup->shadeShift[1] = format->Gshift;
+    setup->shadeShift[2] = format->Bshift;
+    setup->shadeAlpha = ((Uint32)(255 - setup->invAlpha) << format->Ashift) & format->Amask;
+}
+
+
+
+//
+// Checks if a triangle can touch any pixel center inside a rectangle of pixels (inclusive).
+// Uses the corner of the rectangle that is furthest inside each edge.
+//
+// (Forced inline so the SIMD kernels get their own copy instead of calling out of vector code)
+SDL_FORCE_INLINE bool RectTouchesTriangle(const RasterSetup* setup, int tileX0, int tileY0, int tileX1, int tileY1)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        float x = (setup->A[i] > 0) ? tileX1 + 0.5f : tileX0 + 0.5f;
+        float y = (setup->B[i] > 0) ? tileY1 + 0.5f : tileY0 + 0.5f;
+
+        if (setup->A[i] * x + setup->B[i] * y + setup->C[i] < 0)
+            return false;
+    }
+
+    return true;
+}
+
+bool TriangleTouchesTile(const RasterSetup* setup, int tileX0, int tileY0, int tileX1, int tileY1)
+{
+    return RectTouchesTriangle(setup, tileX0, tileY0, tileX1, tileY1);
+}
+
+
+
+//
+// Clips a triangle's bounding box to the area covered by a target.
+// Returns false if nothing is left.
+//
+bool ClipRasterBounds(const RasterTarget* target, const RasterSetup* setup, int* minX, int* minY, int* maxX, int* maxY)
+{
+    *minX = SDL_max(setup->minX, target->originX);
+    *minY = SDL_max(setup->minY, target->originY);
+    *maxX = SDL_min(setup->maxX, target->originX + target->width - 1);
+    *maxY = SDL_min(setup->maxY, target->originY + target->height - 1);
+
+    return *minX <= *maxX && *minY <= *maxY;
+}
+
+
+
+//
+// Number of hi-z cells in one row of a target
+//
+SDL_FORCE_INLINE int HiZCellsX(const RasterTarget* target)
+{
+    return (target->width + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE;
+}
+
+
+
+//
+// Pointers to row y of the color and depth buffers, set up so [x] is the pixel at screen position x.
+// With the blocked layout they only work for the x values in the same hi-z cell as x.
+//
+SDL_FORCE_INLINE void RasterRow(const RasterTarget* target, int x, int y, Uint32** colorRow, float** depthRow)
+{
+    int localX = x - target->originX;
+    int localY = y - target->originY;
+
+    if (target->blocked)
+    {
+        int cell = (localY / RASTER_HIZ_SIZE) * HiZCellsX(target) + localX / RASTER_HIZ_SIZE;
+        int offset = cell * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE + (localY % RASTER_HIZ_SIZE) * RASTER_HIZ_SIZE
+                   - (localX - localX % RASTER_HIZ_SIZE) - target->originX;
+
+        *colorRow = target->pixels + offset;
+        *depthRow = target->depth + offset;
+        return;
+    }
+
+    *colorRow = target->pixels + localY * target->pitch - target->originX;
+    *depthRow = target->depth + localY * target->width - target->originX;
+}
+
+
+
+//
+// Depth values of hi-z cell (cx, cy) and how far apart its rows are
+//
+SDL_FORCE_INLINE const float* HiZCellDepth(const RasterTarget* target, int cx, int cy, int* stride)
+{
+    if (target->blocked)
+    {
+        *stride = RASTER_HIZ_SIZE;
+        return target->depth + (cy * HiZCellsX(target) + cx) * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE;
+    }
+
+    *stride = target->width;
+    return target->depth + cy * RASTER_HIZ_SIZE * target->width + cx * RASTER_HIZ_SIZE;
+}
+
+
+
+//
+// Range of 1/z the triangle can have inside a rectangle of pixels.
+// 1/z is a plane, so the extremes are at the corners. The range is padded a little
+// so rounding in the per pixel math can never put a pixel outside of it.
+//
+SDL_FORCE_INLINE void RectDepthRange(const RasterSetup* setup, int x0, int y0, int x1, int y1, float* zNear, float* zFar)
+{
+    float nearX = ((setup->zdx > 0) ? x1 : x0) + 0.5f;
+    float nearY = ((setup->zdy > 0) ? y1 : y0) + 0.5f;
+    float farX  = ((setup->zdx > 0) ? x0 : x1) + 0.5f;
+    float farY  = ((setup->zdy > 0) ? y0 : y1) + 0.5f;
+
+    // Not clamped to the vertex depths, since the plane can overshoot them on thin slivers
+    *zNear = setup->z0 + setup->zdy * (nearY - setup->y0) + setup->zdx * (nearX - setup->x0) + setup->zPad;
+    *zFar  = setup->z0 + setup->zdy * (farY - setup->y0)  + setup->zdx * (farX - setup->x0)  - setup->zPad;
+}
+
+
+
+// One block of pixels for a kernel to fill (see RasterBlockVisible)
+typedef struct RasterBlock
+{
+    int x0, y0, x1, y1;     // Pixels to fill (inclusive)
+    int cellX0, cellY0;     // Hi-z cells the block covers (up to 2x2)
+    int cellX1, cellY1;
+    float zNear;            // Closest the triangle can get inside the block
+    bool allPass;           // In front of everything in the block, so no depth test is needed
+} RasterBlock;
+
+
+
+//
+// Recomputes the depth range of a hi-z cell from the depth buffer.
+// The SIMD kernels pass their own versions of this to RasterBlockVisible.
+//
+typedef void (*RefreshHiZFunc)(RasterTarget* target, int cx, int cy);
+
+SDL_FORCE_INLINE void RefreshHiZCell(RasterTarget* target, int cx, int cy)
+{
+    int x0 = cx * RASTER_HIZ_SIZE;
+    int y0 = cy * RASTER_HIZ_SIZE;
+    int x1 = SDL_min(x0 + RASTER_HIZ_SIZE, target->width);
+    int y1 = SDL_min(y0 + RASTER_HIZ_SIZE, target->height);
+
+    int stride;
+    const float* depth = HiZCellDepth(target, cx, cy, &stride);
+    float lo = depth[0];
+    float hi = lo;
+
+    for (int y = 0; y < y1 - y0; ++y)
+    {
+        const float* depthRow = depth + y * stride;
+
+        for (int x = 0; x < x1 - x0; ++x)
+        {
+            lo = (depthRow[x] < lo) ? depthRow[x] : lo;
+            hi = (depthRow[x] > hi) ? depthRow[x] : hi;
+        }
+    }
+
+    RasterHiZCell* cell = &target->hiz[cy * HiZCellsX(target) + cx];
+    cell->zFar = lo;
+    cell->zNear = hi;
+    cell->stale = false;
+}
+
+
+
+//
+// Finds the block of pixels to draw for hi-z cell (cx, cy).
+// Blocks are normally one cell, but triangles less than a cell wide (or tall) are drawn
+// in a single column (or row) of blocks that can straddle two cells, so no pixel row gets
+// visited twice and small triangles are still one block. Blocked targets never use the single
+// column, since a row of pixels from two cells isn't in one piece of memory there.
+// Returns false if the triangle can't draw anything in the block, either because it misses
+// it or because it's behind everything already drawn there.
+//
+SDL_FORCE_INLINE bool RasterBlockVisible(RasterTarget* target, const RasterSetup* setup,
+                                         int minX, int minY, int maxX, int maxY, int cx, int cy,
+                                         bool narrow, bool flat, RefreshHiZFunc refresh, RasterBlock* block)
+{
+    int cellX = target->originX + cx * RASTER_HIZ_SIZE;
+    int cellY = target->originY + cy * RASTER_HIZ_SIZE;
+
+    block->x0 = narrow ? minX : SDL_max(minX, cellX);
+    block->x1 = narrow ? maxX : SDL_min(maxX, cellX + RASTER_HIZ_SIZE - 1);
+    block->y0 = flat ? minY : SDL_max(minY, cellY);
+    block->y1 = flat ? maxY : SDL_min(maxY, cellY + RASTER_HIZ_SIZE - 1);
+    block->cellX0 = cx;
+    block->cellY0 = cy;
+    block->cellX1 = (block->x1 - target->originX) / RASTER_HIZ_SIZE;
+    block->cellY1 = (block->y1 - target->originY) / RASTER_HIZ_SIZE;
+    block->zNear = 0.0f;
+    block->allPass = false;
+
+    if (!RectTouchesTriangle(setup, block->x0, block->y0, block->x1, block->y1))
+        return false;
+
+    if (target->hiz == NULL)
+        return true;
+
+    // Nothing was drawn in a cell with no near depth yet, so a blocked target's depth there was never cleared
+    if (target->blocked)
+    {
+        for (int y = block->cellY0; y <= block->cellY1; ++y)
+        {
+            for (int x = block->cellX0; x <= block->cellX1; ++x)
+            {
+                if (target->hiz[y * HiZCellsX(target) + x].zNear == 0.0f)
+                    memset(target->depth + (y * HiZCellsX(target) + x) * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE, 0, sizeof(float) * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE);
+            }
+        }
+    }
+
+    float zFar;
+    RectDepthRange(setup, block->x0, block->y0, block->x1, block->y1, &block->zNear, &zFar);
+
+    // Farthest and closest depth already drawn anywhere in the block
+    float cellsFar = INFINITY;
+    float cellsNear = 0.0f;
+    bool stale = false;
+
+    for (int y = block->cellY0; y <= block->cellY1; ++y)
+    {
+        for (int x = block->cellX0; x <= block->cellX1; ++x)
+        {
+            RasterHiZCell* cell = &target->hiz[y * HiZCellsX(target) + x];
+            cellsFar = SDL_min(cellsFar, cell->zFar);
+            cellsNear = SDL_max(cellsNear, cell->zNear);
+            stale |= cell->stale;
+        }
+    }
+
+    if (block->zNear <= cellsFar)
+        return false;
+
+    // Stale cells are only worth recomputing if they could hide the triangle
+    if (stale && block->zNear <= cellsNear)
+    {
+        cellsFar = INFINITY;
+
+        for (int y = block->cellY0; y <= block->cellY1; ++y)
+        {
+            for (int x = block->cellX0; x <= block->cellX1; ++x)
+            {
+                RasterHiZCell* cell = &target->hiz[y * HiZCellsX(target) + x];
+                if (cell->stale)
+                    refresh(target, x, y);
+                cellsFar = SDL_min(cellsFar, cell->zFar);
+            }
+        }
+
+        if (block->zNear <= cellsFar)
+            return false;
+    }
+
+    block->allPass = zFar > cellsNear;
+    return true;
+}
+
+
+
+//
+// Called after a kernel drew into a block. The closest depth can be updated right away,
+// but the farthest one needs a look at every pixel, so it's left for a refresh.
+//
+SDL_FORCE_INLINE void MarkHiZBlock(RasterTarget* target, const RasterBlock* block)
+{
+    if (target->hiz == NULL)
+        return;
+
+    for (int y = block->cellY0; y <= block->cellY1; ++y)
+    {
+        for (int x = block->cellX0; x <= block->cellX1; ++x)
+        {
+            RasterHiZCell* cell = &target->hiz[y * HiZCellsX(target) + x];
+            cell->zNear = SDL_max(cell->zNear, block->zNear);
+            cell->stale = true;
+        }
+    }
+}
+
+
+
+//
+// Blends a premultiplied color over a pixel, one byte at a time (so it works for any 8 bit per channel format)
+//
+SDL_FORCE_INLINE Uint32 BlendRasterPixel(Uint32 color, Uint32 pixel, Uint32 invAlpha)
+{
+    Uint32 out = color;
+
+    for (int shift = 0; shift < 32; shift += 8)
+        out += ((((pixel >> shift) & 0xFF) * invAlpha + 127) / 255) << shift;
+
+    return out;
+}
+
+
+
+//
+// Scalar inner loop template: fills pixels x0 to x1 (inclusive) of one row in a render state.
+// depthTest, wireframe, blend and smooth are constants in every kernel made from it, so the code for the
+// states that are off is dropped at compile time and nothing is tested for them per pixel.
+// shadeRow is the red, green and blue planes at x0 of the setup for this row (smooth only).
+// The SIMD kernels do the exact same math per pixel, so their output matches the default state bit for bit.
+// Returns true if any pixel's depth was written.
+//
+SDL_FORCE_INLINE bool FillRasterSpanState(const RasterSetup* setup, float w0Row, float w1Row, float w2Row, float zRow,
+                                          Uint32* colorRow, float* depthRow, int x0, int x1, bool allPass,
+                                          const float* shadeRow, bool depthTest, bool wireframe, bool blend, bool smooth)
+{
+    const float* A = setup->A;
+    bool wrote = false;
+
+    for (int x = x0; x <= x1; ++x)
+    {
+        float fx = x + 0.5f;
+
+        float w0 = w0Row + A[0] * fx;
+        float w1 = w1Row + A[1] * fx;
+        float w2 = w2Row + A[2] * fx;
+
+        bool inside = (setup->topLeft[0] ? w0 >= 0 : w0 > 0) &&
+                      (setup->topLeft[1] ? w1 >= 0 : w1 > 0) &&
+                      (setup->topLeft[2] ? w2 >= 0 : w2 > 0);
+        if (!inside)
+            continue;
+
+        // Wireframe keeps the pixels less than a pixel away from an edge
+        if (wireframe && w0 * setup->edgeScale[0] >= 1.0f && w1 * setup->edgeScale[1] >= 1.0f && w2 * setup->edgeScale[2] >= 1.0f)
+            continue;
+
+        // Bigger 1/z is closer
+        if (depthTest)
+        {
+            float z = zRow + setup->zdx * (fx - setup->x0);
+            if (!allPass && z <= depthRow[x])
+                continue;
+
+            // Blended pixels don't hide what's behind them
+            if (!blend)
+            {
+                depthRow[x] = z;
+                wrote = true;
+            }
+        }
+
+        Uint32 color = setup->color;
+        if (smooth)
+        {
+            color = setup->shadeAlpha;
+            for (int c = 0; c < 3; ++c)
+            {
+                float value = shadeRow[c] + setup->shadeDx[c] * (fx - setup->x0);
+                color |= (Uint32)(fminf(fmaxf(value, 0.0f), 255.0f) + 0.5f) << setup->shadeShift[c];
+            }
+        }
+
+        colorRow[x] = blend ? BlendRasterPixel(color, colorRow[x], setup->invAlpha) : color;
+    }
+
+    return wrote;
+}
+
+
+
+//
+// The default state's inner loop, also used by the SIMD kernels for the pixels they can't do in groups
+//
+SDL_FORCE_INLINE bool FillRasterSpan(const RasterSetup* setup, float w0Row, float w1Row, float w2Row, float zRow,
+                                  Uint32* colorRow, float* depthRow, int x0, int x1, bool allPass)
+{
+    return FillRasterSpanState(setup, w0Row, w1Row, w2Row, zRow, colorRow, depthRow, x0, x1, allPass, NULL, true, false, false, false);
+}
+
+
+
+//
+// Fills a triangle one pixel at a time (no SIMD), template for the kernel of every render state.
+// Like the SIMD kernels it walks the triangle in hi-z blocks, so hidden blocks are skipped here too.
+//
+SDL_FORCE_INLINE void FillRasterTriangleState(RasterTarget* target, const RasterSetup* setup,
+                                              bool depthTest, bool wireframe, bool blend, bool smooth)
+{
+    int minX, minY, maxX, maxY;
+    if (!ClipRasterBounds(target, setup, &minX, &minY, &maxX, &maxY))
+        return;
+
+    // Without a depth test nothing can be hidden, so hi-z is left alone
+    RasterTarget unculled;
+    if (!depthTest)
+    {
+        unculled = *target;
+        unculled.hiz = NULL;
+        target = &unculled;
+    }
+
+    bool narrow = maxX - minX < RASTER_HIZ_SIZE && !target->blocked;
+    bool flat = maxY - minY < RASTER_HIZ_SIZE;
+    int cx0 = (minX - target->originX) / RASTER_HIZ_SIZE;
+    int cy0 = (minY - target->originY) / RASTER_HIZ_SIZE;
+    int cx1 = narrow ? cx0 : (maxX - target->originX) / RASTER_HIZ_SIZE;
+    int cy1 = flat ? cy0 : (maxY - target->originY) / RASTER_HIZ_SIZE;
+
+    for (int cy = cy0; cy <= cy1; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1; ++cx)
+        {
+            RasterBlock block;
+            if (!RasterBlockVisible(target, setup, minX, minY, maxX, maxY, cx, cy, narrow, flat, RefreshHiZCell, &block))
+                continue;
+
+            bool wrote = false;
+
+            for (int y = block.y0; y <= block.y1; ++y)
+            {
+                float fy = y + 0.5f;
+
+                // Parts of the edge and depth values that only change per row
+                float w0Row = setup->B[0] * fy + setup->C[0];
+                float w1Row = setup->B[1] * fy + setup->C[1];
+                float w2Row = setup->B[2] * fy + setup->C[2];
+                float zRow  = setup->z0 + setup->zdy * (fy - setup->y0);
+
+                float shadeRow[3];
+                if (smooth)
+                {
+                    for (int c = 0; c < 3; ++c)
+                        shadeRow[c] = setup->shade0[c] + setup->shadeDy[c] * (fy - setup->y0);
+                }
+
+                Uint32* colorRow;
+                float* depthRow;
+                RasterRow(target, block.x0, y, &colorRow, &depthRow);
+
+                wrote |= FillRasterSpanState(setup, w0Row, w1Row, w2Row, zRow, colorRow, depthRow, block.x0, block.x1, block.allPass,
+                                             shadeRow, depthTest, wireframe, blend, smooth);
+            }
+
+            if (wrote)
+                MarkHiZBlock(target, &block);
+        }
+    }
+}
+
+
+
+//
+// One kernel per render state, all made from the template above
+//
+#define RASTER_STATE_KERNEL(name, depthTest, wireframe, blend, smooth)                  \
+    static void name(RasterTarget* target, const RasterSetup* setup)                    \
+    {                                                                                   \
+        FillRasterTriangleState(target, setup, depthTest, wireframe, blend, smooth);    \
+    }
+
+RASTER_STATE_KERNEL(FillRasterTriangleOpaque,                  true,  false, false, false)
+RASTER_STATE_KERNEL(FillRasterTriangleNoDepth,                 false, false, false, false)
+RASTER_STATE_KERNEL(FillRasterTriangleWire,                    true,  true,  false, false)
+RASTER_STATE_KERNEL(FillRasterTriangleWireNoDepth,             false, true,  false, false)
+RASTER_STATE_KERNEL(FillRasterTriangleBlend,                   true,  false, true,  false)
+RASTER_STATE_KERNEL(FillRasterTriangleBlendNoDepth,            false, false, true,  false)
+RASTER_STATE_KERNEL(FillRasterTriangleBlendWire,               true,  true,  true,  false)
+RASTER_STATE_KERNEL(FillRasterTriangleBlendWireNoDepth,        false, true,  true,  false)
+RASTER_STATE_KERNEL(FillRasterTriangleSmooth,                  true,  false, false, true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothNoDepth,           false, false, false, true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothWire,              true,  true,  false, true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothWireNoDepth,       false, true,  false, true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothBlend,             true,  false, true,  true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothBlendNoDepth,      false, false, true,  true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothBlendWire,         true,  true,  true,  true)
+RASTER_STATE_KERNEL(FillRasterTriangleSmoothBlendWireNoDepth,  false, true,  true,  true)
+
+// Indexed by the RasterState bits
+static const RasterFillFunc rasterStateKernels[RASTER_STATE_COUNT] = {
+    FillRasterTriangleOpaque,
+    FillRasterTriangleNoDepth,
+    FillRasterTriangleWire,
+    FillRasterTriangleWireNoDepth,
+    FillRasterTriangleBlend,
+    FillRasterTriangleBlendNoDepth,
+    FillRasterTriangleBlendWire,
+    FillRasterTriangleBlendWireNoDepth,
+    FillRasterTriangleSmooth,
+    FillRasterTriangleSmoothNoDepth,
+    FillRasterTriangleSmoothWire,
+    FillRasterTriangleSmoothWireNoDepth,
+    FillRasterTriangleSmoothBlend,
+    FillRasterTriangleSmoothBlendNoDepth,
+    FillRasterTriangleSmoothBlendWire,
+    FillRasterTriangleSmoothBlendWireNoDepth
+};
+
+
+
+//
+// Scalar kernel for the triangle's render state
+//
+void FillRasterTriangleScalar(RasterTarget* target, const RasterSetup* setup)
+{
+    rasterStateKernels[setup->state](target, setup);
+}
+
+
+
+#ifdef SDL_SSE2_INTRINSICS
+//
+// RefreshHiZCell for the SSE2 kernel, 4 depth values at a time when the whole cell is inside the target
+//
+SDL_TARGETING("sse2") SDL_FORCE_INLINE void RefreshHiZCellSSE2(RasterTarget* target, int cx, int cy)
+{
+    if ((cx + 1) * RASTER_HIZ_SIZE > target->width || (cy + 1) * RASTER_HIZ_SIZE > target->height)
+    {
+        RefreshHiZCell(target, cx, cy);
+        return;
+    }
+
+    int stride;
+    const float* depth = HiZCellDepth(target, cx, cy, &stride);
+    __m128 lo = _mm_loadu_ps(depth);
+    __m128 hi = lo;
+
+    for (int y = 0; y < RASTER_HIZ_SIZE; ++y)
+    {
+        for (int x = 0; x < RASTER_HIZ_SIZE; x += 4)
+        {
+            __m128 d = _mm_loadu_ps(depth + y * stride + x);
+            lo = _mm_min_ps(lo, d);
+            hi = _mm_max_ps(hi, d);
+        }
+    }
+
+    lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_min_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    hi = _mm_max_ps(hi, _mm_movehl_ps(hi, hi));
+    hi = _mm_max_ss(hi, _mm_shuffle_ps(hi, hi, 1));
+
+    RasterHiZCell* cell = &target->hiz[cy * HiZCellsX(target) + cx];
+    cell->zFar = _mm_cvtss_f32(lo);
+    cell->zNear = _mm_cvtss_f32(hi);
+    cell->stale = false;
+}
+
+
+
+//
+// SSE2 kernel: walks the triangle in hi-z blocks, skips the ones it can't touch or that are hidden,
+// and tests 4 pixels at a time.
+//
+SDL_TARGETING("sse2") void FillRasterTriangleSSE2(RasterTarget* target, const RasterSetup* setup)
+{
+    int minX, minY, maxX, maxY;
+    if (!ClipRasterBounds(target, setup, &minX, &minY, &maxX, &maxY))
+        return;
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+
+    __m128 A0 = _mm_set1_ps(setup->A[0]);
+    __m128 A1 = _mm_set1_ps(setup->A[1]);
+    __m128 A2 = _mm_set1_ps(setup->A[2]);
+    __m128 tl0 = _mm_castsi128_ps(_mm_set1_epi32(setup->topLeft[0] ? -1 : 0));
+    __m128 tl1 = _mm_castsi128_ps(_mm_set1_epi32(setup->topLeft[1] ? -1 : 0));
+    __m128 tl2 = _mm_castsi128_ps(_mm_set1_epi32(setup->topLeft[2] ? -1 : 0));
+    __m128 zdx = _mm_set1_ps(setup->zdx);
+    __m128 x0 = _mm_set1_ps(setup->x0);
+    __m128i color = _mm_set1_epi32((int)setup->color);
+
+    bool narrow = maxX - minX < RASTER_HIZ_SIZE && !target->blocked;
+    bool flat = maxY - minY < RASTER_HIZ_SIZE;
+    int cx0 = (minX - target->originX) / RASTER_HIZ_SIZE;
+    int cy0 = (minY - target->originY) / RASTER_HIZ_SIZE;
+    int cx1 = narrow ? cx0 : (maxX - target->originX) / RASTER_HIZ_SIZE;
+    int cy1 = flat ? cy0 : (maxY - target->originY) / RASTER_HIZ_SIZE;
+
+    for (int cy = cy0; cy <= cy1; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1; ++cx)
+        {
+            RasterBlock block;
+            if (!RasterBlockVisible(target, setup, minX, minY, maxX, maxY, cx, cy, narrow, flat, RefreshHiZCellSSE2, &block))
+                continue;
+
+            __m128 depthTest = _mm_castsi128_ps(_mm_set1_epi32(block.allPass ? 0 : -1));
+            bool wrote = false;
+
+            // Blocks are at most 8 wide, so each row is done as up to two groups of 4.
+            // In blocked targets the groups line up with the cell, so they never leave it.
+            int gxStart = target->blocked ? block.x0 - (block.x0 - target->originX) % 4 : block.x0;
+
+            for (int gx = gxStart; gx <= block.x1; gx += 4)
+            {
+                int gx1 = SDL_min(gx + 3, block.x1);
+
+                __m128i xs = _mm_add_epi32(_mm_set1_epi32(gx), lane);
+                __m128 fx = _mm_add_ps(_mm_cvtepi32_ps(xs), half);
+
+                // Lanes outside of the block are switched off
+                __m128 laneMask = _mm_castsi128_ps(_mm_and_si128(_mm_cmplt_epi32(xs, _mm_set1_epi32(gx1 + 1)),
+                                                                 _mm_cmpgt_epi32(xs, _mm_set1_epi32(block.x0 - 1))));
+                bool fitsTarget = target->blocked || gx + 3 <= target->originX + target->width - 1;
+
+                for (int y = block.y0; y <= block.y1; ++y)
+                {
+                    float fy = y + 0.5f;
+                    float w0Row = setup->B[0] * fy + setup->C[0];
+                    float w1Row = setup->B[1] * fy + setup->C[1];
+                    float w2Row = setup->B[2] * fy + setup->C[2];
+                    float zRow  = setup->z0 + setup->zdy * (fy - setup->y0);
+
+                    Uint32* colorRow;
+                    float* depthRow;
+                    RasterRow(target, gx, y, &colorRow, &depthRow);
+
+                    // Groups that would read past the edge of the target are done one pixel at a time
+                    if (!fitsTarget)
+                    {
+                        wrote |= FillRasterSpan(setup, w0Row, w1Row, w2Row, zRow, colorRow, depthRow, gx, gx1, block.allPass);
+                        continue;
+                    }
+
+                    __m128 w0 = _mm_add_ps(_mm_set1_ps(w0Row), _mm_mul_ps(A0, fx));
+                    __m128 w1 = _mm_add_ps(_mm_set1_ps(w1Row), _mm_mul_ps(A1, fx));
+                    __m128 w2 = _mm_add_ps(_mm_set1_ps(w2Row), _mm_mul_ps(A2, fx));
+
+                    // w > 0, or w == 0 on a top-left edge
+                    __m128 in0 = _mm_or_ps(_mm_cmpgt_ps(w0, zero), _mm_and_ps(_mm_cmpeq_ps(w0, zero), tl0));
+                    __m128 in1 = _mm_or_ps(_mm_cmpgt_ps(w1, zero), _mm_and_ps(_mm_cmpeq_ps(w1, zero), tl1));
+                    __m128 in2 = _mm_or_ps(_mm_cmpgt_ps(w2, zero), _mm_and_ps(_mm_cmpeq_ps(w2, zero), tl2));
+                    __m128 mask = _mm_and_ps(_mm_and_ps(in0, laneMask), _mm_and_ps(in1, in2));
+
+                    if (_mm_movemask_ps(mask) == 0)
+                        continue;
+
+                    __m128 z = _mm_add_ps(_mm_set1_ps(zRow), _mm_mul_ps(zdx, _mm_sub_ps(fx, x0)));
+                    __m128 oldZ = _mm_loadu_ps(depthRow + gx);
+                    mask = _mm_and_ps(mask, _mm_or_ps(_mm_cmpgt_ps(z, oldZ), _mm_andnot_ps(depthTest, mask)));
+
+                    if (_mm_movemask_ps(mask) == 0)
+                        continue;
+
+                    __m128i oldColor = _mm_loadu_si128((__m128i*)(colorRow + gx));
+                    __m128i imask = _mm_castps_si128(mask);
+
+                    _mm_storeu_ps(depthRow + gx, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, oldZ)));
+                    _mm_storeu_si128((__m128i*)(colorRow + gx),
+                                     _mm_or_si128(_mm_and_si128(imask, color), _mm_andnot_si128(imask, oldColor)));
+                    wrote = true;
+                }
+            }
+
+            if (wrote)
+                MarkHiZBlock(target, &block);
+        }
+    }
+}
+#endif
+
+
+
+#ifdef SDL_AVX2_INTRINSICS
+//
+// RefreshHiZCell for the AVX2 kernel, a whole cell row at a time when the cell is inside the target
+//
+SDL_TARGETING("avx2") SDL_FORCE_INLINE void RefreshHiZCellAVX2(RasterTarget* target, int cx, int cy)
+{
+    if ((cx + 1) * RASTER_HIZ_SIZE > target->width || (cy + 1) * RASTER_HIZ_SIZE > target->height)
+    {
+        RefreshHiZCell(target, cx, cy);
+        return;
+    }
+
+    int stride;
+    const float* depth = HiZCellDepth(target, cx, cy, &stride);
+    __m256 lo = _mm256_loadu_ps(depth);
+    __m256 hi = lo;
+
+    for (int y = 1; y < RASTER_HIZ_SIZE; ++y)
+    {
+        __m256 d = _mm256_loadu_ps(depth + y * stride);
+        lo = _mm256_min_ps(lo, d);
+        hi = _mm256_max_ps(hi, d);
+    }
+
+    __m128 lo4 = _mm_min_ps(_mm256_castps256_ps128(lo), _mm256_extractf128_ps(lo, 1));
+    __m128 hi4 = _mm_max_ps(_mm256_castps256_ps128(hi), _mm256_extractf128_ps(hi, 1));
+    lo4 = _mm_min_ps(lo4, _mm_movehl_ps(lo4, lo4));
+    lo4 = _mm_min_ss(lo4, _mm_shuffle_ps(lo4, lo4, 1));
+    hi4 = _mm_max_ps(hi4, _mm_movehl_ps(hi4, hi4));
+    hi4 = _mm_max_ss(hi4, _mm_shuffle_ps(hi4, hi4, 1));
+
+    RasterHiZCell* cell = &target->hiz[cy * HiZCellsX(target) + cx];
+    cell->zFar = _mm_cvtss_f32(lo4);
+    cell->zNear = _mm_cvtss_f32(hi4);
+    cell->stale = false;
+}
+
+
+
+//
+// AVX2 kernel: same as the SSE2 one, with a whole block row (8 pixels) at a time
+//
+SDL_TARGETING("avx2") void FillRasterTriangleAVX2(RasterTarget* target, const RasterSetup* setup)
+{
+    int minX, minY, maxX, maxY;
+    if (!ClipRasterBounds(target, setup, &minX, &minY, &maxX, &maxY))
+        return;
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    __m256 A0 = _mm256_set1_ps(setup->A[0]);
+    __m256 A1 = _mm256_set1_ps(setup->A[1]);
+    __m256 A2 = _mm256_set1_ps(setup->A[2]);
+    __m256 tl0 = _mm256_castsi256_ps(_mm256_set1_epi32(setup->topLeft[0] ? -1 : 0));
+    __m256 tl1 = _mm256_castsi256_ps(_mm256_set1_epi32(setup->topLeft[1] ? -1 : 0));
+    __m256 tl2 = _mm256_castsi256_ps(_mm256_set1_epi32(setup->topLeft[2] ? -1 : 0));
+    __m256 zdx = _mm256_set1_ps(setup->zdx);
+    __m256 x0 = _mm256_set1_ps(setup->x0);
+    __m256 color = _mm256_castsi256_ps(_mm256_set1_epi32((int)setup->color));
+
+    bool narrow = maxX - minX < RASTER_HIZ_SIZE && !target->blocked;
+    bool flat = maxY - minY < RASTER_HIZ_SIZE;
+    int cx0 = (minX - target->originX) / RASTER_HIZ_SIZE;
+    int cy0 = (minY - target->originY) / RASTER_HIZ_SIZE;
+    int cx1 = narrow ? cx0 : (maxX - target->originX) / RASTER_HIZ_SIZE;
+    int cy1 = flat ? cy0 : (maxY - target->originY) / RASTER_HIZ_SIZE;
+
+    for (int cy = cy0; cy <= cy1; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1; ++cx)
+        {
+            RasterBlock block;
+            if (!RasterBlockVisible(target, setup, minX, minY, maxX, maxY, cx, cy, narrow, flat, RefreshHiZCellAVX2, &block))
+                continue;
+
+            // In blocked targets the row starts at the cell's edge, so it's exactly one cell row
+            int gx = target->blocked ? block.x0 - (block.x0 - target->originX) % RASTER_HIZ_SIZE : block.x0;
+
+            __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(gx), lane);
+            __m256 fx = _mm256_add_ps(_mm256_cvtepi32_ps(xs), half);
+
+            // Lanes outside of the block are switched off
+            __m256 laneMask = _mm256_castsi256_ps(_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(block.x1 + 1), xs),
+                                                                   _mm256_cmpgt_epi32(xs, _mm256_set1_epi32(block.x0 - 1))));
+            __m256 depthTest = _mm256_castsi256_ps(_mm256_set1_epi32(block.allPass ? 0 : -1));
+            bool fitsTarget = target->blocked || gx + 7 <= target->originX + target->width - 1;
+            bool wrote = false;
+
+            for (int y = block.y0; y <= block.y1; ++y)
+            {
+                float fy = y + 0.5f;
+                float w0Row = setup->B[0] * fy + setup->C[0];
+                float w1Row = setup->B[1] * fy + setup->C[1];
+                float w2Row = setup->B[2] * fy + setup->C[2];
+                float zRow  = setup->z0 + setup->zdy * (fy - setup->y0);
+
+                Uint32* colorRow;
+                float* depthRow;
+                RasterRow(target, gx, y, &colorRow, &depthRow);
+
+                // Rows that would read past the edge of the target are done one pixel at a time
+                if (!fitsTarget)
+                {
+                    wrote |= FillRasterSpan(setup, w0Row, w1Row, w2Row, zRow, colorRow, depthRow, block.x0, block.x1, block.allPass);
+                    continue;
+                }
+
+                __m256 w0 = _mm256_add_ps(_mm256_set1_ps(w0Row), _mm256_mul_ps(A0, fx));
+                __m256 w1 = _mm256_add_ps(_mm256_set1_ps(w1Row), _mm256_mul_ps(A1, fx));
+                __m256 w2 = _mm256_add_ps(_mm256_set1_ps(w2Row), _mm256_mul_ps(A2, fx));
+
+                // w > 0, or w == 0 on a top-left edge
+                __m256 in0 = _mm256_or_ps(_mm256_cmp_ps(w0, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_EQ_OQ), tl0));
+                __m256 in1 = _mm256_or_ps(_mm256_cmp_ps(w1, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(w1, zero, _CMP_EQ_OQ), tl1));
+                __m256 in2 = _mm256_or_ps(_mm256_cmp_ps(w2, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(w2, zero, _CMP_EQ_OQ), tl2));
+                __m256 mask = _mm256_and_ps(_mm256_and_ps(in0, laneMask), _mm256_and_ps(in1, in2));
+
+                if (_mm256_movemask_ps(mask) == 0)
+                    continue;
+
+                __m256 z = _mm256_add_ps(_mm256_set1_ps(zRow), _mm256_mul_ps(zdx, _mm256_sub_ps(fx, x0)));
+                __m256 oldZ = _mm256_loadu_ps(depthRow + gx);
+                mask = _mm256_and_ps(mask, _mm256_or_ps(_mm256_cmp_ps(z, oldZ, _CMP_GT_OQ), _mm256_andnot_ps(depthTest, mask)));
+
+                if (_mm256_movemask_ps(mask) == 0)
+                    continue;
+
+                __m256 oldColor = _mm256_loadu_ps((float*)(colorRow + gx));
+
+                _mm256_storeu_ps(depthRow + gx, _mm256_blendv_ps(oldZ, z, mask));
+                _mm256_storeu_ps((float*)(colorRow + gx), _mm256_blendv_ps(oldColor, color, mask));
+                wrote = true;
+            }
+
+            if (wrote)
+                MarkHiZBlock(target, &block);
+        }
+    }
+}
+#endif
+
+
+
+//
+// Picks the best kernel the CPU supports
+//
+int GetBestRasterSIMD()
+{
+#ifdef SDL_AVX2_INTRINSICS
+    if (SDL_HasAVX2())
+        return RASTER_SIMD_AVX2;
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    if (SDL_HasSSE2())
+        return RASTER_SIMD_SSE2;
+#endif
+    return RASTER_SIMD_SCALAR;
+}
+
+
+
+//
+// Sets which kernel FillRasterTriangle uses. Falls back if the CPU can't run it.
+//
+void SetRasterSIMD(int level)
+{
+    int best = GetBestRasterSIMD();
+    SDL_SetAtomicInt(&rasterSIMD, (level > best) ? best : level);
+}
+
+
+
+//
+// Gets the kernel FillRasterTriangle uses
+//
+int GetRasterSIMD()
+{
+    int level = SDL_GetAtomicInt(&rasterSIMD);
+    if (level < 0)
+    {
+        SDL_CompareAndSwapAtomicInt(&rasterSIMD, -1, GetBestRasterSIMD());
+        level = SDL_GetAtomicInt(&rasterSIMD);
+    }
+
+    return level;
+}
+
+
+
+//
+// Kernel for a render state: the one picked with SetRasterSIMD for the default state,
+// and the scalar kernel made for the state otherwise
+//
+RasterFillFunc GetRasterFillFunc(int state)
+{
+    if (state != RASTER_STATE_DEFAULT)
+        return rasterStateKernels[state & (RASTER_STATE_COUNT - 1)];
+
+    switch (GetRasterSIMD())
+    {
+#ifdef SDL_AVX2_INTRINSICS
+        case RASTER_SIMD_AVX2:
+            return FillRasterTriangleAVX2;
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+        case RASTER_SIMD_SSE2:
+            return FillRasterTriangleSSE2;
+#endif
+        default:
+            return FillRasterTriangleOpaque;
+    }
+}
+
+
+
+//
+// Fills the part of a triangle that lands inside the target, testing against the depth buffer.
+// Every pixel's values only depend on its screen position, so the result is the same
+// no matter how the screen is split up between calls, or which kernel is used.
+//
+void FillRasterTriangle(RasterTarget* target, const RasterSetup* setup)
+{
+    GetRasterFillFunc(setup->state)(target, setup);
+}
+
+
+
+//
+// Sets the render state (RasterState bits) of the triangles set up from now on
+//
+void SetRasterState(RasterContext* ctx, int state)
+{
+    ctx->state = state & (RASTER_STATE_COUNT - 1);
+}
+
+int GetRasterState(const RasterContext* ctx)
+{
+    return ctx->state;
+}
+
+
+
+//
+// Maps a triangle's color for the render state. Blended colors are premultiplied by their alpha,
+// so blending is one multiply per channel of the pixel that's already there.
+//
+static Uint32 MapRasterTriangleColor(const RasterContext* ctx, const SDL_PixelFormatDetails* format, Color color)
+{
+    if (ctx->state & RASTER_STATE_BLEND)
+    {
+        color.r = (Uint8)((color.r * color.a + 127) / 255);
+        color.g = (Uint8)((color.g * color.a + 127) / 255);
+        color.b = (Uint8)((color.b * color.a + 127) / 255);
+    }
+
+    return MapRasterColor(format, color);
+}
+
+
+
+//
+// Turns SIMD validation on or off.
+// While it's on, RasterizeTriangles also draws every frame with the scalar kernel
+// and compares the color and depth results bit for bit.
+//
+void SetRasterValidateSIMD(RasterContext* ctx, bool validate)
+{
+    ctx->validateSIMD = validate;
+
+    if (!validate)
+    {
+        free(ctx->validateColor);
+        free(ctx->validateDepth);
+        ctx->validateColor = NULL;
+        ctx->validateDepth = NULL;
+        ctx->validateSize = 0;
+    }
+}
+
+
+
+//
+// Number of pixels that didn't match in the last validated frame
+//
+int GetRasterSIMDMismatches(const RasterContext* ctx)
+{
+    return ctx->lastSIMDMismatches;
+}
+
+
+
+//
+// Makes a copy of the target for the scalar kernel to draw into
+//
+bool PrepareSIMDValidation(RasterContext* ctx, const RasterTarget* target, RasterTarget* check)
+{
+    int cells = HiZCellsX(target) * ((target->height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE);
+    int size = target->blocked ? cells * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE : target->width * target->height;
+    if (size > ctx->validateSize)
+    {
+        free(ctx->validateColor);
+        free(ctx->validateDepth);
+        ctx->validateColor = malloc(sizeof(Uint32) * size);
+        ctx->validateDepth = malloc(sizeof(float) * size);
+        ctx->validateSize = size;
+
+        if (!ctx->validateColor || !ctx->validateDepth)
+        {
+            printf("Failed to allocate SIMD validation buffers\n");
+            SetRasterValidateSIMD(ctx, false);
+            return false;
+        }
+    }
+
+    // The scalar copy runs without hi-z, so it needs all of the depth cleared (blocked targets clear it as they go)
+    if (target->blocked)
+        memset(target->depth, 0, sizeof(float) * size);
+
+    // The scalar copy runs without hi-z, so culling mistakes show up as mismatches too
+    *check = *target;
+    check->pixels = ctx->validateColor;
+    check->pitch = target->width;
+    check->depth = ctx->validateDepth;
+    check->hiz = NULL;
+
+    if (target->blocked)
+        memcpy(check->pixels, target->pixels, sizeof(Uint32) * size);
+    else
+    {
+        for (int y = 0; y < target->height; ++y)
+            memcpy(check->pixels + y * check->pitch, target->pixels + y * target->pitch, sizeof(Uint32) * target->width);
+    }
+    memcpy(check->depth, target->depth, sizeof(float) * size);
+
+    return true;
+}
+
+
+
+//
+// Compares the SIMD result with the scalar one
+//
+int CompareSIMDValidation(const RasterTarget* target, const RasterTarget* check)
+{
+    int mismatches = 0;
+
+    for (int y = target->originY; y < target->originY + target->height; ++y)
+    {
+        for (int x = target->originX; x < target->originX + target->width; ++x)
+        {
+            Uint32* colorRow;
+            Uint32* checkColorRow;
+            float* depthRow;
+            float* checkDepthRow;
+            RasterRow(target, x, y, &colorRow, &depthRow);
+            RasterRow(check, x, y, &checkColorRow, &checkDepthRow);
+
+            if (colorRow[x] != checkColorRow[x] || memcmp(&depthRow[x], &checkDepthRow[x], sizeof(float)) != 0)
+                mismatches++;
+        }
+    }
+
+    return mismatches;
+}
+
+
+
+//
+// Sets the layout RasterizeTriangles draws with
+//
+void SetRasterLayout(RasterContext* ctx, int layout)
+{
+    ctx->layout = (layout == RASTER_LAYOUT_BLOCKED) ? RASTER_LAYOUT_BLOCKED : RASTER_LAYOUT_LINEAR;
+}
+
+int GetRasterLayout(const RasterContext* ctx)
+{
+    return ctx->layout;
+}
+
+
+
+//
+// Points a target at the blocked color buffer, for the same area it covers now.
+// The depth buffer is already big enough for the padded cells (see GetRasterTarget).
+//
+bool UseBlockedLayout(RasterContext* ctx, RasterTarget* target)
+{
+    int cells = HiZCellsX(target) * ((target->height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE);
+    int size = cells * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE;
+
+    if (size > ctx->blockedColorSize)
+    {
+        free(ctx->blockedColor);
+        ctx->blockedColor = malloc(sizeof(Uint32) * size);
+        ctx->blockedColorSize = ctx->blockedColor ? size : 0;
+
+        if (!ctx->blockedColor)
+        {
+            printf("Failed to allocate the blocked color buffer\n");
+            return false;
+        }
+    }
+
+    target->pixels = ctx->blockedColor;
+    target->pitch = RASTER_HIZ_SIZE;
+    target->blocked = true;
+    return true;
+}
+
+
+
+//
+// Copies a blocked target back to rows. The color buffer is never cleared, so only pixels
+// with a depth (the ones that were drawn) are copied and everything else keeps what it had.
+// Cells hi-z knows are empty are skipped without looking at them.
+//
+void DetileRasterTarget(const RasterTarget* blocked, RasterTarget* linear)
+{
+    int cellsX = HiZCellsX(blocked);
+    int cellsY = (blocked->height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE;
+
+    for (int cy = 0; cy < cellsY; ++cy)
+    {
+        int rows = SDL_min(RASTER_HIZ_SIZE, blocked->height - cy * RASTER_HIZ_SIZE);
+
+        for (int cx = 0; cx < cellsX; ++cx)
+        {
+            if (blocked->hiz != NULL && blocked->hiz[cy * cellsX + cx].zNear == 0.0f)
+                continue;
+
+            int columns = SDL_min(RASTER_HIZ_SIZE, blocked->width - cx * RASTER_HIZ_SIZE);
+            int cell = (cy * cellsX + cx) * RASTER_HIZ_SIZE * RASTER_HIZ_SIZE;
+
+            for (int y = 0; y < rows; ++y)
+            {
+                const Uint32* color = blocked->pixels + cell + y * RASTER_HIZ_SIZE;
+                const float* depth = blocked->depth + cell + y * RASTER_HIZ_SIZE;
+                Uint32* out = linear->pixels + (cy * RASTER_HIZ_SIZE + y) * linear->pitch + cx * RASTER_HIZ_SIZE;
+
+                for (int x = 0; x < columns; ++x)
+                    out[x] = (depth[x] > 0.0f) ? color[x] : out[x];
+            }
+        }
+    }
+}
+
+
+
+//
+// Narrows a full surface target down to a rectangle of it.
+// Returns false if the rectangle is completely off the surface.
+//
+bool LimitRasterTarget(RasterTarget* target, const SDL_Rect* rect)
+{
+    if (rect == NULL)
+        return true;
+
+    int x0 = SDL_max(rect->x, 0);
+    int y0 = SDL_max(rect->y, 0);
+    int x1 = SDL_min(rect->x + rect->w, target->width);
+    int y1 = SDL_min(rect->y + rect->h, target->height);
+
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+
+    target->pixels += y0 * target->pitch + x0;
+    target->originX = x0;
+    target->originY = y0;
+    target->width = x1 - x0;
+    target->height = y1 - y0;
+
+    return true;
+}
+
+
+
+//
+// Draws every triangle straight into the surface's pixels.
+// The depth buffer takes care of ordering, so the triangles don't need to be sorted.
+//
+void RasterizeTriangles(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count)
+{
+    RasterizeTrianglesRect(ctx, surface, program, tris, count, NULL);
+}
+
+
+
+//
+// Draws the triangles into a target with a cleared depth buffer, in the layout and with the kernel that are set.
+// Every triangle gets the color from format, or ids[i] when there are ids.
+//
+static void DrawRasterTarget(RasterContext* ctx, RasterTarget target, WindowInfo program, RenderTriangle* tris, int count,
+                             const SDL_PixelFormatDetails* format, const Uint32* ids)
+{
+    RasterTarget check;
+
+    // The blocked layout draws into its own buffer and copies the result to the target at the end.
+    // Only pixels with a depth are copied and the buffer doesn't have the target's pixels, so other states stay linear.
+    RasterTarget linear = target;
+    if (ctx->layout == RASTER_LAYOUT_BLOCKED && (ctx->state == RASTER_STATE_DEFAULT || ids != NULL))
+        UseBlockedLayout(ctx, &target);
+
+    ClearDepthBuffer(&target);
+
+    bool validate = ctx->validateSIMD && (GetRasterSIMD() != RASTER_SIMD_SCALAR || target.hiz != NULL) &&
+                    PrepareSIMDValidation(ctx, &target, &check);
+
+    for (int i = 0; i < count; ++i)
+    {
+        RenderTriangle* t = &tris[i];
+        RasterSetup setup;
+
+        Uint32 color = ids ? ids[i] : MapRasterTriangleColor(ctx, format, t->color);
+
+        if (!SetupRasterTriangle(ctx, t, program, color, &setup))
+            continue;
+
+        // IDs can't be blended or left out, they're always drawn like opaque triangles
+        if (ids)
+            setup.state = RASTER_STATE_DEFAULT;
+        else
+            SetupRasterShading(format, &setup);
+
+        FillRasterTriangle(&target, &setup);
+
+        if (validate)
+            FillRasterTriangleScalar(&check, &setup);
+    }
+
+    if (validate)
+    {
+        ctx->lastSIMDMismatches = CompareSIMDValidation(&target, &check);
+
+        if (ctx->lastSIMDMismatches > 0)
+            printf("SIMD validation: %d pixels differ from the scalar kernel\n", ctx->lastSIMDMismatches);
+    }
+
+    if (target.blocked)
+        DetileRasterTarget(&target, &linear);
+}
+
+
+
+//
+// Same as RasterizeTriangles, but only the pixels inside rect are touched (NULL means the whole surface).
+// The depth buffer is cleared for the rectangle only, so it has to be redrawn with everything that covers it.
+//
+void RasterizeTrianglesRect(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count, const SDL_Rect* rect)
+{
+    RasterTarget target;
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_LockSurface(surface);
+
+    if (!GetRasterTarget(ctx, surface, &target) || !LimitRasterTarget(&target, rect))
+    {
+        if (SDL_MUSTLOCK(surface))
+            SDL_UnlockSurface(surface);
+        return;
+    }
+
+    DrawRasterTarget(ctx, target, program, tris, count, SDL_GetPixelFormatDetails(surface->format), NULL);
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+}
+
+
+
+//
+// Draws an ID for every triangle instead of its color: triangleIds[i] goes wherever triangle i is the closest.
+// Pixels nothing covers are set to 0, so IDs should start at 1.
+//
+void RasterizeTriangleIDs(RasterContext* ctx, Uint32* ids, int width, int height, WindowInfo program, RenderTriangle* tris, const Uint32* triangleIds, int count)
+{
+    RasterTarget target;
+
+    if (!GetRasterBufferTarget(ctx, ids, width, width, height, &target))
+        return;
+
+    // The blocked layout only copies the pixels something was drawn into
+    FillRasterBuffer(ids, width * height, 0);
+
+    DrawRasterTarget(ctx, target, program, tris, count, NULL, triangleIds);
+}
+
+
+
+
+
+
+
+
+
+
+//////////////////////////////////
+// Tiled multi-threaded drawing //
+//////////////////////////////////
+
+
+//
+// Makes room for the bins of a width x height area and for "slices" sets of bin counters
+// (one per thread that bins a part of the triangles).
+//
+static bool PrepareRasterBins(RasterContext* ctx, int width, int height, int slices)
+{
+    ctx->tilesX = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    ctx->tilesY = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    int tileCount = ctx->tilesX * ctx->tilesY;
+
+    if (tileCount + 1 > ctx->binTileCapacity)
+    {
+        free(ctx->binStart);
+        ctx->binStart = malloc(sizeof(int) * (tileCount + 1));
+        ctx->binTileCapacity = ctx->binStart ? tileCount + 1 : 0;
+        if (!ctx->binStart) return false;
+    }
+
+    if (tileCount * slices > ctx->binFillCapacity)
+    {
+        free(ctx->binFill);
+        ctx->binFill = malloc(sizeof(int) * tileCount * slices);
+        ctx->binFillCapacity = ctx->binFill ? tileCount * slices : 0;
+        if (!ctx->binFill) return false;
+    }
+
+    return true;
+}
+
+
+
+//
+// Walks the tiles touched by set up triangles first to last - 1. It either counts them in bins
+// (fill false) or writes the triangles into binTris at the bins' cursors (fill true).
+// Triangles with an empty box (minX > maxX) were rejected during setup and are skipped.
+//
+static void WalkRasterBins(RasterContext* ctx, int originX, int originY, int first, int last, int* bins, bool fill)
+{
+    for (int i = first; i < last; ++i)
+    {
+        RasterSetup* s = &ctx->setupBuffer[i];
+        if (s->minX > s->maxX)
+            continue;
+
+        for (int ty = (s->minY - originY) / RASTER_TILE_SIZE; ty <= (s->maxY - originY) / RASTER_TILE_SIZE; ++ty)
+        {
+            for (int tx = (s->minX - originX) / RASTER_TILE_SIZE; tx <= (s->maxX - originX) / RASTER_TILE_SIZE; ++tx)
+            {
+                int x0 = originX + tx * RASTER_TILE_SIZE;
+                int y0 = originY + ty * RASTER_TILE_SIZE;
+                if (!TriangleTouchesTile(s, x0, y0, x0 + RASTER_TILE_SIZE - 1, y0 + RASTER_TILE_SIZE - 1))
+                    continue;
+
+                if (fill)
+                    ctx->binTris[bins[ty * ctx->tilesX + tx]++] = i;
+                else
+                    bins[ty * ctx->tilesX + tx]++;
+            }
+        }
+    }
+}
+
+
+
+//
+// Turns the counts of every slice into where each slice starts writing in every bin.
+// Slices hold consecutive triangle ranges, so going through them in order for each tile
+// keeps the submission order inside the tile.
+//
+static bool StartRasterBins(RasterContext* ctx, int slices)
+{
+    int tileCount = ctx->tilesX * ctx->tilesY;
+    int total = 0;
+
+    for (int t = 0; t < tileCount; ++t)
+    {
+        ctx->binStart[t] = total;
+        for (int slice = 0; slice < slices; ++slice)
+        {
+            int* bin = &ctx->binFill[slice * tileCount + t];
+            int count = *bin;
+            *bin = total;
+            total += count;
+        }
+    }
+    ctx->binStart[tileCount] = total;
+
+    if (total > ctx->binTrisCapacity)
+    {
+        free(ctx->binTris);
+        ctx->binTris = malloc(sizeof(int) * total);
+        ctx->binTrisCapacity = ctx->binTris ? total : 0;
+        if (!ctx->binTris) return false;
+    }
+
+    return true;
+}
+
+
+
+//
+// Sorts the set up triangles into per-tile lists on the calling thread.
+// Done in two passes (count, then fill) so there's no per-tile allocation.
+//
+bool BinRasterTriangles(RasterContext* ctx, int originX, int originY, int width, int height)
+{
+    if (!PrepareRasterBins(ctx, width, height, 1))
+        return false;
+
+    memset(ctx->binFill, 0, sizeof(int) * ctx->tilesX * ctx->tilesY);
+    WalkRasterBins(ctx, originX, originY, 0, ctx->setupCount, ctx->binFill, false);
+
+    if (!StartRasterBins(ctx, 1))
+        return false;
+
+    WalkRasterBins(ctx, originX, originY, 0, ctx->setupCount, ctx->binFill, true);
+    return true;
+}
+
+
+
+//
+// Sets up one worker's share of the tiled frame's triangles (each one into its own slot,
+// so the workers never write to the same place) and counts them into the worker's bins.
+//
+static void SetupRasterSlice(RasterContext* ctx, int first, int last, int* bins)
+{
+    RasterTarget* area = &ctx->tiledTarget;
+    int areaX1 = area->originX + area->width - 1;
+    int areaY1 = area->originY + area->height - 1;
+
+    for (int i = first; i < last; ++i)
+    {
+        const RenderTriangle* t = &ctx->tiledTris[i];
+        RasterSetup* s = &ctx->setupBuffer[i];
+        Uint32 color = MapRasterTriangleColor(ctx, ctx->tiledFormat, t->color);
+
+        if (!SetupRasterTriangle(ctx, t, ctx->tiledProgram, color, s))
+        {
+            s->minX = 1;
+            s->maxX = 0;
+            continue;
+        }
+
+        SetupRasterShading(ctx->tiledFormat, s);
+
+        // Clipped to the area being drawn (an empty box means it's outside)
+        if (s->minX < area->originX) s->minX = area->originX;
+        if (s->minY < area->originY) s->minY = area->originY;
+        if (s->maxX > areaX1) s->maxX = areaX1;
+        if (s->maxY > areaY1) s->maxY = areaY1;
+        if (s->minY > s->maxY)
+            s->maxX = s->minX - 1;
+    }
+
+    memset(bins, 0, sizeof(int) * ctx->tilesX * ctx->tilesY);
+    WalkRasterBins(ctx, area->originX, area->originY, first, last, bins, false);
+}
+
+
+
+//
+// Draws tiles until there are none left.
+// Each tile is drawn into the worker's own color and depth memory, then copied to the surface.
+// Tiles never overlap, so no locking is needed.
+//
+void RasterizeTiles(RasterContext* ctx, RasterWorker* worker)
+{
+    int tileCount = ctx->tilesX * ctx->tilesY;
+
+    while (true)
+    {
+        int tile = SDL_AddAtomicInt(&ctx->nextTile, 1);
+        if (tile >= tileCount)
+            break;
+
+        int first = ctx->binStart[tile];
+        int last = ctx->binStart[tile + 1];
+        if (first == last)
+            continue;
+
+        RasterTarget local;
+        local.pixels = worker->color;
+        local.pitch = RASTER_TILE_SIZE;
+        local.depth = worker->depth;
+        local.hiz = ctx->hiZ ? worker->hiz : NULL;
+        int tileX = (tile % ctx->tilesX) * RASTER_TILE_SIZE;
+        int tileY = (tile / ctx->tilesX) * RASTER_TILE_SIZE;
+        local.originX = ctx->tiledTarget.originX + tileX;
+        local.originY = ctx->tiledTarget.originY + tileY;
+        local.width = SDL_min(RASTER_TILE_SIZE, ctx->tiledTarget.width - tileX);
+        local.height = SDL_min(RASTER_TILE_SIZE, ctx->tiledTarget.height - tileY);
+        local.blocked = false;
+
+        // Load whatever is already on the surface (background, debug lines)
+        for (int y = 0; y < local.height; ++y)
+        {
+            memcpy(local.pixels + y * local.pitch,
+                   ctx->tiledTarget.pixels + (tileY + y) * ctx->tiledTarget.pitch + tileX,
+                   sizeof(Uint32) * local.width);
+        }
+        ClearDepthBuffer(&local);
+
+        for (int i = first; i < last; ++i)
+            FillRasterTriangle(&local, &ctx->setupBuffer[ctx->binTris[i]]);
+
+        // Store the finished tile
+        for (int y = 0; y < local.height; ++y)
+        {
+            memcpy(ctx->tiledTarget.pixels + (tileY + y) * ctx->tiledTarget.pitch + tileX,
+                   local.pixels + y * local.pitch,
+                   sizeof(Uint32) * local.width);
+        }
+    }
+}
+
+
+
+//
+// Does a worker's part of the step the tiled frame is at. Setup and binning split the triangles
+// into one slice per thread, drawing splits the screen into tiles. Either way the worker takes the
+// next one until there are none left (a worker may do more than one, the slices keep their own bins).
+//
+static void DoRasterWork(RasterContext* ctx, RasterWorker* worker)
+{
+    if (ctx->workPhase == RASTER_PHASE_DRAW)
+    {
+        RasterizeTiles(ctx, worker);
+        return;
+    }
+
+    while (true)
+    {
+        int slice = SDL_AddAtomicInt(&ctx->nextTile, 1);
+        if (slice >= ctx->threadCount)
+            break;
+
+        int first = (int)((Sint64)ctx->tiledCount * slice / ctx->threadCount);
+        int last = (int)((Sint64)ctx->tiledCount * (slice + 1) / ctx->threadCount);
+        int* bins = &ctx->binFill[slice * ctx->tilesX * ctx->tilesY];
+
+        if (ctx->workPhase == RASTER_PHASE_SETUP)
+            SetupRasterSlice(ctx, first, last, bins);
+        else
+            WalkRasterBins(ctx, ctx->tiledTarget.originX, ctx->tiledTarget.originY, first, last, bins, true);
+    }
+}
+
+
+
+//
+// Runs one step on every worker, the calling thread included, and waits until all of them are done
+//
+static void RunRasterWorkers(RasterContext* ctx, int phase)
+{
+    ctx->workPhase = phase;
+    SDL_SetAtomicInt(&ctx->nextTile, 0);
+
+    for (int i = 1; i < ctx->threadCount; ++i)
+        SDL_SignalSemaphore(ctx->workStart);
+
+    DoRasterWork(ctx, &ctx->workers[0]);
+
+    for (int i = 1; i < ctx->threadCount; ++i)
+        SDL_WaitSemaphore(ctx->workDone);
+}
+
+
+
+//
+// Entry point for the worker threads. They sleep until a frame is ready.
+//
+int RasterWorkerMain(void* data)
+{
+    RasterWorker* worker = data;
+    RasterContext* ctx = worker->ctx;
+
+    while (true)
+    {
+        SDL_WaitSemaphore(ctx->workStart);
+        if (ctx->workersQuit)
+            break;
+
+        DoRasterWork(ctx, worker);
+        SDL_SignalSemaphore(ctx->workDone);
+    }
+
+    return 0;
+}
+
+
+
+//
+// Starts (or restarts) the worker pool. The calling thread counts as one of the threads.
+// A count of 0 stops every worker. If the pool can't be created that's remembered, so the tiled mode
+// doesn't try again every frame (calling this again does).
+//
+void SetRasterThreadCount(RasterContext* ctx, int count)
+{
+    if (count > RASTER_MAX_THREADS)
+        count = RASTER_MAX_THREADS;
+
+    if (count == ctx->threadCount)
+        return;
+
+    // Stop the old workers
+    if (ctx->workers != NULL)
+    {
+        ctx->workersQuit = true;
+        for (int i = 1; i < ctx->threadCount; ++i)
+            SDL_SignalSemaphore(ctx->workStart);
+        for (int i = 1; i < ctx->threadCount; ++i)
+            SDL_WaitThread(ctx->workers[i].thread, NULL);
+
+        SDL_DestroySemaphore(ctx->workStart);
+        SDL_DestroySemaphore(ctx->workDone);
+        free(ctx->workers);
+
+        ctx->workers = NULL;
+        ctx->workStart = ctx->workDone = NULL;
+        ctx->threadCount = 0;
+        ctx->workersQuit = false;
+    }
+
+    if (count <= 0)
+        return;
+
+    ctx->workers = calloc(count, sizeof(RasterWorker));
+    ctx->workStart = SDL_CreateSemaphore(0);
+    ctx->workDone = SDL_CreateSemaphore(0);
+
+    if (!ctx->workers || !ctx->workStart || !ctx->workDone)
+    {
+        printf("Failed to create raster workers\n");
+        if (ctx->workStart) SDL_DestroySemaphore(ctx->workStart);
+        if (ctx->workDone)  SDL_DestroySemaphore(ctx->workDone);
+        free(ctx->workers);
+        ctx->workers = NULL;
+        ctx->workStart = ctx->workDone = NULL;
+        ctx->workersFailed = true;
+        return;
+    }
+
+    ctx->workersFailed = false;
+    ctx->threadCount = count;
+    for (int i = 0; i < count; ++i)
+        ctx->workers[i].ctx = ctx;
+
+    // Worker 0 is the calling thread
+    for (int i = 1; i < count; ++i)
+    {
+        ctx->workers[i].thread = SDL_CreateThread(RasterWorkerMain, "RasterWorker", &ctx->workers[i]);
+
+        if (ctx->workers[i].thread == NULL)
+        {
+            printf("Failed to create raster thread %d\n", i);
+            ctx->threadCount = i;
+            break;
+        }
+    }
+}
+
+
+
+//
+// Gets the number of threads used by RasterizeTrianglesTiled
+//
+int GetRasterThreadCount(const RasterContext* ctx)
+{
+    return ctx->threadCount;
+}
+
+
+
+//
+// Same result as RasterizeTriangles, but the screen is split into tiles that
+// are drawn in parallel by the worker pool.
+//
+void RasterizeTrianglesTiled(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count)
+{
+    RasterizeTrianglesTiledRect(ctx, surface, program, tris, count, NULL);
+}
+
+
+
+//
+// Tiled version of RasterizeTrianglesRect, the tiles start at the corner of the rectangle
+//
+void RasterizeTrianglesTiledRect(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count, const SDL_Rect* rect)
+{
+    // Default to one thread per core (only tried once, a failure isn't retried every frame)
+    if (ctx->threadCount == 0 && !ctx->workersFailed)
+        SetRasterThreadCount(ctx, SDL_GetNumLogicalCPUCores());
+
+    if (ctx->threadCount == 0)
+    {
+        RasterizeTrianglesRect(ctx, surface, program, tris, count, rect);
+        return;
+    }
+
+    if (surface == NULL)
+        return;
+
+    if (count > ctx->setupCapacity)
+    {
+        free(ctx->setupBuffer);
+        ctx->setupBuffer = malloc(sizeof(RasterSetup) * count);
+        ctx->setupCapacity = ctx->setupBuffer ? count : 0;
+
+        if (!ctx->setupBuffer)
+        {
+            printf("Failed to allocate triangle setup buffer\n");
+            return;
+        }
+    }
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_LockSurface(surface);
+
+    if (surface->pixels == NULL || SDL_BYTESPERPIXEL(surface->format) != 4)
+    {
+        if (SDL_MUSTLOCK(surface))
+            SDL_UnlockSurface(surface);
+        return;
+    }
+
+    ctx->tiledTarget.pixels = (Uint32*)surface->pixels;
+    ctx->tiledTarget.pitch = surface->pitch / 4;
+    ctx->tiledTarget.depth = NULL;     // Each worker has its own tile depth
+    ctx->tiledTarget.hiz = NULL;
+    ctx->tiledTarget.originX = 0;
+    ctx->tiledTarget.originY = 0;
+    ctx->tiledTarget.width = surface->w;
+    ctx->tiledTarget.height = surface->h;
+
+    if (!LimitRasterTarget(&ctx->tiledTarget, rect))
+    {
+        if (SDL_MUSTLOCK(surface))
+            SDL_UnlockSurface(surface);
+        return;
+    }
+
+    // Every worker sets up its own range of the triangles and counts them into its own bins. The bins
+    // are laid out from those counts, then every worker files its range into them and they draw the tiles.
+    ctx->tiledTris = tris;
+    ctx->tiledCount = count;
+    ctx->tiledProgram = program;
+    ctx->tiledFormat = SDL_GetPixelFormatDetails(surface->format);
+    ctx->setupCount = count;
+
+    if (PrepareRasterBins(ctx, ctx->tiledTarget.width, ctx->tiledTarget.height, ctx->threadCount))
+    {
+        RunRasterWorkers(ctx, RASTER_PHASE_SETUP);
+
+        if (StartRasterBins(ctx, ctx->threadCount))
+        {
+            RunRasterWorkers(ctx, RASTER_PHASE_BIN);
+            RunRasterWorkers(ctx, RASTER_PHASE_DRAW);
+        }
+    }
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+}
+
+
+
+
+
+////////////////////////////////////////////////
+// Span buffer (no depth buffer, no overdraw) //
+////////////////////////////////////////////////
+
+
+//
+// Edge test of the z-buffer kernels for pixel x, with the row part of the edge function already worked out
+//
+SDL_FORCE_INLINE bool EdgeInside(float row, float A, bool topLeft, int x)
+{
+    float w = row + A * (x + 0.5f);
+    return topLeft ? w >= 0 : w > 0;
+}
+
+
+
+//
+// Finds the pixels of row y (between minX and maxX) that are inside a triangle, with the exact same
+// edge math and fill rule as the z-buffer kernels. Each edge function only grows (or only shrinks) along
+// the row, so the inside pixels are one run: a first guess from where the edges cross the row is moved
+// until it agrees with the per pixel test. invA is 1 / A of every edge (only used for the guess).
+//
+static bool RasterRowSpan(const RasterSetup* setup, const float invA[3], int y, int minX, int maxX, int* x0, int* x1)
+{
+    float fy = y + 0.5f;
+    int lo = minX;
+    int hi = maxX;
+
+    for (int i = 0; i < 3 && lo <= hi; ++i)
+    {
+        float A = setup->A[i];
+        float row = setup->B[i] * fy + setup->C[i];
+        bool topLeft = setup->topLeft[i];
+
+        if (A == 0)
+        {
+            if (!EdgeInside(row, A, topLeft, lo))
+                return false;
+        }
+        else
+        {
+            // Pixel center where the edge crosses the row, kept near the span so the fixing up is short
+            float cross = -row * invA[i] - 0.5f;
+            int x = (cross < lo - 1) ? lo - 1 : (cross > hi + 1) ? hi + 1 : (int)floorf(cross);
+
+            if (A > 0)
+            {
+                // Inside from x onwards
+                while (x > lo && EdgeInside(row, A, topLeft, x - 1)) --x;
+                while (x <= hi && !EdgeInside(row, A, topLeft, x)) ++x;
+                lo = SDL_max(lo, x);
+            }
+            else
+            {
+                // Inside up to x
+                while (x < hi && EdgeInside(row, A, topLeft, x + 1)) ++x;
+                while (x >= lo && !EdgeInside(row, A, topLeft, x)) --x;
+                hi = SDL_min(hi, x);
+            }
+        }
+    }
+
+    *x0 = lo;
+    *x1 = hi;
+    return lo <= hi;
+}
+
+
+
+//
+// Takes a span node from the free list or the end of the pool (-1 when out of memory)
+//
+static int NewRasterSpan(RasterContext* ctx, int x0, int x1, int next)
+{
+    int index = ctx->spanFree;
+    if (index >= 0)
+        ctx->spanFree = ctx->spanPool[index].next;
+    else
+    {
+        if (ctx->spanPoolCount == ctx->spanPoolCapacity)
+        {
+            int capacity = (ctx->spanPoolCapacity > 0) ? ctx->spanPoolCapacity * 2 : 4096;
+            RasterSpan* grown = realloc(ctx->spanPool, sizeof(RasterSpan) * capacity);
+            if (!grown)
+                return -1;
+
+            ctx->spanPool = grown;
+            ctx->spanPoolCapacity = capacity;
+        }
+        index = ctx->spanPoolCount++;
+    }
+
+    ctx->spanPool[index] = (RasterSpan){ x0, x1, next };
+    return index;
+}
+
+
+
+//
+// Draws the parts of pixels x0 to x1 (inclusive) of a row that nothing covers yet,
+// then marks them covered. Spans that touch are merged, so a row stays a short list.
+// Returns 1 when the whole row (0 to width - 1) is covered afterwards, 0 when it isn't, and -1 when there's
+// no memory for the new span. The span is allocated first, so nothing is drawn that isn't marked covered.
+//
+static int CoverRasterSpan(RasterContext* ctx, Uint32* colorRow, int* head, int x0, int x1, int width, Uint32 color)
+{
+    int merged = NewRasterSpan(ctx, x0, x1, -1);
+    if (merged < 0)
+        return -1;
+
+    int end = x1 + 1;
+    int prev = -1;
+    int cur = *head;
+
+    // Skip the spans that end before this one starts (and don't touch it)
+    while (cur >= 0 && ctx->spanPool[cur].x1 < x0)
+    {
+        prev = cur;
+        cur = ctx->spanPool[cur].next;
+    }
+
+    // Draw the gaps between the spans this one overlaps, and fold those spans into one
+    int x = x0;
+    int mergedX0 = x0;
+    int mergedX1 = end;
+    while (cur >= 0 && ctx->spanPool[cur].x0 <= end)
+    {
+        RasterSpan* span = &ctx->spanPool[cur];
+        for (; x < span->x0; ++x)
+            colorRow[x] = color;
+        x = SDL_max(x, span->x1);
+
+        mergedX0 = SDL_min(mergedX0, span->x0);
+        mergedX1 = SDL_max(mergedX1, span->x1);
+
+        int next = span->next;
+        span->next = ctx->spanFree;
+        ctx->spanFree = cur;
+        cur = next;
+    }
+
+    for (; x < end; ++x)
+        colorRow[x] = color;
+
+    ctx->spanPool[merged] = (RasterSpan){ mergedX0, mergedX1, cur };
+    if (prev >= 0)
+        ctx->spanPool[prev].next = merged;
+    else
+        *head = merged;
+
+    return (mergedX0 <= 0 && mergedX1 >= width && prev < 0) ? 1 : 0;
+}
+
+
+
+//
+// Draws triangles that are sorted front to back without a depth buffer. Every row keeps a list of the
+// spans that are already covered, so each pixel is only written by the first (closest) triangle that
+// covers it, and the work depends on the screen size instead of how many layers are stacked up.
+// Like the painter's algorithm it goes by whole triangles, so triangles that cut through each other
+// can come out in the wrong order where the z-buffer would split them.
+//
+void RasterizeTrianglesSpans(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, const RenderTriangle* tris, int count)
+{
+    if (surface == NULL || surface->pixels == NULL || SDL_BYTESPERPIXEL(surface->format) != 4)
+        return;
+
+    int width = SDL_min(program.width, surface->w);
+    int height = SDL_min(program.height, surface->h);
+
+    if (height > ctx->spanRowCapacity)
+    {
+        free(ctx->spanRows);
+        ctx->spanRows = malloc(sizeof(int) * height);
+        ctx->spanRowCapacity = ctx->spanRows ? height : 0;
+        if (!ctx->spanRows)
+            return;
+    }
+
+    for (int y = 0; y < height; ++y)
+        ctx->spanRows[y] = -1;
+    ctx->spanPoolCount = 0;
+    ctx->spanFree = -1;
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_LockSurface(surface);
+
+    const SDL_PixelFormatDetails* format = SDL_GetPixelFormatDetails(surface->format);
+    int fullRows = 0;
+    bool failed = false;
+
+    for (int i = 0; i < count && fullRows < height && !failed; ++i)
+    {
+        RasterSetup setup;
+        if (!SetupRasterTriangle(ctx, &tris[i], program, MapRasterColor(format, tris[i].color), &setup))
+            continue;
+
+        int maxX = SDL_min(setup.maxX, width - 1);
+        int maxY = SDL_min(setup.maxY, height - 1);
+        float invA[3];
+        for (int k = 0; k < 3; ++k)
+            invA[k] = (setup.A[k] != 0) ? 1.0f / setup.A[k] : 0.0f;
+
+        for (int y = setup.minY; y <= maxY; ++y)
+        {
+            // Skip the edge math when the triangle's whole width is already covered on this row
+            int span = ctx->spanRows[y];
+            while (span >= 0 && ctx->spanPool[span].x1 <= setup.minX)
+                span = ctx->spanPool[span].next;
+            if (span >= 0 && ctx->spanPool[span].x0 <= setup.minX && ctx->spanPool[span].x1 > maxX)
+                continue;
+
+            int x0, x1;
+            if (!RasterRowSpan(&setup, invA, y, setup.minX, maxX, &x0, &x1))
+                continue;
+
+            Uint32* colorRow = (Uint32*)((Uint8*)surface->pixels + (Sint64)y * surface->pitch);
+            int covered = CoverRasterSpan(ctx, colorRow, &ctx->spanRows[y], x0, x1, width, setup.color);
+
+            // Without the span, triangles further back would draw over this one, so the pass stops here
+            if (covered < 0)
+            {
+                printf("Failed to grow the span buffer\n");
+                failed = true;
+                break;
+            }
+            fullRows += covered;
+        }
+    }
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+}
+
+
+
+
+
+//////////////////////////////////////////////
+// Buffer fills and pixel format conversion //
+//////////////////////////////////////////////
+
+
+//
+// Fills "count" 32 bit values. Streaming stores go around the cache, which is only worth it when the
+// buffer is too big to stay in it anyway, and need an sfence before anything else reads the buffer.
+//
+static void FillRasterBufferScalar(Uint32* buffer, int count, Uint32 value)
+{
+    for (int i = 0; i < count; ++i)
+        buffer[i] = value;
+}
+
+
+
+#ifdef SDL_SSE2_INTRINSICS
+SDL_TARGETING("sse2") static void FillRasterBufferSSE2(Uint32* buffer, int count, Uint32 value, bool stream)
+{
+    int i = 0;
+    for (; i < count && ((uintptr_t)(buffer + i) & 15) != 0; ++i)
+        buffer[i] = value;
+
+    __m128i v = _mm_set1_epi32((int)value);
+    if (stream)
+    {
+        for (; i + 16 <= count; i += 16)
+        {
+            _mm_stream_si128((__m128i*)(buffer + i), v);
+            _mm_stream_si128((__m128i*)(buffer + i + 4), v);
+            _mm_stream_si128((__m128i*)(buffer + i + 8), v);
+            _mm_stream_si128((__m128i*)(buffer + i + 12), v);
+        }
+    }
+    else
+    {
+        for (; i + 16 <= count; i += 16)
+        {
+            _mm_store_si128((__m128i*)(buffer + i), v);
+            _mm_store_si128((__m128i*)(buffer + i + 4), v);
+            _mm_store_si128((__m128i*)(buffer + i + 8), v);
+            _mm_store_si128((__m128i*)(buffer + i + 12), v);
+        }
+    }
+
+    for (; i < count; ++i)
+        buffer[i] = value;
+}
+#endif
+
+
+
+#ifdef SDL_AVX2_INTRINSICS
+SDL_TARGETING("avx2") static void FillRasterBufferAVX2(Uint32* buffer, int count, Uint32 value, bool stream)
+{
+    int i = 0;
+    for (; i < count && ((uintptr_t)(buffer + i) & 31) != 0; ++i)
+        buffer[i] = value;
+
+    __m256i v = _mm256_set1_epi32((int)value);
+    if (stream)
+    {
+        for (; i + 16 <= count; i += 16)
+        {
+            _mm256_stream_si256((__m256i*)(buffer + i), v);
+            _mm256_stream_si256((__m256i*)(buffer + i + 8), v);
+        }
+    }
+    else
+    {
+        for (; i + 16 <= count; i += 16)
+        {
+            _mm256_store_si256((__m256i*)(buffer + i), v);
+            _mm256_store_si256((__m256i*)(buffer + i + 8), v);
+        }
+    }
+
+    for (; i < count; ++i)
+        buffer[i] = value;
+}
+#endif
+
+
+
+//
+// Fills "rows" rows of "count" values, "pitch" bytes apart, with the kernel picked by SetRasterSIMD.
+// Whether to stream is decided for the whole area, since a row on its own is always small.
+//
+static void FillRasterRows(void* buffer, int pitch, int count, int rows, Uint32 value)
+{
+    bool stream = (Sint64)count * rows * sizeof(Uint32) >= RASTER_STREAM_FILL_BYTES;
+    int level = GetRasterSIMD();
+
+    for (int y = 0; y < rows; ++y)
+    {
+        Uint32* row = (Uint32*)((Uint8*)buffer + (Sint64)y * pitch);
+
+#ifdef SDL_AVX2_INTRINSICS
+        if (level == RASTER_SIMD_AVX2)
+        {
+            FillRasterBufferAVX2(row, count, value, stream);
+            continue;
+        }
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+        if (level == RASTER_SIMD_SSE2)
+        {
+            FillRasterBufferSSE2(row, count, value, stream);
+            continue;
+        }
+#endif
+        FillRasterBufferScalar(row, count, value);
+    }
+
+#ifdef SDL_SSE2_INTRINSICS
+    if (stream && level != RASTER_SIMD_SCALAR)
+        _mm_sfence();
+#endif
+}
+
+
+
+void FillRasterBuffer(Uint32* buffer, int count, Uint32 value)
+{
+    FillRasterRows(buffer, 0, count, 1, value);
+}
+
+
+
+void FillRasterDepth(float* depth, int count, float value)
+{
+    Uint32 bits;
+    SDL_memcpy(&bits, &value, sizeof(bits));
+    FillRasterRows(depth, 0, count, 1, bits);
+}
+
+
+
+//
+// Fills a rectangle of a 32 bit surface (the whole surface when rect is NULL) with a color
+//
+bool FillRasterSurface(SDL_Surface* surface, const SDL_Rect* rect, Color color)
+{
+    if (surface == NULL || SDL_BYTESPERPIXEL(surface->format) != 4)
+        return false;
+
+    SDL_Rect area = {0, 0, surface->w, surface->h};
+    if (rect != NULL && !SDL_GetRectIntersection(rect, &area, &area))
+        return true;
+
+    if (SDL_MUSTLOCK(surface) && !SDL_LockSurface(surface))
+        return false;
+
+    Uint32 value = MapRasterColor(SDL_GetPixelFormatDetails(surface->format), color);
+    Uint8* first = (Uint8*)surface->pixels + (Sint64)area.y * surface->pitch + area.x * 4;
+    FillRasterRows(first, surface->pitch, area.w, area.h, value);
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+    return true;
+}
+
+
+
+Uint32 MapRasterColor(const SDL_PixelFormatDetails* format, Color color)
+{
+    if (!IsByteChannelFormat(format))
+        return SDL_MapRGBA(format, NULL, color.r, color.g, color.b, color.a);
+
+    // Same as SDL_MapRGBA: no alpha bits means alpha is dropped
+    return ((Uint32)color.r << format->Rshift) | ((Uint32)color.g << format->Gshift) |
+           ((Uint32)color.b << format->Bshift) | (((Uint32)color.a << format->Ashift) & format->Amask);
+}
+
+
+
+#ifdef SDL_AVX2_INTRINSICS
+//
+// 8 colors at a time: every channel byte is masked out of the packed Color and shifted into place.
+// Color is r, g, b, a in memory, so on little endian CPUs r is the low byte of each 32 bit lane.
+//
+SDL_TARGETING("avx2") static int MapRasterColorsAVX2(const SDL_PixelFormatDetails* format, const Color* colors, Uint32* pixels, int count)
+{
+    __m256i byteMask = _mm256_set1_epi32(0xFF);
+    __m256i alphaMask = _mm256_set1_epi32((int)format->Amask);
+    __m128i rShift = _mm_cvtsi32_si128(format->Rshift);
+    __m128i gShift = _mm_cvtsi32_si128(format->Gshift);
+    __m128i bShift = _mm_cvtsi32_si128(format->Bshift);
+    __m128i aShift = _mm_cvtsi32_si128(format->Ashift);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(colors + i));
+        __m256i r = _mm256_sll_epi32(_mm256_and_si256(c, byteMask), rShift);
+        __m256i g = _mm256_sll_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 8), byteMask), gShift);
+        __m256i b = _mm256_sll_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 16), byteMask), bShift);
+        __m256i a = _mm256_and_si256(_mm256_sll_epi32(_mm256_srli_epi32(c, 24), aShift), alphaMask);
+
+        _mm256_storeu_si256((__m256i*)(pixels + i), _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, a)));
+    }
+    return i;
+}
+
+
+
+SDL_TARGETING("avx2") static int UnmapRasterPixelsAVX2(const SDL_PixelFormatDetails* format, const Uint32* pixels, Color* colors, int count)
+{
+    __m256i byteMask = _mm256_set1_epi32(0xFF);
+    __m128i rShift = _mm_cvtsi32_si128(format->Rshift);
+    __m128i gShift = _mm_cvtsi32_si128(format->Gshift);
+    __m128i bShift = _mm_cvtsi32_si128(format->Bshift);
+    __m128i aShift = _mm_cvtsi32_si128(format->Ashift);
+
+    // Without alpha bits the alpha is always 255, like SDL_GetRGBA
+    __m256i opaque = _mm256_set1_epi32((format->Abits == 0) ? (int)0xFF000000u : 0);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256i r = _mm256_and_si256(_mm256_srl_epi32(p, rShift), byteMask);
+        __m256i g = _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, gShift), byteMask), 8);
+        __m256i b = _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, bShift), byteMask), 16);
+        __m256i a = (format->Abits == 0) ? opaque : _mm256_slli_epi32(_mm256_srl_epi32(p, aShift), 24);
+
+        _mm256_storeu_si256((__m256i*)(colors + i), _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, a)));
+    }
+    return i;
+}
+#endif
+
+
+
+#ifdef SDL_SSE2_INTRINSICS
+SDL_TARGETING("sse2") static int MapRasterColorsSSE2(const SDL_PixelFormatDetails* format, const Color* colors, Uint32* pixels, int count)
+{
+    __m128i byteMask = _mm_set1_epi32(0xFF);
+    __m128i alphaMask = _mm_set1_epi32((int)format->Amask);
+    __m128i rShift = _mm_cvtsi32_si128(format->Rshift);
+    __m128i gShift = _mm_cvtsi32_si128(format->Gshift);
+    __m128i bShift = _mm_cvtsi32_si128(format->Bshift);
+    __m128i aShift = _mm_cvtsi32_si128(format->Ashift);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i*)(colors + i));
+        __m128i r = _mm_sll_epi32(_mm_and_si128(c, byteMask), rShift);
+        __m128i g = _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(c, 8), byteMask), gShift);
+        __m128i b = _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(c, 16), byteMask), bShift);
+        __m128i a = _mm_and_si128(_mm_sll_epi32(_mm_srli_epi32(c, 24), aShift), alphaMask);
+
+        _mm_storeu_si128((__m128i*)(pixels + i), _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a)));
+    }
+    return i;
+}
+
+
+
+SDL_TARGETING("sse2") static int UnmapRasterPixelsSSE2(const SDL_PixelFormatDetails* format, const Uint32* pixels, Color* colors, int count)
+{
+    __m128i byteMask = _mm_set1_epi32(0xFF);
+    __m128i rShift = _mm_cvtsi32_si128(format->Rshift);
+    __m128i gShift = _mm_cvtsi32_si128(format->Gshift);
+    __m128i bShift = _mm_cvtsi32_si128(format->Bshift);
+    __m128i aShift = _mm_cvtsi32_si128(format->Ashift);
+    __m128i opaque = _mm_set1_epi32((format->Abits == 0) ? (int)0xFF000000u : 0);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)(pixels + i));
+        __m128i r = _mm_and_si128(_mm_srl_epi32(p, rShift), byteMask);
+        __m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, gShift), byteMask), 8);
+        __m128i b = _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, bShift), byteMask), 16);
+        __m128i a = (format->Abits == 0) ? opaque : _mm_slli_epi32(_mm_srl_epi32(p, aShift), 24);
+
+        _mm_storeu_si128((__m128i*)(colors + i), _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a)));
+    }
+    return i;
+}
+#endif
+
+
+
+//
+// Converts colors to pixels of a format, the SIMD kernels do the 8 bit channel formats
+//
+void MapRasterColors(const SDL_PixelFormatDetails* format, const Color* colors, Uint32* pixels, int count)
+{
+    int done = 0;
+
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    if (IsByteChannelFormat(format))
+    {
+#ifdef SDL_AVX2_INTRINSICS
+        if (GetRasterSIMD() == RASTER_SIMD_AVX2)
+            done = MapRasterColorsAVX2(format, colors, pixels, count);
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+        if (GetRasterSIMD() == RASTER_SIMD_SSE2)
+            done = MapRasterColorsSSE2(format, colors, pixels, count);
+#endif
+    }
+#endif
+
+    for (int i = done; i < count; ++i)
+        pixels[i] = MapRasterColor(format, colors[i]);
+}
+
+
+
+//
+// Converts pixels of a format back to colors
+//
+void UnmapRasterPixels(const SDL_PixelFormatDetails* format, const Uint32* pixels, Color* colors, int count)
+{
+    int done = 0;
+
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    if (IsByteChannelFormat(format))
+    {
+#ifdef SDL_AVX2_INTRINSICS
+        if (GetRasterSIMD() == RASTER_SIMD_AVX2)
+            done = UnmapRasterPixelsAVX2(format, pixels, colors, count);
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+        if (GetRasterSIMD() == RASTER_SIMD_SSE2)
+            done = UnmapRasterPixelsSSE2(format, pixels, colors, count);
+#endif
+    }
+#endif
+
+    bool bytes = IsByteChannelFormat(format);
+    for (int i = done; i < count; ++i)
+    {
+        Uint32 p = pixels[i];
+        if (bytes)
+            colors[i] = (Color){ (p >> format->Rshift) & 0xFF, (p >> format->Gshift) & 0xFF, (p >> format->Bshift) & 0xFF,
+                                 (format->Abits == 0) ? 0xFF : (p >> format->Ashift) & 0xFF };
+        else
+            SDL_GetRGBA(p, format, NULL, &colors[i].r, &colors[i].g, &colors[i].b, &colors[i].a);
+    }
+}
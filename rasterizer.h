@@ -0,0 +1,280 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include "structures.h"
+#include "SDL3/SDL.h"
+
+
+// Tiles are square blocks of pixels that get drawn independently by the worker threads
+#define RASTER_TILE_SIZE 64
+#define RASTER_MAX_THREADS 64
+
+// Fills of at least this many bytes use non-temporal stores, which don't push the rest of the frame out of the cache
+#define RASTER_STREAM_FILL_BYTES (512 * 1024)
+
+// Hi-z cells are square blocks of pixels with a known depth range, used to skip hidden triangles
+#define RASTER_HIZ_SIZE 8
+
+
+// Inner loop kernels, from slowest to fastest
+typedef enum RasterSIMD
+{
+    RASTER_SIMD_SCALAR = 0,     // One pixel at a time
+    RASTER_SIMD_SSE2,           // 4 pixels at a time
+    RASTER_SIMD_AVX2            // 8 pixels at a time (a whole hi-z cell row)
+} RasterSIMD;
+
+
+// Render state bits for the native rasterizer (they can be combined).
+// Every combination has its own kernel, made from one template at compile time, so the inner loops
+// never test the state per pixel. Only the default state has SIMD kernels.
+typedef enum RasterState
+{
+    RASTER_STATE_DEFAULT = 0,           // Filled, opaque and depth tested
+    RASTER_STATE_NO_DEPTH = 1 << 0,     // No depth test or write, triangles are drawn in the order they come in
+    RASTER_STATE_WIREFRAME = 1 << 1,    // Only the pixels less than a pixel away from an edge
+    RASTER_STATE_BLEND = 1 << 2,        // Blended with the color alpha, depth is tested but not written
+    RASTER_STATE_SMOOTH = 1 << 3,       // Gouraud shading: the vertex colors are interpolated over the triangle
+    RASTER_STATE_COUNT = 1 << 4
+} RasterState;
+
+
+// How RasterizeTriangles stores color and depth while it draws
+typedef enum RasterLayout
+{
+    RASTER_LAYOUT_LINEAR = 0,   // Straight into the surface, row after row
+    RASTER_LAYOUT_BLOCKED       // 8x8 blocks (one hi-z cell each) one after the other, copied to the surface at the end
+} RasterLayout;
+
+
+
+//////////////////////////////////////////////////////////
+// Native triangle rasterizer for the software renderer //
+//////////////////////////////////////////////////////////
+
+
+// Depth range of one 8x8 cell of the depth buffer, used to skip triangles that are hidden.
+// Both bounds are conservative: zFar is never more than the real farthest 1/z and zNear never less than the closest.
+typedef struct RasterHiZCell
+{
+    float zFar;
+    float zNear;
+    bool stale;     // Pixels were drawn since zFar was last computed (it may be too low)
+} RasterHiZCell;
+
+
+// The memory the rasterizer draws into.
+// Depth is stored as 1/z (inverse view depth), so bigger values are closer
+// and a cleared depth of 0 means "infinitely far away".
+// originX/originY is the screen position of the first pixel, so a target can also be a single tile.
+// A blocked target keeps every 8x8 hi-z cell in 64 pixels in a row (for both color and depth), so the
+// rows of a cell are next to each other in memory. Its buffers are padded out to whole cells and pitch isn't used.
+typedef struct RasterTarget
+{
+    Uint32* pixels;     // Color buffer (32 bit pixels)
+    int pitch;          // Number of pixels per row in the color buffer
+    float* depth;       // Depth buffer (width * height floats)
+    RasterHiZCell* hiz; // Hi-z cells, row by row (NULL turns hi-z off)
+    int originX;
+    int originY;
+    int width;
+    int height;
+    bool blocked;       // RASTER_LAYOUT_BLOCKED instead of rows
+} RasterTarget;
+
+
+// A run of covered pixels in one row of the span buffer, x0 up to (not including) x1
+typedef struct RasterSpan
+{
+    int x0;
+    int x1;
+    int next;       // Next span to the right in the pool (-1 at the end of the row)
+} RasterSpan;
+
+
+// A triangle after setup, ready to be filled.
+// Edge i is the edge opposite vertex i: w_i = A[i]*x + B[i]*y + C[i]
+typedef struct RasterSetup
+{
+    float A[3], B[3], C[3];
+    bool topLeft[3];        // Pixels exactly on a top or left edge are drawn
+    float x0, y0;           // Screen position of vertex 0
+    float z0, zdx, zdy;     // 1/z plane: z0 + zdx*(x - x0) + zdy*(y - y0)
+    float zPad;             // How far rounding can push a pixel's 1/z off the plane
+    int minX, minY, maxX, maxY;
+    Uint32 color;           // Premultiplied by the alpha in the blend state
+    int state;              // RasterState bits
+    Uint32 invAlpha;        // 255 - alpha, for blending
+    float edgeScale[3];     // 1 / length of (A[i], B[i]), turns edge values into pixels (wireframe only)
+    float shade0[3], shadeDx[3], shadeDy[3];    // Red, green and blue planes like the 1/z one (smooth only)
+    int shadeShift[3];      // Where red, green and blue go in a pixel
+    Uint32 shadeAlpha;      // The alpha bits of every pixel
+} RasterSetup;
+
+
+// A kernel that fills a set up triangle
+typedef void (*RasterFillFunc)(RasterTarget* target, const RasterSetup* setup);
+
+
+// Tile worker thread (the calling thread is worker 0)
+typedef struct RasterWorker RasterWorker;
+
+
+// Everything one renderer draws with: the buffers, the settings and the worker pool.
+// Contexts share nothing, so each one can draw on its own thread while the others do too.
+// Buffers only grow and are kept until FreeRasterContext. The SIMD level is the only setting for every context.
+typedef struct RasterContext
+{
+    // Depth buffer and its hi-z cells
+    float* depthBuffer;
+    int depthBufferSize;
+    RasterHiZCell* hizBuffer;
+    int hizBufferSize;
+    bool hiZ;
+
+    // Color buffer for the blocked layout (the depth buffer is shared with the linear one)
+    int layout;
+    Uint32* blockedColor;
+    int blockedColorSize;
+
+    // Render state of the triangles set up from now on (RasterState bits)
+    int state;
+
+    // Triangles after setup (shared with the tile workers)
+    RasterSetup* setupBuffer;
+    int setupCount;
+    int setupCapacity;
+
+    // Tile bins: triangles for tile t are binTris[binStart[t]] to binTris[binStart[t+1] - 1]
+    // (binFill has a count, then a write position, for every tile and every worker that bins triangles)
+    int* binStart;
+    int* binFill;
+    int* binTris;
+    int binTileCapacity;
+    int binFillCapacity;
+    int binTrisCapacity;
+    int tilesX;
+    int tilesY;
+
+    // Worker pool for tiled rasterizing (threadCount 0 starts one per core the first time it's needed,
+    // unless starting it failed before, then the tiled mode draws like the untiled one)
+    RasterWorker* workers;
+    int threadCount;
+    bool workersFailed;
+    SDL_Semaphore* workStart;
+    SDL_Semaphore* workDone;
+    SDL_AtomicInt nextTile;     // Next tile to draw (or slice of the triangles to set up or bin)
+    bool workersQuit;
+
+    // The frame the tiled mode is drawing, and the step the workers are at
+    RasterTarget tiledTarget;
+    const RenderTriangle* tiledTris;
+    int tiledCount;
+    WindowInfo tiledProgram;
+    const SDL_PixelFormatDetails* tiledFormat;
+    int workPhase;
+
+    // Span buffer: the covered spans of every row, as linked lists in spanPool (spanRows holds the first one, -1 is none)
+    int* spanRows;
+    int spanRowCapacity;
+    RasterSpan* spanPool;
+    int spanPoolCount;
+    int spanPoolCapacity;
+    int spanFree;
+
+    // SIMD validation: the scalar kernel's copy of the frame, and how many pixels differed last time
+    bool validateSIMD;
+    Uint32* validateColor;
+    float* validateDepth;
+    int validateSize;
+    int lastSIMDMismatches;
+} RasterContext;
+
+
+
+// Sets up an empty context with the default settings, and frees everything it holds (stopping its workers)
+void InitRasterContext(RasterContext* ctx);
+void FreeRasterContext(RasterContext* ctx);
+
+// Get a raster target for a surface (resizes the context's depth buffer if needed)
+bool GetRasterTarget(RasterContext* ctx, SDL_Surface* surface, RasterTarget* target);
+bool GetRasterBufferTarget(RasterContext* ctx, Uint32* pixels, int pitch, int width, int height, RasterTarget* target);
+
+// Sets every depth value to "infinitely far away"
+void ClearDepthBuffer(RasterTarget* target);
+
+// Hi-z skips the parts of triangles that are behind what's already drawn (on by default)
+void SetRasterHiZ(RasterContext* ctx, bool enabled);
+bool GetRasterHiZ(const RasterContext* ctx);
+
+// Project a camera space triangle and build its edge equations (for the render state that is set).
+// The smooth state also needs SetupRasterShading with the pixel format, or it's drawn flat.
+bool SetupRasterTriangle(const RasterContext* ctx, const RenderTriangle* tri, WindowInfo program, Uint32 color, RasterSetup* setup);
+void SetupRasterShading(const SDL_PixelFormatDetails* format, RasterSetup* setup);
+
+// Fill the part of one triangle that is inside the target, in its render state
+// FillRasterTriangle uses the kernel picked with SetRasterSIMD (for the default state)
+bool TriangleTouchesTile(const RasterSetup* setup, int tileX0, int tileY0, int tileX1, int tileY1);
+bool ClipRasterBounds(const RasterTarget* target, const RasterSetup* setup, int* minX, int* minY, int* maxX, int* maxY);
+void FillRasterTriangle(RasterTarget* target, const RasterSetup* setup);
+void FillRasterTriangleScalar(RasterTarget* target, const RasterSetup* setup);
+
+// Render state (RasterState bits) of everything drawn from now on, except the span buffer which is always
+// filled, opaque and flat, and the visibility buffer IDs. Other states than the default one use the linear layout.
+void SetRasterState(RasterContext* ctx, int state);
+int GetRasterState(const RasterContext* ctx);
+RasterFillFunc GetRasterFillFunc(int state);
+
+// Kernel selection, for every context. Asking for more than the CPU supports falls back to the best available one.
+int GetBestRasterSIMD();
+void SetRasterSIMD(int level);
+int GetRasterSIMD();
+
+// Memory layout used by RasterizeTriangles (linear by default). The picture is the same either way.
+void SetRasterLayout(RasterContext* ctx, int layout);
+int GetRasterLayout(const RasterContext* ctx);
+
+// Copies the pixels a blocked target drew (the ones with a depth) to a linear target of the same area
+void DetileRasterTarget(const RasterTarget* blocked, RasterTarget* linear);
+
+// When on, RasterizeTriangles also draws with the scalar kernel and reports pixels that differ
+void SetRasterValidateSIMD(RasterContext* ctx, bool validate);
+int GetRasterSIMDMismatches(const RasterContext* ctx);
+
+// Draws a list of camera space triangles into a surface with a depth buffer
+void RasterizeTriangles(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count);
+
+// Only redraws a rectangle of the surface (NULL is the whole surface), the rest keeps its pixels
+bool LimitRasterTarget(RasterTarget* target, const SDL_Rect* rect);
+void RasterizeTrianglesRect(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count, const SDL_Rect* rect);
+
+// Visibility buffer pass: draws triangleIds[i] instead of the color of triangle i into a width * height buffer
+// of IDs, with the same depth test. Uncovered pixels get 0.
+void RasterizeTriangleIDs(RasterContext* ctx, Uint32* ids, int width, int height, WindowInfo program, RenderTriangle* tris, const Uint32* triangleIds, int count);
+
+// Multi-threaded version: triangles are binned into tiles that are drawn in parallel
+bool BinRasterTriangles(RasterContext* ctx, int originX, int originY, int width, int height);
+void RasterizeTrianglesTiled(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count);
+void RasterizeTrianglesTiledRect(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, RenderTriangle* tris, int count, const SDL_Rect* rect);
+
+// Draws triangles sorted front to back without a depth buffer, every pixel is written once at most
+void RasterizeTrianglesSpans(RasterContext* ctx, SDL_Surface* surface, WindowInfo program, const RenderTriangle* tris, int count);
+
+// Size of the context's worker pool (including the calling thread). Defaults to one per CPU core.
+void SetRasterThreadCount(RasterContext* ctx, int count);
+int GetRasterThreadCount(const RasterContext* ctx);
+
+// Fill and pixel format kernels, with the SIMD level picked by SetRasterSIMD.
+// FillRasterBuffer fills count 32 bit values (any pixel format), FillRasterSurface fills a rectangle
+// of a 32 bit surface with a color (NULL is the whole surface).
+void FillRasterBuffer(Uint32* buffer, int count, Uint32 value);
+void FillRasterDepth(float* depth, int count, float value);
+bool FillRasterSurface(SDL_Surface* surface, const SDL_Rect* rect, Color color);
+
+// Color <-> pixel conversion, the same values as SDL_MapRGBA and SDL_GetRGBA
+Uint32 MapRasterColor(const SDL_PixelFormatDetails* format, Color color);
+void MapRasterColors(const SDL_PixelFormatDetails* format, const Color* colors, Uint32* pixels, int count);
+void UnmapRasterPixels(const SDL_PixelFormatDetails* format, const Uint32* pixels, Color* colors, int count);
+
+
+#endif
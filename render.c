@@ -469,10 +469,12 @@ void AddRenderTriangles(Object* GlobalObjects, int numObjects, Camera* cam, Vect
 
                 float depth = (v0.z + v1.z + v2.z) / 3.0f;
 
+                Color color = ColorScale(obj.mesh->color, brightness);
                 triangleBuffer[triCount++] = (RenderTriangle){
                     { v0, v1, v2 }, // <--- Use v0, v1, v2 here!
                     depth,
-                    ColorScale(obj.mesh->color, brightness)
+                    color,
+                    { color, color, color }
                 };
             }
             
@@ -1,15 +1,148 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "structures.h"
 #include "softwareRender.h"
+#include "rasterizer.h"
 #include "SDL3/SDL.h"
 
 
-// Global variables
-RenderTriangle* triangleBuffer;
-int triCount = 0;
+//
+// Makes sure a buffer has room for at least "needed" elements (keeps the contents)
+//
+static bool GrowRenderBuffer(void** buffer, int* capacity, int needed, size_t elementSize)
+{
+    if (needed <= *capacity)
+        return true;
+
+    int newCapacity = (*capacity > 0) ? *capacity : 256;
+    while (newCapacity < needed)
+        newCapacity *= 2;
+
+    void* grown = realloc(*buffer, elementSize * newCapacity);
+    if (!grown)
+        return false;
+
+    *buffer = grown;
+    *capacity = newCapacity;
+    return true;
+}
+
+
+
+// Settings the geometry thread uses wait for its frame with this first (it's with the pipelined frames below)
+static void DropPipelinedFrame(RenderContext* ctx);
+
+
+
+//
+// Frees the static BSP tree, it gets built again the next time it's needed
+//
+static void FreeStaticBSP(RenderContext* ctx)
+{
+    free(ctx->bspNodes);
+    free(ctx->bspTriangles);
+    ctx->bspNodes = NULL;
+    ctx->bspTriangles = NULL;
+    ctx->bspNodeCount = 0;
+    ctx->bspNodeCapacity = 0;
+    ctx->bspTriangleCount = 0;
+    ctx->bspTriangleCapacity = 0;
+    ctx->bspRoot = -1;
+    ctx->bspBuilt = false;
+}
+
+
+
+//
+// Starts a context with empty buffers and the default settings (only back-face culling is on)
+//
+void InitRenderContext(RenderContext* ctx)
+{
+    memset(ctx, 0, sizeof(RenderContext));
+    ctx->backFaceCulling = true;
+    ctx->frame = &ctx->renderFrames[0];
+    ctx->nextFrame = &ctx->renderFrames[1];
+    ctx->bspRoot = -1;
+
+    InitRasterContext(&ctx->raster);
+}
+
+
+
+//
+// Frees every buffer of the context and stops its threads. The settings stay, so it can be used again.
+//
+void FreeRenderContext(RenderContext* ctx)
+{
+    SetFramePipelining(ctx, false);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        RenderFrame* f = &ctx->renderFrames[i];
+        free(f->triangles);
+        free(f->objectTriangleStart);
+        free(f->triangleFaces);
+        free(f->faceTriangles);
+        free(f->sortedTriangles);
+        free(f->sortScratch);
+        free(f->vertexCache);
+        free(f->vertexColors);
+        free(f->objects);
+        *f = (RenderFrame){ 0 };
+    }
+
+    free(ctx->geometryBuffer);
+    free(ctx->frontToBack);
+    free(ctx->wireframePoints);
+    free(ctx->dirtyObjects);
+    free(ctx->sortHistory);
+    FreeStaticBSP(ctx);
+    free(ctx->bspPlanes);
+    free(ctx->bspStack);
+    ctx->bspPlanes = NULL;
+    ctx->bspStack = NULL;
+    ctx->bspPlaneCapacity = 0;
+    ctx->bspStackCapacity = 0;
+    free(ctx->visibilityBuffer);
+    free(ctx->visibilityTriangleIds);
+    free(ctx->visibilityObjectFaces);
+    free(ctx->visibilityFaceColors);
+    free(ctx->visibilityFaceShaded);
+    ctx->visibilityBuffer = NULL;
+    ctx->visibilityTriangleIds = NULL;
+    ctx->visibilityObjectFaces = NULL;
+    ctx->visibilityFaceColors = NULL;
+    ctx->visibilityFaceShaded = NULL;
+    ctx->visibilityCapacity = 0;
+    ctx->visibilityTriangleIdCapacity = 0;
+    ctx->visibilityObjectCapacity = 0;
+    ctx->visibilityFaceColorCapacity = 0;
+    ctx->visibilityFaceShadedCapacity = 0;
+    ctx->visibilityWidth = 0;
+    ctx->visibilityHeight = 0;
+    ctx->visibilityObjectCount = 0;
+    ctx->sortHistory = NULL;
+    ctx->sortHistoryCount = 0;
+    ctx->sortHistoryCapacity = 0;
+    ctx->geometryBuffer = NULL;
+    ctx->frontToBack = NULL;
+    ctx->frontToBackCapacity = 0;
+    ctx->wireframePoints = NULL;
+    ctx->dirtyObjects = NULL;
+    ctx->geometryCapacity = 0;
+    ctx->wireframePointsCapacity = 0;
+    ctx->dirtyObjectCapacity = 0;
+    ctx->dirtyObjectCount = 0;
+    ctx->dirtyFrameValid = false;
+
+    FreeRasterContext(&ctx->raster);
+}
+
+
+
 
 
 //////////////////////
@@ -147,63 +280,275 @@ Vector2 TransformAndProject(Camera* cam, Transform* obj, Vector3 p)
 //
 // Renders an objects mesh to an SDL renderer as a wireframe
 //
-void RenderWireframe(SDL_Renderer* renderer, WindowInfo program, Camera* cam, Object* obj)
+void RenderWireframe(RenderContext* ctx, SDL_Renderer* renderer, WindowInfo program, Camera* cam, Object* obj)
 {
     if (obj->mesh == NULL)
         return;
-    
-    for (int i = 0; i < obj->mesh->facesCount; ++i)
-    {
-        int* row = obj->mesh->faces[i];
-
-        // int length = sizeof(row) / sizeof(row[0]);
-        for (int j = 0; j < 3; ++j)
-        {
-            int a = row[j];
-            int b = row[(j+1)%3];
-
-            Vector3 rotatedV = {0};
-            Vector3 worldV = {0};
-
-            // First scale, then Rotate vertex A
-            worldV = obj->mesh->vertices[a];
-            worldV.x *= obj->transform.scale.x;
-            worldV.y *= obj->transform.scale.y;
-            worldV.z *= obj->transform.scale.z;
-            rotatedV = RotateVectorByQuaternion(worldV, obj->transform.rotation);
-            worldV.x = obj->transform.position.x + rotatedV.x;
-            worldV.y = obj->transform.position.y + rotatedV.y;
-            worldV.z = obj->transform.position.z + rotatedV.z;
-
-            // Put vertex A in camera space
-            Vector3 camA = CameraSpace(cam, worldV);
-
-            // First scale, then Rotate vertex B
-            worldV = obj->mesh->vertices[b];
-            worldV.x *= obj->transform.scale.x;
-            worldV.y *= obj->transform.scale.y;
-            worldV.z *= obj->transform.scale.z;
-            rotatedV = RotateVectorByQuaternion(worldV, obj->transform.rotation);
-            worldV.x = obj->transform.position.x + rotatedV.x;
-            worldV.y = obj->transform.position.y + rotatedV.y;
-            worldV.z = obj->transform.position.z + rotatedV.z;
-
-            // Put vertex B in camera space
-            Vector3 camB = CameraSpace(cam, worldV);
-
-            // If the vertex is behind the camera, skip it
-            if (camA.z <= 0.01f || camB.z <= 0.01f)
-                continue;
 
-            // Draw a line between points A and B
-            DrawLine(renderer,
-                Screen(Project(camA), program),
-                Screen(Project(camB), program),
-                program,
-                obj->mesh->color
-            );
+    Mesh* mesh = obj->mesh;
+
+    if (!GrowRenderBuffer((void**)&ctx->frame->vertexCache, &ctx->frame->vertexCacheCapacity, mesh->vertexCount, sizeof(Vector3)) ||
+        !GrowRenderBuffer((void**)&ctx->wireframePoints, &ctx->wireframePointsCapacity, mesh->vertexCount + mesh->edgeStripsLength, sizeof(SDL_FPoint)))
+    {
+        printf("Failed to allocate wireframe buffers\n");
+        return;
+    }
+
+    Vector3* vertexCache = ctx->frame->vertexCache;
+
+    // Put every vertex in camera space and on the screen once
+    // The second half of wireframePoints is where the lines get collected
+    SDL_FPoint* screenPoints = ctx->wireframePoints;
+    SDL_FPoint* line = ctx->wireframePoints + mesh->vertexCount;
+    Matrix4 modelView = Mat4Multiply(GetViewMatrix(cam), GetModelMatrix(obj->transform));
+
+    for (int k = 0; k < mesh->vertexCount; ++k)
+    {
+        vertexCache[k] = Mat4TransformPoint(modelView, mesh->vertices[k]);
+
+        ScreenPoint sp = Screen(Project(vertexCache[k]), program);
+        screenPoints[k] = (SDL_FPoint){ sp.x, sp.y };
+    }
+
+    SDL_SetRenderDrawColor(renderer, mesh->color.r, mesh->color.g, mesh->color.b, mesh->color.a);
+
+    // Walk the edge strips and draw each unbroken run with one call
+    // A run breaks where a segment is behind the camera or completely off one side of the screen
+    int count = 0;
+    int previous = -1;
+
+    for (int i = 0; i < mesh->edgeStripsLength; ++i)
+    {
+        int v = mesh->edgeStrips[i];
+
+        bool connected = false;
+        if (v >= 0 && previous >= 0 && vertexCache[v].z > 0.01f && vertexCache[previous].z > 0.01f)
+        {
+            SDL_FPoint p1 = screenPoints[previous];
+            SDL_FPoint p2 = screenPoints[v];
+
+            connected = !((p1.x < 0 && p2.x < 0) || (p1.x >= program.width && p2.x >= program.width) ||
+                          (p1.y < 0 && p2.y < 0) || (p1.y >= program.height && p2.y >= program.height));
+        }
+
+        if (connected)
+        {
+            if (count == 0)
+                line[count++] = screenPoints[previous];
+            line[count++] = screenPoints[v];
+        }
+        else if (count > 0)
+        {
+            SDL_RenderLines(renderer, line, count);
+            count = 0;
+        }
+
+        previous = v;
+    }
+
+    if (count > 0)
+        SDL_RenderLines(renderer, line, count);
+}
+
+
+
+
+
+/////////////////////////////////////////////////////////
+/// Clips a camera space triangle to the view frustum ///
+/////////////////////////////////////////////////////////
+
+// The planes are written in homogeneous clip space, where a point (x, y, z) becomes
+// (x / aspectX, y / aspectY, z, w = z) and is visible when -w <= x, y <= w and near <= z <= far.
+// Since that's a linear map of camera space, clipping is done on the camera space points directly.
+//
+// The sides use a guard band: a triangle is only cut by the x/y planes if it reaches
+// FRUSTUM_GUARD_BAND times past the edge of the screen. Anything closer than that is left
+// for the rasterizer's bounding box and edge functions to trim, which is much cheaper.
+
+static float FrustumPlaneDistance(int plane, Vector3 v, float aspectX, float aspectY, float guard)
+{
+    switch (plane)
+    {
+        case FRUSTUM_NEAR:   return v.z - FRUSTUM_NEAR_Z;
+        case FRUSTUM_FAR:    return FRUSTUM_FAR_Z - v.z;
+        case FRUSTUM_LEFT:   return guard * aspectX * v.z + v.x;
+        case FRUSTUM_RIGHT:  return guard * aspectX * v.z - v.x;
+        case FRUSTUM_BOTTOM: return guard * aspectY * v.z + v.y;
+        default:             return guard * aspectY * v.z - v.y;
+    }
+}
+
+// One bit for every plane the point is outside of
+static int FrustumOutcode(Vector3 v, float aspectX, float aspectY, float guard)
+{
+    float limitX = guard * aspectX * v.z;
+    float limitY = guard * aspectY * v.z;
+
+    return ((v.z < FRUSTUM_NEAR_Z) << FRUSTUM_NEAR)
+         | ((v.z > FRUSTUM_FAR_Z)  << FRUSTUM_FAR)
+         | ((v.x < -limitX)        << FRUSTUM_LEFT)
+         | ((v.x > limitX)         << FRUSTUM_RIGHT)
+         | ((v.y < -limitY)        << FRUSTUM_BOTTOM)
+         | ((v.y > limitY)         << FRUSTUM_TOP);
+}
+
+//
+// Color part of the way from a to b (rounded)
+//
+static Color LerpColor(Color a, Color b, float t)
+{
+    return (Color){
+        (Uint8)(a.r + (b.r - a.r) * t + 0.5f),
+        (Uint8)(a.g + (b.g - a.g) * t + 0.5f),
+        (Uint8)(a.b + (b.b - a.b) * t + 0.5f),
+        (Uint8)(a.a + (b.a - a.a) * t + 0.5f)
+    };
+}
+
+
+
+//
+// Clips a triangle and, when inColors isn't NULL, the colors of its vertices along with it
+// (outColors gets the colors of the clipped points)
+//
+static int ClipShadedTriangleToFrustum(Vector3 inV[3], const Color inColors[3], WindowInfo program,
+                                       Vector3 outV[FRUSTUM_MAX_CLIPPED], Color outColors[FRUSTUM_MAX_CLIPPED])
+{
+    float minSize = (program.width < program.height) ? program.width : program.height;
+    float aspectX = program.width / minSize;
+    float aspectY = program.height / minSize;
+
+    int outcodes[3], guardcodes[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        outcodes[k] = FrustumOutcode(inV[k], aspectX, aspectY, 1.0f);
+        guardcodes[k] = FrustumOutcode(inV[k], aspectX, aspectY, FRUSTUM_GUARD_BAND);
+    }
+
+    // Every point is outside the same plane (of the real frustum) -> Draw nothing
+    if ((outcodes[0] & outcodes[1] & outcodes[2]) != 0)
+        return 0;
+
+    // Only the planes that some point is outside of need to be clipped against
+    // Near and far always clip, the sides only when the triangle leaves the guard band
+    int clipPlanes = ((outcodes[0] | outcodes[1] | outcodes[2]) & ((1 << FRUSTUM_NEAR) | (1 << FRUSTUM_FAR)))
+                   | (guardcodes[0] | guardcodes[1] | guardcodes[2]);
+
+    outV[0] = inV[0];
+    outV[1] = inV[1];
+    outV[2] = inV[2];
+    int count = 3;
+
+    Color colors[FRUSTUM_MAX_CLIPPED] = { 0 };
+    if (inColors)
+        memcpy(colors, inColors, sizeof(Color) * 3);
+
+    if (clipPlanes == 0)
+    {
+        if (outColors)
+            memcpy(outColors, colors, sizeof(Color) * 3);
+        return count;
+    }
+
+    // Sutherland-Hodgman: cut the polygon by one plane at a time
+    // Every plane can add at most one point, so 3 + 6 is the limit
+    Vector3 temp[FRUSTUM_MAX_CLIPPED];
+    Color tempColors[FRUSTUM_MAX_CLIPPED];
+    for (int plane = 0; plane < FRUSTUM_PLANE_COUNT && count > 0; ++plane)
+    {
+        if ((clipPlanes & (1 << plane)) == 0)
+            continue;
+
+        int tempCount = 0;
+        for (int k = 0; k < count; ++k)
+        {
+            Vector3 a = outV[k];
+            Vector3 b = outV[(k + 1) % count];
+            float da = FrustumPlaneDistance(plane, a, aspectX, aspectY, FRUSTUM_GUARD_BAND);
+            float db = FrustumPlaneDistance(plane, b, aspectX, aspectY, FRUSTUM_GUARD_BAND);
+
+            if (da >= 0)
+            {
+                tempColors[tempCount] = colors[k];
+                temp[tempCount++] = a;
+            }
+
+            // The edge crosses the plane, keep the crossing point
+            if ((da >= 0) != (db >= 0))
+            {
+                float t = da / (da - db);
+                tempColors[tempCount] = LerpColor(colors[k], colors[(k + 1) % count], t);
+                temp[tempCount++] = Vector3Lerp(a, b, t);
+            }
         }
+
+        for (int k = 0; k < tempCount; ++k)
+        {
+            outV[k] = temp[k];
+            colors[k] = tempColors[k];
+        }
+        count = tempCount;
     }
+
+    if (outColors)
+        memcpy(outColors, colors, sizeof(Color) * count);
+
+    return (count >= 3) ? count : 0;
+}
+
+int ClipTriangleToFrustum(Vector3 inV[3], WindowInfo program, Vector3 outV[FRUSTUM_MAX_CLIPPED])
+{
+    return ClipShadedTriangleToFrustum(inV, NULL, program, outV, NULL);
+}
+
+
+
+//
+// The sort history belongs to the geometry thread while a pipelined frame is built, so that frame is dropped first
+//
+void SetCoherentSort(RenderContext* ctx, bool enabled)
+{
+    DropPipelinedFrame(ctx);
+
+    ctx->coherentSort = enabled;
+    ctx->sortHistoryCount = 0;
+    ctx->coherentSortBackoff = 0;
+    ctx->coherentSortWait = 0;
+}
+
+bool GetCoherentSort(const RenderContext* ctx)
+{
+    return ctx->coherentSort;
+}
+
+
+
+void SetBackFaceCulling(RenderContext* ctx, bool enabled)
+{
+    ctx->backFaceCulling = enabled;
+}
+
+bool GetBackFaceCulling(const RenderContext* ctx)
+{
+    return ctx->backFaceCulling;
+}
+
+
+
+//
+// Smooth shading also needs the rasterizer's smooth state, so the z-buffer modes interpolate the vertex colors
+//
+void SetSmoothShading(RenderContext* ctx, bool enabled)
+{
+    ctx->smoothShading = enabled;
+    int state = GetRasterState(&ctx->raster);
+    SetRasterState(&ctx->raster, enabled ? (state | RASTER_STATE_SMOOTH) : (state & ~RASTER_STATE_SMOOTH));
+}
+
+bool GetSmoothShading(const RenderContext* ctx)
+{
+    return ctx->smoothShading;
 }
 
 
@@ -310,18 +655,157 @@ int CompareTris(const void* a, const void* b)
 
 
 
-//////////////////////////////////////////////////////////////////
-/// Fills the triangleBuffer array with faces from all objects ///
-//////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+/// Fills a frame's triangle list with faces from all objects ///
+////////////////////////////////////////////////////////////////
+
+//
+// Light direction in camera space, flipped the same way as the vertices
+//
+static Vector3 LightDirectionToCamera(Camera* cam, Vector3 lightDirCamera)
+{
+    lightDirCamera = RotateVectorByQuaternion(lightDirCamera, QuaternionInverse(cam->rotation));
+    lightDirCamera.z *= -1.0f;
+    return lightDirCamera;
+}
+
+
+
+//
+// Brightness of a surface from the cosine between its normal and the direction to the light (ambient + diffuse)
+//
+static float LightBrightness(float facing)
+{
+    // (Written so NaN from a degenerate normal ends up as no light)
+    float brightness = (facing > 0) ? facing : 0;
+    brightness = 0.3f + 0.9f * brightness;
+    if (brightness > 1) brightness = 1;
+
+    return brightness;
+}
+
+
+
+//
+// Flat shading: the color of a face from its camera space normal (any length)
+//
+static Color ShadeFace(Color color, Vector3 normal, Vector3 lightDirCamera)
+{
+    normal = Vector3Normalize(normal);
+    return ColorScale(color, LightBrightness(Vector3Dot(normal, Vector3Scale(lightDirCamera, -1.0f))));
+}
+
+
+
+//
+// Gouraud shading: lights every vertex of a mesh once with its cached normal, in object space.
+// modelView's 3x3 part is A = (rotations and flips) * scale, so A^-1 = scale^-2 * A^T takes the direction
+// to the light into object space without inverting a matrix, and the normals don't need transforming.
+//
+static void LightMeshVertices(const Mesh* mesh, Matrix4 modelView, Vector3 scale, Vector3 lightDirCamera, Color* colors)
+{
+    Vector3 l = Vector3Scale(lightDirCamera, -1.0f);
+    Vector3 invScale = { 1.0f / scale.x, 1.0f / scale.y, 1.0f / scale.z };
+    Vector3 toLight = {
+        (modelView.m0 * l.x + modelView.m1 * l.y + modelView.m2  * l.z) * invScale.x * invScale.x,
+        (modelView.m4 * l.x + modelView.m5 * l.y + modelView.m6  * l.z) * invScale.y * invScale.y,
+        (modelView.m8 * l.x + modelView.m9 * l.y + modelView.m10 * l.z) * invScale.z * invScale.z
+    };
+
+    // A normal n becomes A^-T n in camera space, which is n * invScale long (all the same for uniform scale)
+    if (scale.x == scale.y && scale.y == scale.z)
+    {
+        float length = fabsf(scale.x);
+        for (int k = 0; k < mesh->vertexCount; ++k)
+            colors[k] = ColorScale(mesh->color, LightBrightness(Vector3Dot(mesh->normals[k], toLight) * length));
+        return;
+    }
+
+    for (int k = 0; k < mesh->vertexCount; ++k)
+    {
+        Vector3 n = mesh->normals[k];
+        Vector3 scaled = { n.x * invScale.x, n.y * invScale.y, n.z * invScale.z };
+        colors[k] = ColorScale(mesh->color, LightBrightness(Vector3Dot(n, toLight) / sqrtf(Vector3Dot(scaled, scaled))));
+    }
+}
+
+
+
+//
+// Culls, clips and lights one camera space face and adds what's left of it to the frame's triangles.
+// vertexColors are the lit colors of the vertices for smooth shading, NULL lights the face flat.
+// Returns false if the triangle buffer couldn't grow.
+//
+static bool AddFrameFace(RenderFrame* f, Vector3 camVerts[3], const Color vertexColors[3], Color meshColor, Uint32 face, WindowInfo program,
+                         Vector3 lightDirCamera, bool cullBackFaces)
+{
+    Vector3 ab = Vector3Subtract(camVerts[1], camVerts[0]);
+    Vector3 ac = Vector3Subtract(camVerts[2], camVerts[0]);
+    Vector3 normal = Vector3Cross(ab, ac);
+
+    // Back-face culling: the camera is at the origin, so a face points away
+    // from it when its normal points the same way as the vector to the face
+    if (cullBackFaces && Vector3Dot(normal, camVerts[0]) >= 0)
+        return true;
+
+    Vector3 clipped[FRUSTUM_MAX_CLIPPED];
+    Color clippedColors[FRUSTUM_MAX_CLIPPED];
+    int clippedCount = ClipShadedTriangleToFrustum(camVerts, vertexColors, program, clipped, clippedColors);
+
+    if (clippedCount == 0)
+        return true;
+
+    // Clipped pieces lie in the same plane, so they share the lighting of the whole face.
+    // Smooth faces come with their vertices lit, so they don't need any normal math here. They use the color
+    // of their first vertex where the colors can't be interpolated (like GL's flat shading).
+    Color color = vertexColors ? clippedColors[0] : ShadeFace(meshColor, normal, lightDirCamera);
+
+    if (!GrowRenderBuffer((void**)&f->triangles, &f->triangleCapacity, f->triCount + clippedCount - 2, sizeof(RenderTriangle)) ||
+        !GrowRenderBuffer((void**)&f->triangleFaces, &f->triangleFaceCapacity, f->triCount + clippedCount - 2, sizeof(Uint32)))
+        return false;
+
+    if (f->faceTriangles[face] < 0)
+        f->faceTriangles[face] = f->triCount;
+
+    // Filling in the triangle buffer with a fan over the clipped polygon
+    for (int t = 1; t + 1 < clippedCount; ++t)
+    {
+        Vector3 v0 = clipped[0];
+        Vector3 v1 = clipped[t];
+        Vector3 v2 = clipped[t + 1];
+
+        float depth = (v0.z + v1.z + v2.z) / 3.0f;
+
+        f->triangleFaces[f->triCount] = face;
+        f->triangles[f->triCount++] = (RenderTriangle){
+            { v0, v1, v2 },
+            depth,
+            color,
+            { color, vertexColors ? clippedColors[t] : color, vertexColors ? clippedColors[t + 1] : color }
+        };
+    }
+
+    return true;
+}
+
+
 
-void AddRenderTriangles(Object* GlobalObjects, int numObjects, Camera* cam, Vector3 lightDirCamera)
+//
+// Static objects are left out when skipStatic is set, the static BSP tree adds them after the sort
+//
+static void FillFrameTriangles(RenderContext* ctx, RenderFrame* f, Object* GlobalObjects, int numObjects, Camera* cam, WindowInfo program, Vector3 lightDirCamera,
+                               bool cullBackFaces, bool smoothShading, bool skipStatic)
 {
-    const float nearPlane = 0.01f;
     int facesCount = 0;
+
+    if (cam == NULL)
+    {
+        printf("Camera is NULL\n");
+        return;
+    }
     
     // Flip lighting for consistency
-    lightDirCamera = RotateVectorByQuaternion(lightDirCamera, QuaternionInverse(cam->rotation));
-    lightDirCamera.z *= -1.0f;
+    lightDirCamera = LightDirectionToCamera(cam, lightDirCamera);
 
     for (int a = 0; a < numObjects; ++a)
     {
@@ -329,266 +813,1532 @@ void AddRenderTriangles(Object* GlobalObjects, int numObjects, Camera* cam, Vect
             facesCount += GlobalObjects[a].mesh->facesCount;
     }
 
-    // Use facesCount * 2 if more faces are needed
-    triangleBuffer = malloc(sizeof(RenderTriangle) * facesCount);
-    // triangleBuffer = malloc(sizeof(RenderTriangle) * facesCount * 2);
-
-    if (!triangleBuffer)
+    // Clipping can turn one face into several triangles, the buffer grows again if that happens
+    f->triCount = 0;
+    f->sortedCount = 0;
+    f->objectRangeCount = 0;
+    f->faceCount = 0;
+    f->backFaceCulling = cullBackFaces;
+    f->smoothShading = smoothShading;
+    if (!GrowRenderBuffer((void**)&f->triangles, &f->triangleCapacity, facesCount, sizeof(RenderTriangle)) ||
+        !GrowRenderBuffer((void**)&f->triangleFaces, &f->triangleFaceCapacity, facesCount, sizeof(Uint32)) ||
+        !GrowRenderBuffer((void**)&f->faceTriangles, &f->faceTriangleCapacity, facesCount, sizeof(int)) ||
+        !GrowRenderBuffer((void**)&f->objectTriangleStart, &f->objectTriangleCapacity, numObjects + 1, sizeof(int)))
     {
         printf("Failed to allocate triangle buffer\n");
         return;
     }
 
+    Matrix4 view = GetViewMatrix(cam);
+
     // Generate triangles for every object
     for (int a = 0; a < numObjects; ++a)
     {
         Object obj = GlobalObjects[a];
+        f->objectTriangleStart[a] = f->triCount;
 
         if (obj.mesh == NULL)
             continue;
 
-        for (int i = 0; i < obj.mesh->facesCount; ++i)
+        // The faces keep their numbers, they just don't get any triangles
+        if (skipStatic && obj.isStatic)
         {
-            int* row = obj.mesh->faces[i];
-
-            Vector3 camVerts[3];
-
-            // Rotate Mesh to follow the objects rotation
-            for (int k = 0; k < 3; ++k)
-            {
-                Vector3 localVert = obj.mesh->vertices[row[k]];
-                localVert.x *= -1.0f;
-
-                localVert = (Vector3){
-                    localVert.x * obj.transform.scale.x,
-                    localVert.y * obj.transform.scale.y,
-                    localVert.z * obj.transform.scale.z
-                };
-
-                Vector3 rotatedVert = RotateVectorByQuaternion(localVert, obj.transform.rotation);
-
-                Vector3 world = {
-                    obj.transform.position.x + rotatedVert.x,
-                    obj.transform.position.y + rotatedVert.y,
-                    obj.transform.position.z + rotatedVert.z
-                };
-
-                if (cam == NULL)
-                {
-                    printf("Camera is NULL\n");
-                    return;
-                }
-
-                camVerts[k] = CameraSpace(cam, world);
-                // Flip Z for right-handed system
-                camVerts[k].z *= -1.0f;
-            }
+            for (int i = 0; i < obj.mesh->facesCount; ++i)
+                f->faceTriangles[f->faceCount++] = -1;
+            continue;
+        }
 
-            // If vertices are behind the camera, don't add
-            if (camVerts[0].z <= 0 || camVerts[1].z <= 0 || camVerts[2].z <= 0)
-                continue;
+        if (!GrowRenderBuffer((void**)&f->vertexCache, &f->vertexCacheCapacity, obj.mesh->vertexCount, sizeof(Vector3)))
+        {
+            printf("Failed to allocate vertex cache\n");
+            return;
+        }
 
+        // One model-view matrix per object: flip the mesh x, then scale, rotate, move,
+        // go into camera space and flip z for the right-handed system
+        Matrix4 modelView = Mat4Multiply(view, GetModelMatrix(obj.transform));
+        // (column 0 flips x and row 2 flips z, m2 is in both so it flips twice)
+        modelView.m0 *= -1.0f; modelView.m1 *= -1.0f; modelView.m2 *= -1.0f;
+        modelView.m2 *= -1.0f; modelView.m6 *= -1.0f; modelView.m10 *= -1.0f; modelView.m14 *= -1.0f;
 
+        // Every vertex is transformed once, the faces share the results
+        for (int k = 0; k < obj.mesh->vertexCount; ++k)
+            f->vertexCache[k] = Mat4TransformPoint(modelView, obj.mesh->vertices[k]);
 
-            ///////////////////////////////////////
-            // --- Near-plane clipping --- //
-            ///////////////////////////////////////
-            int inFront[3];
-            int countInFront = 0;
-            for (int k = 0; k < 3; k++)
+        // Same for the lighting when it's smooth
+        bool smooth = f->smoothShading && obj.mesh->normals != NULL;
+        if (smooth)
+        {
+            if (!GrowRenderBuffer((void**)&f->vertexColors, &f->vertexColorCapacity, obj.mesh->vertexCount, sizeof(Color)))
             {
-                if (camVerts[k].z >= nearPlane) {
-                    inFront[k] = 1;
-                    countInFront++;
-                } else {
-                    inFront[k] = 0;
-                }
+                printf("Failed to allocate vertex cache\n");
+                return;
             }
 
-            if (countInFront == 0) continue; // fully behind camera, skip
+            LightMeshVertices(obj.mesh, modelView, obj.transform.scale, lightDirCamera, f->vertexColors);
+        }
 
-            // Helper arrays for clipped triangles
-            Vector3 clipped[4]; // max 4 vertices after clipping
-            int clippedCount = 0;
+        for (int i = 0; i < obj.mesh->facesCount; ++i)
+        {
+            int* row = obj.mesh->faces[i];
+            Uint32 face = (Uint32)f->faceCount++;
+            f->faceTriangles[face] = -1;
 
-            if (countInFront == 3)
-            {
-                // all vertices in front, keep original triangle
-                clipped[0] = camVerts[0];
-                clipped[1] = camVerts[1];
-                clipped[2] = camVerts[2];
-                clippedCount = 3;
-            }
-            else if (countInFront == 1)
-            {
-                // one vertex in front, generate 2 new triangles (quad split)
-                int frontIdx = (inFront[0]) ? 0 : (inFront[1] ? 1 : 2);
-                int backIdx1 = (frontIdx + 1) % 3;
-                int backIdx2 = (frontIdx + 2) % 3;
-
-                Vector3 vFront = camVerts[frontIdx];
-                Vector3 vBack1 = camVerts[backIdx1];
-                Vector3 vBack2 = camVerts[backIdx2];
-
-                float t1 = (nearPlane - vFront.z) / (vBack1.z - vFront.z);
-                float t2 = (nearPlane - vFront.z) / (vBack2.z - vFront.z);
-
-                Vector3 vi1 = {
-                    vFront.x + (vBack1.x - vFront.x) * t1,
-                    vFront.y + (vBack1.y - vFront.y) * t1,
-                    nearPlane
-                };
-                Vector3 vi2 = {
-                    vFront.x + (vBack2.x - vFront.x) * t2,
-                    vFront.y + (vBack2.y - vFront.y) * t2,
-                    nearPlane
-                };
-
-                // Triangle 1
-                clipped[0] = vFront;
-                clipped[1] = vi1;
-                clipped[2] = vi2;
-                clippedCount = 3;
-            }
-            else if (countInFront == 2)
+            Vector3 camVerts[3] = {
+                f->vertexCache[row[0]],
+                f->vertexCache[row[1]],
+                f->vertexCache[row[2]]
+            };
+            Color colors[3];
+            if (smooth)
             {
-                // two vertices in front, generate 1 new triangle
-                int backIdx = (inFront[0] == 0) ? 0 : (inFront[1] == 0 ? 1 : 2);
-                int frontIdx1 = (backIdx + 1) % 3;
-                int frontIdx2 = (backIdx + 2) % 3;
-
-                Vector3 vBack = camVerts[backIdx];
-                Vector3 vFront1 = camVerts[frontIdx1];
-                Vector3 vFront2 = camVerts[frontIdx2];
-
-                float t1 = (nearPlane - vFront1.z) / (vBack.z - vFront1.z);
-                float t2 = (nearPlane - vFront2.z) / (vBack.z - vFront2.z);
-
-                Vector3 vi1 = {
-                    vFront1.x + (vBack.x - vFront1.x) * t1,
-                    vFront1.y + (vBack.y - vFront1.y) * t1,
-                    nearPlane
-                };
-                Vector3 vi2 = {
-                    vFront2.x + (vBack.x - vFront2.x) * t2,
-                    vFront2.y + (vBack.y - vFront2.y) * t2,
-                    nearPlane
-                };
-
-                clipped[0] = vFront1;
-                clipped[1] = vFront2;
-                clipped[2] = vi2;
-                clippedCount = 3;
+                colors[0] = f->vertexColors[row[0]];
+                colors[1] = f->vertexColors[row[1]];
+                colors[2] = f->vertexColors[row[2]];
             }
-            // --- End near-plane clipping --- //
 
-            // Filling in the triangle buffer with the clipped array data
-            for (int t = 0; t < clippedCount; t += 3)
+            if (!AddFrameFace(f, camVerts, smooth ? colors : NULL, obj.mesh->color, face, program, lightDirCamera, cullBackFaces))
             {
-                Vector3 v0 = clipped[t + 0];
-                Vector3 v1 = clipped[t + 1];
-                Vector3 v2 = clipped[t + 2];
-
-                // Recalculate normal for the new clipped fragment
-                Vector3 ab = Vector3Subtract(v1, v0);
-                Vector3 ac = Vector3Subtract(v2, v0);
-                Vector3 normal = Vector3Normalize(Vector3Cross(ab, ac));
-
-                // Recalculate brightness
-                float brightness = Vector3Dot(normal, Vector3Scale(lightDirCamera, -1.0f));
-                if (brightness < 0) brightness = 0;
-                brightness = 0.3f + 0.9f * brightness;
-                if (brightness > 1) brightness = 1;
-
-                float depth = (v0.z + v1.z + v2.z) / 3.0f;
-
-                triangleBuffer[triCount++] = (RenderTriangle){
-                    { v0, v1, v2 }, // <--- Use v0, v1, v2 here!
-                    depth,
-                    ColorScale(obj.mesh->color, brightness)
-                };
+                printf("Failed to grow triangle buffer\n");
+                return;
             }
-            
-
-
+        }
+    }
 
-            // ----------- Old routine ----------- //
-            // -- Doesn't use the clipped array -- //
+    f->objectTriangleStart[numObjects] = f->triCount;
+    f->objectRangeCount = numObjects;
+}
 
-            // Vector3 ab = Vector3Subtract(camVerts[1], camVerts[0]);
-            // Vector3 ac = Vector3Subtract(camVerts[2], camVerts[0]);
-            // Vector3 normal = Vector3Normalize(Vector3Cross(ab, ac));
 
-            // Back-face culling (Don't use right now, undefined behavior)
-            // if (normal.z >= 0) continue;
-            // if (Vector3Dot(normal, camVerts[0]) >= 0) continue;
 
-            // Compute brightness (directional light)
-            // float brightness = Vector3Dot(normal, Vector3Scale(lightDirCamera, -1.0f));
-            // if (brightness < 0) brightness = 0;
-            // brightness = 0.3f + 0.9f * brightness;
-            // if (brightness > 1) brightness = 1;
+void AddRenderTriangles(RenderContext* ctx, Object* GlobalObjects, int numObjects, Camera* cam, WindowInfo program, Vector3 lightDirCamera)
+{
+    FillFrameTriangles(ctx, ctx->frame, GlobalObjects, numObjects, cam, program, lightDirCamera, ctx->backFaceCulling, ctx->smoothShading, false);
+}
 
 
-            
-            // float depth = (camVerts[0].z + camVerts[1].z + camVerts[2].z) / 3.0f;
 
-            // triangleBuffer[triCount++] = (RenderTriangle){
-            //     { camVerts[0], camVerts[1], camVerts[2] },
-            //     depth,
-            //     ColorScale(obj.mesh->color, brightness)
-            // };
+//
+// Sort key for a depth: bigger depths get smaller keys, so sorting the keys up puts the triangles back to front.
+// Positive floats already sort like their bits, negative ones need every bit flipped to sort the same way.
+//
+static Uint32 DepthSortKey(float depth)
+{
+    Uint32 bits;
+    SDL_memcpy(&bits, &depth, sizeof(bits));
+
+    bits ^= (bits & 0x80000000u) ? 0xFFFFFFFFu : 0x80000000u;
+    return ~bits;
+}
+
+
+
+//
+// Sorts sortedTriangles (with the keys and indices already filled in) with an LSD radix sort,
+// one pass per byte of the key. sortScratch holds the other half of every pass.
+//
+static void RadixSortFrameTriangles(RenderFrame* f)
+{
+    // Count every byte of every key in one go
+    Uint32 counts[4][256] = { 0 };
+    for (int i = 0; i < f->triCount; ++i)
+    {
+        Uint32 key = f->sortedTriangles[i].key;
+
+        counts[0][key & 0xFF]++;
+        counts[1][(key >> 8) & 0xFF]++;
+        counts[2][(key >> 16) & 0xFF]++;
+        counts[3][key >> 24]++;
+    }
+
+    RenderSortEntry* from = f->sortedTriangles;
+    RenderSortEntry* to = f->sortScratch;
+
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        int shift = pass * 8;
+
+        // Skip the pass when every key has the same byte here (common for the top byte)
+        if (f->triCount == 0 || counts[pass][(from[0].key >> shift) & 0xFF] == (Uint32)f->triCount)
+            continue;
+
+        // Turn the counts into the first position of every bucket
+        Uint32 offset = 0;
+        for (int b = 0; b < 256; ++b)
+        {
+            Uint32 count = counts[pass][b];
+            counts[pass][b] = offset;
+            offset += count;
+        }
+
+        for (int i = 0; i < f->triCount; ++i)
+        {
+            Uint32 b = (from[i].key >> shift) & 0xFF;
+            to[counts[pass][b]++] = from[i];
+        }
+
+        RenderSortEntry* t = from;
+        from = to;
+        to = t;
+    }
+
+    // After an odd number of passes the result is in the scratch buffer
+    if (from != f->sortedTriangles)
+    {
+        int capacity = f->sortCapacity;
+        f->sortCapacity = f->scratchCapacity;
+        f->scratchCapacity = capacity;
+
+        f->sortScratch = f->sortedTriangles;
+        f->sortedTriangles = from;
+    }
+}
+
+
+
+//
+// Puts the triangles in the order their faces were drawn last frame (faces that weren't drawn go last),
+// then fixes that up with an insertion sort. Returns false without a usable order when the insertion
+// sort would need too many moves, then the radix sort takes over.
+//
+static bool CoherentSortFrameTriangles(RenderContext* ctx, RenderFrame* f)
+{
+    // Keys are worked out in triangle order first, so the gather below only jumps around the small entries.
+    // The triangles of a face are next to each other, faceTriangles is set to -1 once they're placed.
+    RenderSortEntry* keyed = f->sortScratch;
+    for (int t = 0; t < f->triCount; ++t)
+        keyed[t] = (RenderSortEntry){ DepthSortKey(f->triangles[t].depth), (Uint32)t };
+
+    int count = 0;
+    for (int h = 0; h < ctx->sortHistoryCount; ++h)
+    {
+        Uint32 face = ctx->sortHistory[h];
+        int t = f->faceTriangles[face];
+        if (t < 0)
+            continue;
+
+        for (; t < f->triCount && f->triangleFaces[t] == face; ++t)
+            f->sortedTriangles[count++] = keyed[t];
+        f->faceTriangles[face] = -1;
+    }
+
+    for (int t = 0; t < f->triCount; ++t)
+    {
+        if (f->faceTriangles[f->triangleFaces[t]] >= 0)
+            f->sortedTriangles[count++] = keyed[t];
+    }
+
+    // Insertion sort, which only does work where the order changed
+    RenderSortEntry* entries = f->sortedTriangles;
+    Sint64 movesLeft = (Sint64)f->triCount * COHERENT_SORT_MAX_MOVES;
+
+    for (int i = 1; i < count; ++i)
+    {
+        RenderSortEntry entry = entries[i];
+        int j = i;
+
+        while (j > 0 && entries[j - 1].key > entry.key)
+        {
+            entries[j] = entries[j - 1];
+            --j;
+        }
+        entries[j] = entry;
+
+        movesLeft -= i - j;
+        if (movesLeft < 0)
+            return false;
+    }
+
+    return true;
+}
+
+
+
+//
+// Sort the triangles back to front (only needed by the painter's algorithm)
+// The triangles stay where they are, only the small key/index pairs in sortedTriangles get moved around.
+//
+static void SortFrameTriangles(RenderContext* ctx, RenderFrame* f)
+{
+    f->sortedCount = 0;
+
+    if (!GrowRenderBuffer((void**)&f->sortedTriangles, &f->sortCapacity, f->triCount, sizeof(RenderSortEntry)) ||
+        !GrowRenderBuffer((void**)&f->sortScratch, &f->scratchCapacity, f->triCount, sizeof(RenderSortEntry)))
+    {
+        printf("Failed to allocate sort buffer\n");
+        return;
+    }
+
+    bool sorted = false;
+    if (ctx->coherentSort && ctx->coherentSortWait == 0 && ctx->sortHistoryCount > 0 && ctx->sortHistoryFaces == f->faceCount)
+    {
+        sorted = CoherentSortFrameTriangles(ctx, f);
+
+        // When the order changes too much to repair (a dense mesh up close, a camera jump) the attempt
+        // costs more than it saves, so the next ones get spaced out further every time it fails
+        ctx->coherentSortBackoff = sorted ? 0 : SDL_min(SDL_max(ctx->coherentSortBackoff * 2, 1), COHERENT_SORT_MAX_BACKOFF);
+        ctx->coherentSortWait = ctx->coherentSortBackoff;
+    }
+    else if (ctx->coherentSortWait > 0)
+        ctx->coherentSortWait--;
+
+    if (!sorted)
+    {
+        for (int i = 0; i < f->triCount; ++i)
+            f->sortedTriangles[i] = (RenderSortEntry){ DepthSortKey(f->triangles[i].depth), (Uint32)i };
+
+        RadixSortFrameTriangles(f);
+    }
+
+    // Remember the order of the faces when the next frame is going to try the coherent sort
+    ctx->sortHistoryCount = 0;
+    if (ctx->coherentSort && ctx->coherentSortWait == 0 &&
+        GrowRenderBuffer((void**)&ctx->sortHistory, &ctx->sortHistoryCapacity, f->triCount, sizeof(Uint32)))
+    {
+        for (int i = 0; i < f->triCount; ++i)
+            ctx->sortHistory[i] = f->triangleFaces[f->sortedTriangles[i].index];
+        ctx->sortHistoryCount = f->triCount;
+        ctx->sortHistoryFaces = f->faceCount;
+    }
+
+    f->sortedCount = f->triCount;
+}
+
+
+
+void SortRenderTriangles(RenderContext* ctx)
+{
+    SortFrameTriangles(ctx, ctx->frame);
+}
+
+
+
+
+
+///////////////////////
+/// Static BSP tree ///
+///////////////////////
+
+
+// A list of pool triangles waiting to become a subtree, and where the subtree goes
+typedef struct BSPBuildList
+{
+    int* tris;
+    int count;
+    int parent;     // -1 for the root
+    bool front;     // Which child of the parent it is
+} BSPBuildList;
+
+
+//
+// The geometry thread builds and walks the tree while a pipelined frame is built, so these wait for that frame
+// (and throw it away, an invalidated tree gets built again for the next one)
+//
+void SetStaticBSP(RenderContext* ctx, bool enabled)
+{
+    DropPipelinedFrame(ctx);
+    ctx->staticBSP = enabled;
+}
+
+bool GetStaticBSP(const RenderContext* ctx)
+{
+    return ctx->staticBSP;
+}
+
+void InvalidateStaticBSP(RenderContext* ctx)
+{
+    DropPipelinedFrame(ctx);
+    ctx->bspBuilt = false;
+}
+
+
+
+//
+// Distances of a triangle's points from a plane (positive in front), the ones very close to it are set to 0.
+// Returns -1 if the whole triangle is behind it, 1 if it's in front, 0 if it's in the plane and 2 if it crosses it.
+//
+static int ClassifyBSPTriangle(const BSPTriangle* t, Vector3 point, Vector3 normal, float d[3])
+{
+    bool front = false;
+    bool back = false;
+
+    for (int k = 0; k < 3; ++k)
+    {
+        d[k] = Vector3Dot(normal, Vector3Subtract(t->v[k], point));
+        if (fabsf(d[k]) < BSP_PLANE_EPSILON)
+            d[k] = 0.0f;
+
+        front |= d[k] > 0.0f;
+        back |= d[k] < 0.0f;
+    }
+
+    if (front && back)
+        return 2;
+    return front ? 1 : (back ? -1 : 0);
+}
+
+
+
+//
+// Adds a triangle to the build pool, leaving out the ones with no area (they have no plane)
+//
+static bool AddBSPBuildTriangle(BSPTriangle** pool, int* count, int* capacity, BSPTriangle t)
+{
+    Vector3 normal = Vector3Cross(Vector3Subtract(t.v[1], t.v[0]), Vector3Subtract(t.v[2], t.v[0]));
+    if (Vector3Dot(normal, normal) == 0.0f)
+        return true;
+
+    if (!GrowRenderBuffer((void**)pool, capacity, *count + 1, sizeof(BSPTriangle)))
+        return false;
+
+    (*pool)[(*count)++] = t;
+    return true;
+}
+
+
+
+//
+// Cuts a triangle that crosses a plane into the pieces in front of it and behind it.
+// Each side is a triangle or a quad, which is split into two triangles with the same winding.
+//
+static int SplitBSPTriangle(const BSPTriangle* t, const float d[3], bool front, BSPTriangle out[2])
+{
+    Vector3 points[4];
+    Vector3 normals[4];
+    int count = 0;
+
+    for (int k = 0; k < 3; ++k)
+    {
+        int next = (k + 1) % 3;
+        float da = front ? d[k] : -d[k];
+        float db = front ? d[next] : -d[next];
+
+        if (da >= 0.0f)
+        {
+            normals[count] = t->n[k];
+            points[count++] = t->v[k];
+        }
+
+        if ((da > 0.0f && db < 0.0f) || (da < 0.0f && db > 0.0f))
+        {
+            float along = da / (da - db);
+            normals[count] = Vector3Lerp(t->n[k], t->n[next], along);
+            points[count++] = Vector3Lerp(t->v[k], t->v[next], along);
+        }
+    }
+
+    int pieces = 0;
+    for (int k = 1; k + 1 < count; ++k)
+    {
+        int corners[3] = { 0, k, k + 1 };
+        out[pieces] = *t;
+        for (int c = 0; c < 3; ++c)
+        {
+            out[pieces].v[c] = points[corners[c]];
+            out[pieces].n[c] = normals[corners[c]];
+        }
+        pieces++;
+    }
+
+    return pieces;
+}
+
+
+
+//
+// Picks the plane for a node: a few triangles spread through the list are tried against a sample of the list,
+// and the one that splits the fewest triangles (and after that, leaves the sides most even) wins
+//
+static int ChooseBSPSplitter(const BSPTriangle* pool, const int* tris, int count)
+{
+    int candidates = SDL_min(count, BSP_SPLIT_CANDIDATES);
+    int samples = SDL_min(count, BSP_SPLIT_SAMPLES);
+    int best = 0;
+    int bestScore = -1;
+
+    for (int c = 0; c < candidates; ++c)
+    {
+        int index = (int)((long long)c * count / candidates);
+        const BSPTriangle* t = &pool[tris[index]];
+        Vector3 normal = Vector3Normalize(Vector3Cross(Vector3Subtract(t->v[1], t->v[0]), Vector3Subtract(t->v[2], t->v[0])));
+
+        int front = 0, back = 0, split = 0;
+        for (int k = 0; k < samples; ++k)
+        {
+            float d[3];
+            int side = ClassifyBSPTriangle(&pool[tris[(int)((long long)k * count / samples)]], t->v[0], normal, d);
+
+            if (side == 2)       split++;
+            else if (side == 1)  front++;
+            else if (side == -1) back++;
+        }
+
+        int score = split * 8 + abs(front - back);
+        if (bestScore < 0 || score < bestScore)
+        {
+            best = index;
+            bestScore = score;
+        }
+    }
+
+    return best;
+}
+
+
+
+//
+// Builds the tree from the world space faces of the static objects.
+// Done with a list of pending subtrees instead of recursion, since a mostly convex mesh makes a very deep tree.
+//
+static bool BuildStaticBSP(RenderContext* ctx, Object* objects, int objectCount)
+{
+    FreeStaticBSP(ctx);
+    ctx->bspBuilt = true;
+
+    BSPTriangle* pool = NULL;
+    int poolCount = 0;
+    int poolCapacity = 0;
+    BSPBuildList* work = NULL;
+    int workCount = 0;
+    int workCapacity = 0;
+    bool ok = true;
+
+    // Faces are numbered through all the objects, like FillFrameTriangles does
+    Uint32 face = 0;
+    for (int a = 0; a < objectCount && ok; ++a)
+    {
+        Mesh* mesh = objects[a].mesh;
+        if (mesh == NULL)
+            continue;
+
+        if (!objects[a].isStatic)
+        {
+            face += mesh->facesCount;
+            continue;
+        }
+
+        // Same as the model-view matrix in FillFrameTriangles without the view: flip the mesh x, scale, rotate, move
+        Matrix4 model = GetModelMatrix(objects[a].transform);
+        model.m0 *= -1.0f; model.m1 *= -1.0f; model.m2 *= -1.0f;
+
+        // Normals go through the inverse transpose, which is the model matrix again after dividing by scale twice
+        Vector3 scale = objects[a].transform.scale;
+        Vector3 normalScale = { 1.0f / (scale.x * scale.x), 1.0f / (scale.y * scale.y), 1.0f / (scale.z * scale.z) };
+        Vector3 origin = Mat4TransformPoint(model, (Vector3){ 0.0f, 0.0f, 0.0f });
+
+        for (int i = 0; i < mesh->facesCount && ok; ++i, ++face)
+        {
+            BSPTriangle t;
+            for (int k = 0; k < 3; ++k)
+                t.v[k] = Mat4TransformPoint(model, mesh->vertices[mesh->faces[i][k]]);
+            t.color = mesh->color;
+            t.face = face;
+
+            // Without vertex normals the face is lit flat
+            Vector3 faceNormal = Vector3Cross(Vector3Subtract(t.v[1], t.v[0]), Vector3Subtract(t.v[2], t.v[0]));
+            for (int k = 0; k < 3; ++k)
+            {
+                t.n[k] = faceNormal;
+                if (mesh->normals)
+                {
+                    Vector3 n = mesh->normals[mesh->faces[i][k]];
+                    n = (Vector3){ n.x * normalScale.x, n.y * normalScale.y, n.z * normalScale.z };
+                    t.n[k] = Vector3Subtract(Mat4TransformPoint(model, n), origin);
+                }
+            }
+
+            ok = AddBSPBuildTriangle(&pool, &poolCount, &poolCapacity, t);
+        }
+    }
+
+    int* all = ok ? malloc(sizeof(int) * SDL_max(poolCount, 1)) : NULL;
+    if (all != NULL && GrowRenderBuffer((void**)&work, &workCapacity, 1, sizeof(BSPBuildList)))
+    {
+        for (int i = 0; i < poolCount; ++i)
+            all[i] = i;
+        work[workCount++] = (BSPBuildList){ all, poolCount, -1, false };
+    }
+    else
+    {
+        free(all);
+        ok = false;
+    }
+
+    while (workCount > 0)
+    {
+        BSPBuildList list = work[--workCount];
+
+        // An empty side has no node (-1)
+        int child = (list.count > 0) ? ctx->bspNodeCount : -1;
+        if (list.parent < 0)
+            ctx->bspRoot = child;
+        else if (list.front)
+            ctx->bspNodes[list.parent].front = child;
+        else
+            ctx->bspNodes[list.parent].back = child;
+
+        if (list.count == 0 || !ok)
+        {
+            free(list.tris);
+            continue;
+        }
+
+        int* frontTris = malloc(sizeof(int) * list.count * 2);
+        int* backTris = malloc(sizeof(int) * list.count * 2);
+        if (!frontTris || !backTris || !GrowRenderBuffer((void**)&ctx->bspNodes, &ctx->bspNodeCapacity, ctx->bspNodeCount + 1, sizeof(BSPNode)) ||
+            !GrowRenderBuffer((void**)&work, &workCapacity, workCount + 2, sizeof(BSPBuildList)))
+        {
+            free(frontTris);
+            free(backTris);
+            free(list.tris);
+            ok = false;
+            continue;
+        }
+
+        const BSPTriangle* splitter = &pool[list.tris[ChooseBSPSplitter(pool, list.tris, list.count)]];
+        BSPNode* node = &ctx->bspNodes[ctx->bspNodeCount++];
+        node->point = splitter->v[0];
+        node->normal = Vector3Normalize(Vector3Cross(Vector3Subtract(splitter->v[1], splitter->v[0]),
+                                                     Vector3Subtract(splitter->v[2], splitter->v[0])));
+        node->first = ctx->bspTriangleCount;
+        node->count = 0;
+        node->front = -1;
+        node->back = -1;
+        Vector3 point = node->point;
+        Vector3 normal = node->normal;
+
+        int frontCount = 0;
+        int backCount = 0;
+
+        for (int i = 0; i < list.count && ok; ++i)
+        {
+            // A copy, the pool can move when split pieces are added
+            BSPTriangle t = pool[list.tris[i]];
+            float d[3];
+            int side = ClassifyBSPTriangle(&t, point, normal, d);
+
+            if (side == 0)
+            {
+                ok = GrowRenderBuffer((void**)&ctx->bspTriangles, &ctx->bspTriangleCapacity, ctx->bspTriangleCount + 1, sizeof(BSPTriangle));
+                if (ok)
+                    ctx->bspTriangles[ctx->bspTriangleCount++] = t;
+            }
+            else if (side == 1)
+                frontTris[frontCount++] = list.tris[i];
+            else if (side == -1)
+                backTris[backCount++] = list.tris[i];
+            else
+            {
+                BSPTriangle pieces[2];
+                int n = SplitBSPTriangle(&t, d, true, pieces);
+                for (int k = 0; k < n && ok; ++k)
+                {
+                    int before = poolCount;
+                    ok = AddBSPBuildTriangle(&pool, &poolCount, &poolCapacity, pieces[k]);
+                    if (poolCount > before)
+                        frontTris[frontCount++] = before;
+                }
+
+                n = SplitBSPTriangle(&t, d, false, pieces);
+                for (int k = 0; k < n && ok; ++k)
+                {
+                    int before = poolCount;
+                    ok = AddBSPBuildTriangle(&pool, &poolCount, &poolCapacity, pieces[k]);
+                    if (poolCount > before)
+                        backTris[backCount++] = before;
+                }
+            }
+        }
+
+        ctx->bspNodes[ctx->bspNodeCount - 1].count = ctx->bspTriangleCount - ctx->bspNodes[ctx->bspNodeCount - 1].first;
+        free(list.tris);
+
+        work[workCount++] = (BSPBuildList){ backTris, backCount, ctx->bspNodeCount - 1, false };
+        work[workCount++] = (BSPBuildList){ frontTris, frontCount, ctx->bspNodeCount - 1, true };
+    }
+
+    free(pool);
+    free(work);
+
+    if (!ok)
+    {
+        printf("Failed to build the static BSP tree\n");
+        FreeStaticBSP(ctx);
+        ctx->bspBuilt = true;    // Don't try again every frame
+        return false;
+    }
+
+    return true;
+}
+
+
+
+//
+// Builds the tree again if the static objects changed, returns true if there's anything in it
+//
+static bool UpdateStaticBSP(RenderContext* ctx, Object* objects, int objectCount)
+{
+    // Which objects are static, their meshes, and the face numbers they start at
+    Uint32 signature = 2166136261u;
+    Uint32 faces = 0;
+    for (int a = 0; a < objectCount; ++a)
+    {
+        if (objects[a].mesh == NULL)
+            continue;
+
+        if (objects[a].isStatic)
+        {
+            Uint32 values[3] = { (Uint32)a, (Uint32)(uintptr_t)objects[a].mesh, faces };
+            for (int k = 0; k < 3; ++k)
+                signature = (signature ^ values[k]) * 16777619u;
+        }
+
+        faces += objects[a].mesh->facesCount;
+    }
+
+    if (!ctx->bspBuilt || signature != ctx->bspSignature)
+    {
+        BuildStaticBSP(ctx, objects, objectCount);
+        ctx->bspSignature = signature;
+    }
+
+    return ctx->bspNodeCount > 0;
+}
+
+
+
+//
+// Adds the static triangles to a frame whose dynamic triangles are sorted, walking the tree back to front
+// from the camera. The dynamic triangles keep their sorted order: the ones whose center is behind a node's
+// plane (seen from the camera) are drawn before the node's triangles, the rest after the whole tree.
+//
+static void MergeStaticBSP(RenderContext* ctx, RenderFrame* f, Camera* cam, WindowInfo program, Vector3 lightDirCamera)
+{
+    int dynamicCount = f->triCount;
+    if (f->sortedCount != dynamicCount)
+        return;
+
+    if (!GrowRenderBuffer((void**)&ctx->bspPlanes, &ctx->bspPlaneCapacity, ctx->bspNodeCount * 2, sizeof(Vector3)) ||
+        !GrowRenderBuffer((void**)&ctx->bspStack, &ctx->bspStackCapacity, ctx->bspNodeCount * 2 + 2, sizeof(int)) ||
+        !GrowRenderBuffer((void**)&f->sortScratch, &f->scratchCapacity, dynamicCount, sizeof(RenderSortEntry)))
+    {
+        printf("Failed to allocate static BSP buffers\n");
+        return;
+    }
+
+    // World to camera space, with z flipped like the model-view matrices
+    Matrix4 view = GetViewMatrix(cam);
+    view.m2 *= -1.0f; view.m6 *= -1.0f; view.m10 *= -1.0f; view.m14 *= -1.0f;
+    lightDirCamera = LightDirectionToCamera(cam, lightDirCamera);
+
+    // Direction to the light in world space for smooth shading, the view's 3x3 part only rotates and flips so its transpose undoes it
+    Vector3 l = Vector3Scale(lightDirCamera, -1.0f);
+    Vector3 toLight = {
+        view.m0 * l.x + view.m1 * l.y + view.m2  * l.z,
+        view.m4 * l.x + view.m5 * l.y + view.m6  * l.z,
+        view.m8 * l.x + view.m9 * l.y + view.m10 * l.z
+    };
+
+    for (int i = 0; i < ctx->bspNodeCount; ++i)
+    {
+        Vector3 point = Mat4TransformPoint(view, ctx->bspNodes[i].point);
+        ctx->bspPlanes[i * 2] = point;
+        ctx->bspPlanes[i * 2 + 1] = Vector3Subtract(Mat4TransformPoint(view, Vector3Add(ctx->bspNodes[i].point, ctx->bspNodes[i].normal)), point);
+    }
+
+    int outCount = 0;
+    int nextDynamic = 0;    // First dynamic triangle (in sorted order) that isn't drawn yet
+
+    // Walk the tree: 2 * node expands a node, 2 * node + 1 draws its triangles
+    int stackCount = 0;
+    ctx->bspStack[stackCount++] = 2 * ctx->bspRoot;
+
+    while (stackCount > 0)
+    {
+        int item = ctx->bspStack[--stackCount];
+        int node = item / 2;
+        Vector3 planePoint = ctx->bspPlanes[node * 2];
+        Vector3 planeNormal = ctx->bspPlanes[node * 2 + 1];
+
+        // Camera space puts the camera at the origin, the side it's on gets drawn last
+        bool cameraInFront = Vector3Dot(planeNormal, planePoint) <= 0.0f;
+
+        if (item % 2 == 0)
+        {
+            int nearChild = cameraInFront ? ctx->bspNodes[node].front : ctx->bspNodes[node].back;
+            int farChild = cameraInFront ? ctx->bspNodes[node].back : ctx->bspNodes[node].front;
+
+            if (nearChild >= 0)
+                ctx->bspStack[stackCount++] = 2 * nearChild;
+            ctx->bspStack[stackCount++] = item + 1;
+            if (farChild >= 0)
+                ctx->bspStack[stackCount++] = 2 * farChild;
+            continue;
+        }
+
+        // Dynamic triangles on the far side of this plane go first
+        while (nextDynamic < dynamicCount)
+        {
+            const RenderTriangle* t = &f->triangles[f->sortedTriangles[nextDynamic].index];
+            Vector3 center = Vector3Scale(Vector3Add(Vector3Add(t->v[0], t->v[1]), t->v[2]), 1.0f / 3.0f);
+            float side = Vector3Dot(planeNormal, Vector3Subtract(center, planePoint));
+            if ((side >= 0.0f) == cameraInFront)
+                break;
+
+            f->sortScratch[outCount++] = f->sortedTriangles[nextDynamic++];
+        }
+
+        const BSPNode* n = &ctx->bspNodes[node];
+        for (int i = n->first; i < n->first + n->count; ++i)
+        {
+            const BSPTriangle* t = &ctx->bspTriangles[i];
+            Vector3 camVerts[3] = {
+                Mat4TransformPoint(view, t->v[0]),
+                Mat4TransformPoint(view, t->v[1]),
+                Mat4TransformPoint(view, t->v[2])
+            };
+
+            Color colors[3];
+            for (int k = 0; k < 3 && f->smoothShading; ++k)
+                colors[k] = ColorScale(t->color, LightBrightness(Vector3Dot(Vector3Normalize(t->n[k]), toLight)));
+
+            int first = f->triCount;
+            if (!AddFrameFace(f, camVerts, f->smoothShading ? colors : NULL, t->color, t->face, program, lightDirCamera, f->backFaceCulling) ||
+                !GrowRenderBuffer((void**)&f->sortScratch, &f->scratchCapacity, outCount + f->triCount - first + dynamicCount - nextDynamic, sizeof(RenderSortEntry)))
+            {
+                printf("Failed to grow triangle buffer\n");
+                return;
+            }
+
+            for (int k = first; k < f->triCount; ++k)
+                f->sortScratch[outCount++] = (RenderSortEntry){ DepthSortKey(f->triangles[k].depth), (Uint32)k };
+        }
+    }
+
+    // Whatever is left is in front of everything static
+    while (nextDynamic < dynamicCount)
+        f->sortScratch[outCount++] = f->sortedTriangles[nextDynamic++];
+
+    // The merged order becomes the frame's draw order
+    RenderSortEntry* sorted = f->sortScratch;
+    int capacity = f->scratchCapacity;
+    f->sortScratch = f->sortedTriangles;
+    f->scratchCapacity = f->sortCapacity;
+    f->sortedTriangles = sorted;
+    f->sortCapacity = capacity;
+    f->sortedCount = (outCount == f->triCount) ? outCount : 0;
+}
+
+
+
+//
+// Fills a frame for the modes that draw back to front. Only the dynamic triangles get sorted
+// when the static BSP tree is on, the tree adds the static ones in order after that.
+//
+static void FillSortedFrame(RenderContext* ctx, RenderFrame* f, Object* objects, int objectCount, Camera* cam, WindowInfo program, Vector3 lightDirCamera,
+                            bool cullBackFaces, bool smoothShading)
+{
+    bool useBSP = ctx->staticBSP && UpdateStaticBSP(ctx, objects, objectCount);
+
+    FillFrameTriangles(ctx, f, objects, objectCount, cam, program, lightDirCamera, cullBackFaces, smoothShading, useBSP);
+    SortFrameTriangles(ctx, f);
+
+    if (useBSP)
+        MergeStaticBSP(ctx, f, cam, program, lightDirCamera);
+}
+
+
+
+
+
+/////////////////////////////////////////////
+/// Renders all faces in the frame's list ///
+/////////////////////////////////////////////
+
+void RenderTriangles(RenderContext* ctx, SDL_Renderer* renderer, WindowInfo program)
+{
+    if (!GrowRenderBuffer((void**)&ctx->geometryBuffer, &ctx->geometryCapacity, ctx->frame->triCount * 3, sizeof(SDL_Vertex)))
+    {
+        printf("Failed to allocate geometry buffer\n");
+        ctx->frame->triCount = 0;
+        return;
+    }
+
+    int vertexCount = 0;
+
+    // Use the depth order if the triangles were sorted
+    bool sorted = (ctx->frame->sortedCount == ctx->frame->triCount);
+
+    for (int i = 0; i < ctx->frame->triCount; ++i)
+    {
+        RenderTriangle* t = &ctx->frame->triangles[sorted ? ctx->frame->sortedTriangles[i].index : (Uint32)i];
+
+        // The color is the same for all three corners when it's flat, so only convert it once
+        SDL_FColor color = {
+            (float)t->color.r / (float)255,
+            (float)t->color.g / (float)255,
+            (float)t->color.b / (float)255,
+            (float)t->color.a / (float)255
+        };
+
+        for (int k = 0; k < 3; ++k)
+        {
+            if (ctx->frame->smoothShading)
+            {
+                color.r = (float)t->vertexColors[k].r / (float)255;
+                color.g = (float)t->vertexColors[k].g / (float)255;
+                color.b = (float)t->vertexColors[k].b / (float)255;
+            }
+
+            Vector2 projected = {
+                t->v[k].x / t->v[k].z,
+                t->v[k].y / t->v[k].z
+            };
+
+            ScreenPoint sp = Screen(projected, program);
+
+            SDL_Vertex* vertex = &ctx->geometryBuffer[vertexCount++];
+            vertex->position.x = sp.x;
+            vertex->position.y = sp.y;
+            vertex->color = color;
+            vertex->tex_coord.x = 0;
+            vertex->tex_coord.y = 0;
+        }
+    }
+
+    // One call for the whole frame, SDL draws the triangles in order so the sorting still holds
+    if (vertexCount > 0)
+        SDL_RenderGeometry(renderer, NULL, ctx->geometryBuffer, vertexCount, NULL, 0);
+
+    // Reset triCount to fill the buffer again next frame
+    ctx->frame->triCount = 0;
+}
+
+
+
+
+
+//////////////////////////////
+/// Dirty rectangle redraw ///
+//////////////////////////////
+
+void SetDirtyRectRedraw(RenderContext* ctx, bool enabled)
+{
+    ctx->dirtyRectRedraw = enabled;
+    ctx->dirtyFrameValid = false;
+}
+
+bool GetDirtyRectRedraw(const RenderContext* ctx)
+{
+    return ctx->dirtyRectRedraw;
+}
+
+void InvalidateDirtyRects(RenderContext* ctx)
+{
+    ctx->dirtyFrameValid = false;
+}
+
+
+
+//
+// Screen area covered by triangles first to last - 1 (w = 0 if there are none)
+// Uses the same projection as the rasterizer, padded by a pixel for rounding.
+//
+static SDL_Rect TriangleScreenBounds(const RenderContext* ctx, WindowInfo program, int first, int last)
+{
+    float scale = (program.width < program.height) ? program.width / 2.0f : program.height / 2.0f;
+    float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+
+    for (int i = first; i < last; ++i)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            Vector3 v = ctx->frame->triangles[i].v[k];
+            float sx =  v.x / v.z * scale + program.width / 2.0f;
+            float sy = -v.y / v.z * scale + program.height / 2.0f;
+
+            minX = fminf(minX, sx); maxX = fmaxf(maxX, sx);
+            minY = fminf(minY, sy); maxY = fmaxf(maxY, sy);
+        }
+    }
+
+    SDL_Rect bounds = {0, 0, 0, 0};
+    if (first >= last)
+        return bounds;
+
+    int x0 = SDL_max((int)floorf(minX) - 1, 0);
+    int y0 = SDL_max((int)floorf(minY) - 1, 0);
+    int x1 = SDL_min((int)ceilf(maxX) + 1, program.width);
+    int y1 = SDL_min((int)ceilf(maxY) + 1, program.height);
+
+    if (x0 < x1 && y0 < y1)
+        bounds = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+
+    return bounds;
+}
+
+
+
+//
+// Grows rect to also cover add (empty rectangles are ignored)
+//
+static void UniteRects(SDL_Rect* rect, SDL_Rect add)
+{
+    if (add.w <= 0 || add.h <= 0)
+        return;
+
+    if (rect->w <= 0 || rect->h <= 0)
+    {
+        *rect = add;
+        return;
+    }
+
+    int x0 = SDL_min(rect->x, add.x);
+    int y0 = SDL_min(rect->y, add.y);
+    int x1 = SDL_max(rect->x + rect->w, add.x + add.w);
+    int y1 = SDL_max(rect->y + rect->h, add.y + add.h);
+    *rect = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+
+
+//
+// Works out which part of the screen needs to be drawn again after the frame's triangles are built.
+// Returns true for a full redraw, otherwise dirty is the area to redraw (w = 0 means nothing changed).
+// Objects that didn't move keep their triangles in the same place, so only the old and new
+// areas of objects that moved (or changed mesh or color) are dirty.
+//
+static bool FindDirtyRect(RenderContext* ctx, SDL_Surface* surface, WindowInfo program, Scene* scene, Vector3 lightDirCamera, int renderMode, SDL_Rect* dirty)
+{
+    bool full = !ctx->dirtyFrameValid || surface != ctx->dirtySurface || program.width != ctx->dirtyWidth || program.height != ctx->dirtyHeight ||
+                renderMode != ctx->dirtyMode || ctx->frame->backFaceCulling != ctx->dirtyBackFaceCulling || ctx->frame->smoothShading != ctx->dirtySmoothShading ||
+                memcmp(&ctx->dirtyLight, &lightDirCamera, sizeof(Vector3)) != 0 ||
+                memcmp(&ctx->dirtyCamera.transform, &scene->mainCam->transform, sizeof(Transform)) != 0 ||
+                memcmp(&ctx->dirtyCamera.rotation, &scene->mainCam->rotation, sizeof(Quaternion)) != 0 ||
+                scene->objectCount != ctx->dirtyObjectCount || ctx->frame->objectRangeCount != scene->objectCount;
 
-            // ---------- Old routine ---------- //
+    *dirty = (SDL_Rect){0, 0, 0, 0};
 
+    if (!GrowRenderBuffer((void**)&ctx->dirtyObjects, &ctx->dirtyObjectCapacity, scene->objectCount, sizeof(DirtyObjectState)))
+    {
+        ctx->dirtyFrameValid = false;
+        return true;
+    }
+
+    for (int i = 0; i < scene->objectCount; ++i)
+    {
+        Object* obj = &scene->objects[i];
+        DirtyObjectState* last = &ctx->dirtyObjects[i];
+        SDL_Rect bounds = TriangleScreenBounds(ctx, program, ctx->frame->objectTriangleStart[i], ctx->frame->objectTriangleStart[i + 1]);
+
+        bool moved = full || obj->mesh != last->mesh ||
+                     memcmp(&obj->transform, &last->transform, sizeof(Transform)) != 0 ||
+                     (obj->mesh != NULL && memcmp(&obj->mesh->color, &last->color, sizeof(Color)) != 0);
+
+        if (moved && !full)
+        {
+            UniteRects(dirty, last->bounds);
+            UniteRects(dirty, bounds);
         }
+
+        last->transform = obj->transform;
+        last->mesh = obj->mesh;
+        last->color = (obj->mesh != NULL) ? obj->mesh->color : (Color){0, 0, 0, 0};
+        last->bounds = bounds;
     }
 
-    // Sort the vertices according to depth
-    qsort(triangleBuffer, triCount, sizeof(RenderTriangle), CompareTris);
+    // Remember what this frame was drawn with
+    ctx->dirtyFrameValid = true;
+    ctx->dirtySurface = surface;
+    ctx->dirtyWidth = program.width;
+    ctx->dirtyHeight = program.height;
+    ctx->dirtyMode = renderMode;
+    ctx->dirtyBackFaceCulling = ctx->frame->backFaceCulling;
+    ctx->dirtySmoothShading = ctx->frame->smoothShading;
+    ctx->dirtyLight = lightDirCamera;
+    ctx->dirtyCamera = *scene->mainCam;
+    ctx->dirtyObjectCount = scene->objectCount;
+
+    return full;
 }
 
 
 
+//
+// Clears a rectangle of the surface (NULL is all of it) to the renderer's draw color.
+// The fill kernels write the surface directly, so whatever is queued on the renderer is drawn first.
+//
+void ClearRenderSurface(SDL_Renderer* renderer, SDL_Surface* surface, const SDL_Rect* rect)
+{
+    Color color;
+    SDL_GetRenderDrawColor(renderer, &color.r, &color.g, &color.b, &color.a);
+    SDL_FlushRenderer(renderer);
+
+    if (FillRasterSurface(surface, rect, color))
+        return;
+
+    // Not a 32 bit surface (or no surface at all), let the renderer do it
+    if (rect == NULL)
+        SDL_RenderClear(renderer);
+    else
+    {
+        SDL_FRect area = {(float)rect->x, (float)rect->y, (float)rect->w, (float)rect->h};
+        SDL_RenderFillRect(renderer, &area);
+    }
+    SDL_FlushRenderer(renderer);
+}
 
 
-/////////////////////////////////////////////////
-/// Renders all faces in triangleBuffer array ///
-/////////////////////////////////////////////////
 
-void RenderTriangles(SDL_Renderer* renderer, WindowInfo program)
+//
+// Redraws only the dirty part of the previous frame in the z-buffer modes.
+// The objects that don't touch the dirty area are dropped before rasterizing.
+//
+static void RasterizeDirtyRect(RenderContext* ctx, SDL_Renderer* renderer, SDL_Surface* surface, WindowInfo program, Scene* scene, int renderMode, SDL_Rect dirty)
 {
-    for (int i = 0; i < triCount; ++i)
+    // Background, in the renderer's draw color
+    ClearRenderSurface(renderer, surface, &dirty);
+
+    // Keep the triangles of objects that overlap the dirty area (in order)
+    int count = 0;
+    for (int i = 0; i < scene->objectCount; ++i)
     {
-        RenderTriangle* t = &triangleBuffer[i];
+        int first = ctx->frame->objectTriangleStart[i];
+        int last = ctx->frame->objectTriangleStart[i + 1];
 
-        SDL_Vertex triangle[3];
+        if (!SDL_HasRectIntersection(&ctx->dirtyObjects[i].bounds, &dirty))
+            continue;
 
-        for (int k = 0; k < 3; ++k)
+        if (count != first)
+            memmove(&ctx->frame->triangles[count], &ctx->frame->triangles[first], sizeof(RenderTriangle) * (last - first));
+        count += last - first;
+    }
+
+    if (renderMode == SOFTWARE_MODE_TILED)
+        RasterizeTrianglesTiledRect(&ctx->raster, surface, program, ctx->frame->triangles, count, &dirty);
+    else
+        RasterizeTrianglesRect(&ctx->raster, surface, program, ctx->frame->triangles, count, &dirty);
+}
+
+
+
+
+////////////////////////
+/// Pipelined frames ///
+////////////////////////
+
+//
+// Copies what the geometry thread needs from the scene, so the caller can change it while the frame is built
+//
+static bool CopySceneToFrame(RenderContext* ctx, RenderFrame* f, Scene* scene, WindowInfo program, Vector3 lightDirCamera, int renderMode)
+{
+    if (!GrowRenderBuffer((void**)&f->objects, &f->objectCapacity, scene->objectCount, sizeof(Object)))
+    {
+        printf("Failed to allocate ctx->frame objects\n");
+        return false;
+    }
+
+    if (scene->objectCount > 0)
+        memcpy(f->objects, scene->objects, sizeof(Object) * scene->objectCount);
+
+    f->objectCount = scene->objectCount;
+    f->camera = *scene->mainCam;
+    f->program = program;
+    f->lightDirCamera = lightDirCamera;
+    f->renderMode = renderMode;
+    f->backFaceCulling = ctx->backFaceCulling;
+    f->smoothShading = ctx->smoothShading;
+    return true;
+}
+
+
+
+//
+// Builds a frame from its copy of the scene (the sorting is only needed by the mesh mode)
+//
+static void BuildFrame(RenderContext* ctx, RenderFrame* f)
+{
+    if (f->renderMode == SOFTWARE_MODE_MESH || f->renderMode == SOFTWARE_MODE_SPANS)
+        FillSortedFrame(ctx, f, f->objects, f->objectCount, &f->camera, f->program, f->lightDirCamera, f->backFaceCulling, f->smoothShading);
+    else
+        FillFrameTriangles(ctx, f, f->objects, f->objectCount, &f->camera, f->program, f->lightDirCamera, f->backFaceCulling, f->smoothShading, false);
+}
+
+
+
+//
+// Entry point for the geometry thread. It sleeps until RenderScene hands it the next frame.
+//
+static int GeometryThreadMain(void* data)
+{
+    RenderContext* ctx = data;
+
+    while (true)
+    {
+        SDL_WaitSemaphore(ctx->geometryStart);
+        if (ctx->geometryQuit)
+            break;
+
+        BuildFrame(ctx, ctx->nextFrame);
+        SDL_SignalSemaphore(ctx->geometryDone);
+    }
+
+    return 0;
+}
+
+
+
+static bool StartGeometryThread(RenderContext* ctx)
+{
+    if (ctx->geometryThread != NULL)
+        return true;
+
+    ctx->geometryStart = SDL_CreateSemaphore(0);
+    ctx->geometryDone = SDL_CreateSemaphore(0);
+
+    if (ctx->geometryStart != NULL && ctx->geometryDone != NULL)
+        ctx->geometryThread = SDL_CreateThread(GeometryThreadMain, "GeometryThread", ctx);
+
+    if (ctx->geometryThread == NULL)
+    {
+        printf("Failed to start the geometry thread, frames won't be pipelined\n");
+        SDL_DestroySemaphore(ctx->geometryStart);
+        SDL_DestroySemaphore(ctx->geometryDone);
+        ctx->geometryStart = ctx->geometryDone = NULL;
+        ctx->framePipelining = false;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+//
+// Waits until the geometry thread is done with the frame it's building (the frame is thrown away)
+//
+static void DropPipelinedFrame(RenderContext* ctx)
+{
+    if (!ctx->geometryPending)
+        return;
+
+    SDL_WaitSemaphore(ctx->geometryDone);
+    ctx->geometryPending = false;
+}
+
+
+
+void SetFramePipelining(RenderContext* ctx, bool enabled)
+{
+    ctx->framePipelining = enabled;
+
+    if (enabled || ctx->geometryThread == NULL)
+        return;
+
+    DropPipelinedFrame(ctx);
+
+    ctx->geometryQuit = true;
+    SDL_SignalSemaphore(ctx->geometryStart);
+    SDL_WaitThread(ctx->geometryThread, NULL);
+
+    SDL_DestroySemaphore(ctx->geometryStart);
+    SDL_DestroySemaphore(ctx->geometryDone);
+    ctx->geometryThread = NULL;
+    ctx->geometryStart = ctx->geometryDone = NULL;
+    ctx->geometryQuit = false;
+}
+
+bool GetFramePipelining(const RenderContext* ctx)
+{
+    return ctx->framePipelining;
+}
+
+
+
+//
+// Fills frame with the triangles to draw now and returns the scene they were built from.
+// Without pipelining that's the scene as it is. With it, it's the copy of the scene from the last call,
+// which the geometry thread has been building in the meantime, and the thread starts on this call's scene.
+//
+static Scene PrepareFrame(RenderContext* ctx, Scene* scene, WindowInfo program, Vector3* lightDirCamera, int renderMode)
+{
+    if (!ctx->framePipelining || !StartGeometryThread(ctx))
+    {
+        if (renderMode == SOFTWARE_MODE_MESH || renderMode == SOFTWARE_MODE_SPANS)
+            FillSortedFrame(ctx, ctx->frame, scene->objects, scene->objectCount, scene->mainCam, program, *lightDirCamera, ctx->backFaceCulling, ctx->smoothShading);
+        else
+            FillFrameTriangles(ctx, ctx->frame, scene->objects, scene->objectCount, scene->mainCam, program, *lightDirCamera, ctx->backFaceCulling, ctx->smoothShading, false);
+        return *scene;
+    }
+
+    // Swap in the frame the geometry thread just finished
+    bool ready = ctx->geometryPending;
+    if (ctx->geometryPending)
+    {
+        SDL_WaitSemaphore(ctx->geometryDone);
+        ctx->geometryPending = false;
+
+        RenderFrame* built = ctx->frame;
+        ctx->frame = ctx->nextFrame;
+        ctx->nextFrame = built;
+    }
+
+    // The first frame (or one started with another mode or window size) is built here instead
+    if (!ready || ctx->frame->renderMode != renderMode ||
+        ctx->frame->program.width != program.width || ctx->frame->program.height != program.height)
+    {
+        if (!CopySceneToFrame(ctx, ctx->frame, scene, program, *lightDirCamera, renderMode))
         {
-            Vector2 projected = {
-                t->v[k].x / t->v[k].z,
-                t->v[k].y / t->v[k].z
-            };
+            ctx->frame->triCount = 0;
+            ctx->frame->objectRangeCount = 0;
+            return *scene;
+        }
+        BuildFrame(ctx, ctx->frame);
+    }
 
-            ScreenPoint sp = Screen(projected, program);
+    // Start on the next frame while this one is drawn
+    if (CopySceneToFrame(ctx, ctx->nextFrame, scene, program, *lightDirCamera, renderMode))
+    {
+        ctx->geometryPending = true;
+        SDL_SignalSemaphore(ctx->geometryStart);
+    }
+
+    *lightDirCamera = ctx->frame->lightDirCamera;
+    return (Scene){ .mainCam = &ctx->frame->camera, .objectCount = ctx->frame->objectCount, .objectCapacity = ctx->frame->objectCapacity,
+                    .objects = ctx->frame->objects, .dirty = false };
+}
+
+
+
+
+
+/////////////////////////
+/// Visibility buffer ///
+/////////////////////////
+
+
+//
+// Object a face ID belongs to (a binary search through the first face of every object)
+//
+static int FindVisibilityObject(const RenderContext* ctx, int face)
+{
+    int low = 0;
+    int high = ctx->visibilityObjectCount - 1;
 
-            triangle[k].position.x = sp.x;
-            triangle[k].position.y = sp.y;
-            triangle[k].color.a = (float)t->color.a / (float)255;
-            triangle[k].color.b = (float)t->color.b / (float)255;
-            triangle[k].color.g = (float)t->color.g / (float)255;
-            triangle[k].color.r = (float)t->color.r / (float)255;
-            triangle[k].tex_coord.x = 0;
-            triangle[k].tex_coord.y = 0;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+
+        if (ctx->visibilityObjectFaces[mid] <= face)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+
+
+//
+// First pass: the face ID of every pixel, drawn with the z-buffer rasterizer
+//
+static bool DrawVisibilityBuffer(RenderContext* ctx, SDL_Surface* surface, WindowInfo program, Scene* scene)
+{
+    if (!GrowRenderBuffer((void**)&ctx->visibilityBuffer, &ctx->visibilityCapacity, surface->w * surface->h, sizeof(Uint32)) ||
+        !GrowRenderBuffer((void**)&ctx->visibilityTriangleIds, &ctx->visibilityTriangleIdCapacity, ctx->frame->triCount, sizeof(Uint32)) ||
+        !GrowRenderBuffer((void**)&ctx->visibilityObjectFaces, &ctx->visibilityObjectCapacity, scene->objectCount + 1, sizeof(int)))
+    {
+        printf("Failed to allocate visibility buffer\n");
+        ctx->visibilityWidth = ctx->visibilityHeight = 0;
+        return false;
+    }
+
+    // Faces are numbered through the objects in the order FillFrameTriangles goes through them
+    int faces = 0;
+    for (int i = 0; i < scene->objectCount; ++i)
+    {
+        ctx->visibilityObjectFaces[i] = faces;
+        if (scene->objects[i].mesh != NULL)
+            faces += scene->objects[i].mesh->facesCount;
+    }
+    ctx->visibilityObjectFaces[scene->objectCount] = faces;
+    ctx->visibilityObjectCount = scene->objectCount;
+
+    for (int i = 0; i < ctx->frame->triCount; ++i)
+        ctx->visibilityTriangleIds[i] = ctx->frame->triangleFaces[i] + 1;
+
+    ctx->visibilityWidth = surface->w;
+    ctx->visibilityHeight = surface->h;
+    RasterizeTriangleIDs(&ctx->raster, ctx->visibilityBuffer, ctx->visibilityWidth, ctx->visibilityHeight, program, ctx->frame->triangles, ctx->visibilityTriangleIds, ctx->frame->triCount);
+    return true;
+}
+
+
+
+//
+// Second pass: every covered pixel gets the color of its face. A face is shaded from its mesh color and
+// normal the first time one of its pixels comes up, so hidden faces are never shaded at all.
+//
+static void ResolveVisibilityBuffer(RenderContext* ctx, SDL_Surface* surface, Scene* scene, Vector3 lightDirCamera)
+{
+    if (!GrowRenderBuffer((void**)&ctx->visibilityFaceColors, &ctx->visibilityFaceColorCapacity, ctx->frame->faceCount, sizeof(Uint32)) ||
+        !GrowRenderBuffer((void**)&ctx->visibilityFaceShaded, &ctx->visibilityFaceShadedCapacity, ctx->frame->faceCount, sizeof(Uint8)))
+    {
+        printf("Failed to allocate visibility buffer colors\n");
+        return;
+    }
+
+    memset(ctx->visibilityFaceShaded, 0, ctx->frame->faceCount);
+    lightDirCamera = LightDirectionToCamera(scene->mainCam, lightDirCamera);
+    const SDL_PixelFormatDetails* format = SDL_GetPixelFormatDetails(surface->format);
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_LockSurface(surface);
+
+    for (int y = 0; y < ctx->visibilityHeight; ++y)
+    {
+        const Uint32* ids = ctx->visibilityBuffer + y * ctx->visibilityWidth;
+        Uint32* row = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch);
+
+        for (int x = 0; x < ctx->visibilityWidth; ++x)
+        {
+            Uint32 id = ids[x];
+            if (id == 0)
+                continue;
+
+            int face = (int)id - 1;
+            if (!ctx->visibilityFaceShaded[face])
+            {
+                // All the triangles of a face are in its plane, the first one gives the normal
+                const RenderTriangle* t = &ctx->frame->triangles[ctx->frame->faceTriangles[face]];
+                Vector3 normal = Vector3Cross(Vector3Subtract(t->v[1], t->v[0]),
+                                              Vector3Subtract(t->v[2], t->v[0]));
+                Mesh* mesh = scene->objects[FindVisibilityObject(ctx, face)].mesh;
+
+                ctx->visibilityFaceColors[face] = MapRasterColor(format, ShadeFace(mesh->color, normal, lightDirCamera));
+                ctx->visibilityFaceShaded[face] = 1;
+            }
+
+            row[x] = ctx->visibilityFaceColors[face];
         }
+    }
+
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+}
+
+
+
+bool PickVisibilityBuffer(const RenderContext* ctx, int x, int y, int* objectIndex, int* faceIndex)
+{
+    if (x < 0 || y < 0 || x >= ctx->visibilityWidth || y >= ctx->visibilityHeight)
+        return false;
+
+    Uint32 id = ctx->visibilityBuffer[y * ctx->visibilityWidth + x];
+    if (id == 0)
+        return false;
+
+    int face = (int)id - 1;
+    int object = FindVisibilityObject(ctx, face);
+
+    if (objectIndex)
+        *objectIndex = object;
+    if (faceIndex)
+        *faceIndex = face - ctx->visibilityObjectFaces[object];
+    return true;
+}
+
+
+
+
+
+//////////////////////////
+/// Dynamic resolution ///
+//////////////////////////
+
+void InitDynamicResolution(DynamicResolution* res, WindowInfo program)
+{
+    *res = (DynamicResolution){ 0 };
+    res->filter = SDL_SCALEMODE_LINEAR;
+    res->scale = 1.0f;
+    res->minScale = DYNAMIC_RES_MIN_SCALE;
+    res->budgetMs = 1000.0 / ((program.FPS > 0) ? program.FPS : 60);
+}
+
+
+
+//
+// Shrinks the scale when the smoothed frame time goes over the budget and grows it back
+// when there's plenty of room. Most of the cost is per pixel, so the scale (per axis)
+// follows the square root of the time ratio. Growing is slow and starts well under the
+// budget, so it doesn't keep bouncing between two sizes.
+//
+bool UpdateDynamicResolution(DynamicResolution* res, double frameMs)
+{
+    if (!res->enabled)
+        return false;
 
-        SDL_RenderGeometry(renderer, NULL, triangle, 3, NULL, 0);
+    if (res->settleFrames > 0)
+    {
+        res->settleFrames--;
+        return false;
+    }
+
+    res->averageMs = (res->averageMs > 0) ? res->averageMs * 0.9 + frameMs * 0.1 : frameMs;
+
+    float scale = res->scale;
+    if (res->averageMs > res->budgetMs)
+    {
+        // Aim a bit under the budget, but don't drop more than a quarter at a time
+        scale *= (float)sqrt(0.9 * res->budgetMs / res->averageMs);
+        scale = fmaxf(scale, res->scale * 0.75f);
     }
+    else if (res->averageMs < 0.7 * res->budgetMs)
+        scale *= 1.05f;
+    else
+        return false;
+
+    // Steps of 1/64 so small changes don't make a new surface every frame
+    scale = fminf(fmaxf(scale, res->minScale), 1.0f);
+    scale = roundf(scale * 64.0f) / 64.0f;
+
+    if (scale == res->scale)
+        return false;
+
+    res->scale = scale;
+    res->averageMs = 0;
+    res->settleFrames = DYNAMIC_RES_SETTLE_FRAMES;
+    return true;
+}
+
+
+
+void GetDynamicResolutionSize(const DynamicResolution* res, WindowInfo window, int* width, int* height)
+{
+    float scale = res->enabled ? res->scale : 1.0f;
+
+    *width = SDL_max((int)(window.width * scale + 0.5f), 1);
+    *height = SDL_max((int)(window.height * scale + 0.5f), 1);
+}
 
-    // Reset triangleBuffer and triCount to fill it again next frame
-    free(triangleBuffer);
-    triCount = 0;
+
+
+bool PresentDynamicResolution(const DynamicResolution* res, SDL_Surface* surface, SDL_Surface* windowSurface)
+{
+    if (surface->w == windowSurface->w && surface->h == windowSurface->h)
+        return SDL_BlitSurface(surface, NULL, windowSurface, NULL);
+
+    return SDL_BlitSurfaceScaled(surface, NULL, windowSurface, NULL, res->filter);
+}
+
+
+
+bool CanDrawToWindowSurface(SDL_Surface* windowSurface)
+{
+    // The rasterizer writes whole 32 bit pixels in the surface's own format, the SDL renderer takes any format
+    return windowSurface != NULL && windowSurface->pixels != NULL &&
+           SDL_BYTESPERPIXEL(windowSurface->format) == 4 && !SDL_MUSTLOCK(windowSurface);
 }
 
 
@@ -599,19 +2349,126 @@ void RenderTriangles(SDL_Renderer* renderer, WindowInfo program)
 /// This function encapsulates all rendering steps according to settings ///
 ////////////////////////////////////////////////////////////////////////////
 
-void RenderScene(SDL_Renderer* renderer, WindowInfo program, Scene* scene, Vector3 lightDirCamera, bool Wireframe)
+void RenderScene(RenderContext* ctx, SDL_Renderer* renderer, SDL_Surface* surface, WindowInfo program, Scene* scene, Vector3 lightDirCamera, int renderMode)
 {
     Camera* cam = scene->mainCam;
-    // Depending on whether Wireframe is true or not, different rendering functions are used.
-    if (Wireframe == true)
+
+    // With dirty rectangles the clearing is done here (in the renderer's draw color), since most of the last frame is kept
+    bool dirtyRects = ctx->dirtyRectRedraw && surface != NULL && renderer != NULL &&
+                      (renderMode == SOFTWARE_MODE_ZBUFFER || renderMode == SOFTWARE_MODE_TILED);
+    if (ctx->dirtyRectRedraw && !dirtyRects)
     {
-        for (int i = 0; i < scene->objectCount; ++i)
-            RenderWireframe(renderer, program, cam, &scene->objects[i]);
+        if (renderer != NULL)
+            SDL_RenderClear(renderer);
+        ctx->dirtyFrameValid = false;
     }
-    else
+
+    Scene built;
+
+    // Depending on the render mode, different rendering functions are used.
+    switch (renderMode)
     {
-        AddRenderTriangles(scene->objects, scene->objectCount, cam, lightDirCamera);
-        RenderTriangles(renderer, program);
+        case SOFTWARE_MODE_WIREFRAME:
+            // Lines are drawn straight from the scene, a frame started by another mode is out of date by the time it's used
+            DropPipelinedFrame(ctx);
+
+            if (renderer == NULL)
+            {
+                printf("Wireframe mode needs a renderer\n");
+                break;
+            }
+
+            for (int i = 0; i < scene->objectCount; ++i)
+                RenderWireframe(ctx, renderer, program, cam, &scene->objects[i]);
+            break;
+
+        case SOFTWARE_MODE_ZBUFFER:
+        case SOFTWARE_MODE_TILED:
+            if (surface == NULL)
+            {
+                printf("Z-buffer mode needs a surface\n");
+                break;
+            }
+
+            built = PrepareFrame(ctx, scene, program, &lightDirCamera, renderMode);
+
+            if (dirtyRects)
+            {
+                SDL_Rect dirty;
+                if (!FindDirtyRect(ctx, surface, program, &built, lightDirCamera, renderMode, &dirty))
+                {
+                    if (dirty.w > 0 && dirty.h > 0)
+                        RasterizeDirtyRect(ctx, renderer, surface, program, &built, renderMode, dirty);
+
+                    ctx->frame->triCount = 0;
+                    break;
+                }
+
+                ClearRenderSurface(renderer, surface, NULL);
+            }
+
+            // Anything queued on the renderer has to land before we write pixels
+            if (renderer != NULL)
+                SDL_FlushRenderer(renderer);
+
+            if (renderMode == SOFTWARE_MODE_TILED)
+                RasterizeTrianglesTiled(&ctx->raster, surface, program, ctx->frame->triangles, ctx->frame->triCount);
+            else
+                RasterizeTriangles(&ctx->raster, surface, program, ctx->frame->triangles, ctx->frame->triCount);
+
+            ctx->frame->triCount = 0;
+            break;
+
+        case SOFTWARE_MODE_SPANS:
+            if (surface == NULL)
+            {
+                printf("Span buffer mode needs a surface\n");
+                break;
+            }
+
+            PrepareFrame(ctx, scene, program, &lightDirCamera, renderMode);
+
+            // The sort is back to front for the painter's algorithm, the span buffer wants the closest first
+            if (ctx->frame->sortedCount != ctx->frame->triCount ||
+                !GrowRenderBuffer((void**)&ctx->frontToBack, &ctx->frontToBackCapacity, ctx->frame->triCount, sizeof(RenderTriangle)))
+                break;
+
+            for (int i = 0; i < ctx->frame->triCount; ++i)
+                ctx->frontToBack[i] = ctx->frame->triangles[ctx->frame->sortedTriangles[ctx->frame->triCount - 1 - i].index];
+
+            if (renderer != NULL)
+                SDL_FlushRenderer(renderer);
+            RasterizeTrianglesSpans(&ctx->raster, surface, program, ctx->frontToBack, ctx->frame->triCount);
+            break;
+
+        case SOFTWARE_MODE_VISIBILITY:
+            if (surface == NULL)
+            {
+                printf("Visibility buffer mode needs a surface\n");
+                break;
+            }
+
+            built = PrepareFrame(ctx, scene, program, &lightDirCamera, renderMode);
+
+            if (renderer != NULL)
+                SDL_FlushRenderer(renderer);
+            if (DrawVisibilityBuffer(ctx, surface, program, &built))
+                ResolveVisibilityBuffer(ctx, surface, &built, lightDirCamera);
+
+            ctx->frame->triCount = 0;
+            break;
+
+        case SOFTWARE_MODE_MESH:
+        default:
+            if (renderer == NULL)
+            {
+                printf("Mesh mode needs a renderer\n");
+                break;
+            }
+
+            PrepareFrame(ctx, scene, program, &lightDirCamera, renderMode);
+            RenderTriangles(ctx, renderer, program);
+            break;
     }
 }
 
@@ -2,12 +2,249 @@
 #define SOFTWARE_RENDER_H
 
 #include "structures.h"
+#include "rasterizer.h"
 #include "SDL3/SDL.h"
 
 
-// // Global variables
-// RenderTriangle* triangleBuffer;
-// int triCount = 0;
+// Render modes for the software renderer
+typedef enum SoftwareRenderMode
+{
+    SOFTWARE_MODE_MESH = 0,     // Depth sorted triangles drawn with SDL_RenderGeometry
+    SOFTWARE_MODE_WIREFRAME,    // Lines only
+    SOFTWARE_MODE_ZBUFFER,      // Native rasterizer with a depth buffer, draws into the surface
+    SOFTWARE_MODE_TILED,        // Same as ZBUFFER, but split into tiles drawn on several threads
+    SOFTWARE_MODE_SPANS,        // Native rasterizer without a depth buffer, front to back with a span buffer (no overdraw)
+    SOFTWARE_MODE_VISIBILITY,   // Face IDs with a depth buffer first, then every visible pixel is shaded once from its ID
+    SOFTWARE_MODE_COUNT
+} SoftwareRenderMode;
+
+
+// View frustum planes, used as bit positions in clipping outcodes
+typedef enum FrustumPlane
+{
+    FRUSTUM_NEAR = 0,
+    FRUSTUM_FAR,
+    FRUSTUM_LEFT,
+    FRUSTUM_RIGHT,
+    FRUSTUM_BOTTOM,
+    FRUSTUM_TOP,
+    FRUSTUM_PLANE_COUNT
+} FrustumPlane;
+
+#define FRUSTUM_NEAR_Z 0.01f
+#define FRUSTUM_FAR_Z 100.0f        // Same as the hardware renderer
+#define FRUSTUM_GUARD_BAND 2.0f     // How far past the screen edges (in screen sizes) a triangle can reach before it gets clipped
+#define FRUSTUM_MAX_CLIPPED 9       // A triangle clipped by all six planes has at most 3 + 6 points
+
+// The coherent sort gives up and sorts from scratch after this many moves per triangle,
+// and then waits up to COHERENT_SORT_MAX_BACKOFF frames before trying again
+#define COHERENT_SORT_MAX_MOVES 4
+#define COHERENT_SORT_MAX_BACKOFF 16
+
+
+// Entry in the painter's algorithm draw order
+typedef struct RenderSortEntry
+{
+    Uint32 key;     // Depth turned into an integer that sorts back to front
+    Uint32 index;   // Position in the frame's triangles
+} RenderSortEntry;
+
+
+// Triangle of a static object in the BSP tree, in world space (pieces of split faces are triangles of their own)
+typedef struct BSPTriangle
+{
+    Vector3 v[3];
+    Vector3 n[3];   // Vertex normals in world space (any length) for smooth shading
+    Color color;    // Mesh color, it's lit every frame
+    Uint32 face;    // Mesh face it came from, numbered like RenderFrame.triangleFaces
+} BSPTriangle;
+
+
+// Node of the static BSP tree: a plane and the triangles that lie in it.
+// A child of -1 means there's nothing on that side.
+typedef struct BSPNode
+{
+    Vector3 point;      // The plane goes through point and faces along normal (world space)
+    Vector3 normal;
+    int first;          // Triangles in the plane, first to first + count - 1 in the tree's triangles
+    int count;
+    int front;
+    int back;
+} BSPNode;
+
+#define BSP_PLANE_EPSILON 1e-4f     // Points closer than this to a plane (in world units) are in it
+#define BSP_SPLIT_CANDIDATES 16     // Splitting planes tried per node, each scored on a sample of the node's triangles
+#define BSP_SPLIT_SAMPLES 128
+
+
+// Everything one frame's triangles are built from and into.
+// With pipelined frames there are two: one is drawn while the next one is built on another thread.
+typedef struct RenderFrame
+{
+    // Camera space triangles, with the range of every object (objectRangeCount + 1 entries, the last one is triCount)
+    RenderTriangle* triangles;
+    int triCount;
+    int triangleCapacity;
+    int* objectTriangleStart;
+    int objectTriangleCapacity;
+    int objectRangeCount;
+
+    // Mesh face every triangle came from, and the first triangle of every face (-1 when it has none).
+    // Faces are numbered through all the objects, the coherent sort uses them to find last frame's triangles.
+    Uint32* triangleFaces;
+    int triangleFaceCapacity;
+    int* faceTriangles;
+    int faceTriangleCapacity;
+    int faceCount;
+
+    // Draw order from SortRenderTriangles (only used when sortedCount matches triCount)
+    RenderSortEntry* sortedTriangles;
+    RenderSortEntry* sortScratch;
+    int sortCapacity;
+    int scratchCapacity;
+    int sortedCount;
+
+    // Camera space positions of the vertices of the object being added, and their lit colors for smooth shading
+    Vector3* vertexCache;
+    int vertexCacheCapacity;
+    Color* vertexColors;
+    int vertexColorCapacity;
+
+    // Copy of the scene the triangles were built from (only filled in for pipelined frames)
+    Object* objects;
+    int objectCount;
+    int objectCapacity;
+    Camera camera;
+    WindowInfo program;
+    Vector3 lightDirCamera;
+    int renderMode;
+    bool backFaceCulling;
+    bool smoothShading;
+} RenderFrame;
+
+
+// Dynamic resolution: the scene is drawn into a smaller surface when frames run over the
+// frame time budget (from WindowInfo.FPS) and scaled up to the window when it's presented
+typedef struct DynamicResolution
+{
+    bool enabled;
+    SDL_ScaleMode filter;   // How the internal surface is scaled up (SDL_SCALEMODE_NEAREST or SDL_SCALEMODE_LINEAR)
+    float scale;            // Internal size / window size, per axis
+    float minScale;
+    double budgetMs;
+    double averageMs;       // Smoothed frame time (0 until the next frame is measured)
+    int settleFrames;       // Frames left before the average is trusted again after a change
+} DynamicResolution;
+
+#define DYNAMIC_RES_MIN_SCALE 0.25f
+#define DYNAMIC_RES_SETTLE_FRAMES 8     // Frames to skip after a resize, while caches and the average catch up
+
+
+// What an object looked like when the last frame was drawn (for dirty rectangle redraw)
+typedef struct DirtyObjectState
+{
+    Transform transform;
+    Mesh* mesh;
+    Color color;
+    SDL_Rect bounds;    // Screen area its triangles covered
+} DirtyObjectState;
+
+
+// Everything one software renderer draws with: its settings, the frames, the scratch buffers and the caches
+// kept between frames. Each context is independent, so several scenes (or viewports) can be drawn at the same
+// time, each on its own thread with its own context. Start one with InitRenderContext and don't move it after
+// (frame points into it). The buffers only grow and are kept until FreeRenderContext.
+typedef struct RenderContext
+{
+    // Settings (see the Set functions below)
+    bool backFaceCulling;
+    bool smoothShading;
+    bool coherentSort;
+    bool staticBSP;
+    bool framePipelining;
+    bool dirtyRectRedraw;
+
+    // The buffers are kept between frames and only grow, so a frame doesn't need any allocations.
+    // frame is the one being drawn, nextFrame is built on the geometry thread when frames are pipelined.
+    RenderFrame renderFrames[2];
+    RenderFrame* frame;
+    RenderFrame* nextFrame;
+    SDL_Vertex* geometryBuffer;
+    int geometryCapacity;
+
+    // The frame's triangles in front to back order for the span buffer mode
+    RenderTriangle* frontToBack;
+    int frontToBackCapacity;
+
+    // Visibility buffer: face ID + 1 of the closest face at every pixel of the last frame drawn in that mode (0 is nothing).
+    // The first face of every object is kept with it, so a pixel can be picked after the frame is gone.
+    Uint32* visibilityBuffer;
+    int visibilityCapacity;
+    int visibilityWidth;
+    int visibilityHeight;
+    Uint32* visibilityTriangleIds;
+    int visibilityTriangleIdCapacity;
+    int* visibilityObjectFaces;
+    int visibilityObjectCapacity;
+    int visibilityObjectCount;
+
+    // Pixel value of every face the visibility buffer resolve has shaded this frame
+    Uint32* visibilityFaceColors;
+    int visibilityFaceColorCapacity;
+    Uint8* visibilityFaceShaded;
+    int visibilityFaceShadedCapacity;
+
+    // Screen positions and line points for the wireframe renderer
+    SDL_FPoint* wireframePoints;
+    int wireframePointsCapacity;
+
+    // Coherent sort: the faces in the order the last sorted frame drew them (faceCount of that frame in sortHistoryFaces)
+    Uint32* sortHistory;
+    int sortHistoryCount;
+    int sortHistoryCapacity;
+    int sortHistoryFaces;
+    int coherentSortBackoff;    // Frames to wait after the next failed attempt (doubles every time)
+    int coherentSortWait;       // Frames left before trying again
+
+    // Static BSP tree, built from the objects marked isStatic (bspSignature tells when they change)
+    bool bspBuilt;
+    Uint32 bspSignature;
+    BSPNode* bspNodes;
+    int bspNodeCount;
+    int bspNodeCapacity;
+    BSPTriangle* bspTriangles;
+    int bspTriangleCount;
+    int bspTriangleCapacity;
+    int bspRoot;
+
+    // Static BSP per frame: node planes in camera space (point and normal) and the walk's stack
+    Vector3* bspPlanes;
+    int bspPlaneCapacity;
+    int* bspStack;
+    int bspStackCapacity;
+
+    // Pipelined frames: the geometry thread builds nextFrame between geometryStart and geometryDone
+    bool geometryPending;
+    bool geometryQuit;
+    SDL_Thread* geometryThread;
+    SDL_Semaphore* geometryStart;
+    SDL_Semaphore* geometryDone;
+
+    // Dirty rectangle redraw: what the last frame looked like, so the next one only redraws what changed
+    bool dirtyFrameValid;
+    SDL_Surface* dirtySurface;
+    int dirtyWidth, dirtyHeight, dirtyMode;
+    bool dirtyBackFaceCulling;
+    bool dirtySmoothShading;
+    Camera dirtyCamera;
+    Vector3 dirtyLight;
+    DirtyObjectState* dirtyObjects;
+    int dirtyObjectCount;
+    int dirtyObjectCapacity;
+
+    // Depth buffer, tile workers and the other rasterizer state
+    RasterContext raster;
+} RenderContext;
 
 
 
@@ -43,16 +280,92 @@ Vector2 Project(Vector3 p);
 Vector2 TransformAndProject(Camera* cam, Transform* obj, Vector3 p);
 
 // Wireframe renderer
-void RenderWireframe(SDL_Renderer* renderer, WindowInfo program, Camera* cam, Object* obj);
+void RenderWireframe(RenderContext* ctx, SDL_Renderer* renderer, WindowInfo program, Camera* cam, Object* obj);
 
 // Functions for mesh rendering
 int ClipTriangleAgainstNearPlane(Vector3 inV[3], Vector3 outTris[2][3]);
 int CompareTris(const void* a, const void* b);
-void AddRenderTriangles(Object* GlobalObjects, int numObjects, Camera* cam, Vector3 lightDirCamera);
-void RenderTriangles(SDL_Renderer* renderer, WindowInfo program);
+
+// Clips a camera space triangle to the view frustum, returns the number of points in outV (0 when it's not visible)
+int ClipTriangleToFrustum(Vector3 inV[3], WindowInfo program, Vector3 outV[FRUSTUM_MAX_CLIPPED]);
+
+// Skips faces that point away from the camera (on by default, meshes need consistent winding)
+void SetBackFaceCulling(RenderContext* ctx, bool enabled);
+bool GetBackFaceCulling(const RenderContext* ctx);
+
+// Gouraud shading (off by default): every vertex is lit once with the mesh's cached normals and the colors are
+// interpolated, like the GL renderer. The mesh and z-buffer modes interpolate, the span buffer draws each triangle
+// with the color of its first vertex and the visibility buffer stays flat.
+void SetSmoothShading(RenderContext* ctx, bool enabled);
+bool GetSmoothShading(const RenderContext* ctx);
+
+void AddRenderTriangles(RenderContext* ctx, Object* GlobalObjects, int numObjects, Camera* cam, WindowInfo program, Vector3 lightDirCamera);
+// Works out the back to front draw order for RenderTriangles (the triangles themselves don't move)
+void SortRenderTriangles(RenderContext* ctx);
+
+// Coherent sort (off by default): the painter's order starts from the last frame's order and gets repaired
+// with an insertion sort, which is close to linear while little moves. When too much has changed (the
+// camera jumped, a dense mesh turned) it sorts from scratch like it does when it's off, and tries less often.
+void SetCoherentSort(RenderContext* ctx, bool enabled);
+bool GetCoherentSort(const RenderContext* ctx);
+void RenderTriangles(RenderContext* ctx, SDL_Renderer* renderer, WindowInfo program);
+
+// Static BSP tree (off by default): in the mesh and span buffer modes, objects marked isStatic are put
+// into a BSP tree once and drawn by walking it from the camera instead of being sorted every frame.
+// That's linear and always in the right order, even for triangles that cut through each other.
+// The other objects are sorted like before and merged in that order, each one before the first plane it's in front of.
+// The tree is built again when objects are marked or unmarked, call InvalidateStaticBSP after moving a static object.
+// With pipelined frames both setters wait for the frame being built and drop it, so the next one uses the new tree.
+void SetStaticBSP(RenderContext* ctx, bool enabled);
+bool GetStaticBSP(const RenderContext* ctx);
+void InvalidateStaticBSP(RenderContext* ctx);
+
+// Sets up a context before its first frame, and frees its buffers and threads when it's done (see RenderContext)
+void InitRenderContext(RenderContext* ctx);
+void FreeRenderContext(RenderContext* ctx);
+
+// Dirty rectangle redraw (off by default): in the z-buffer modes only the part of the screen where objects
+// moved is drawn again and the rest of the last frame is kept. A moving camera still redraws everything.
+// While it's on, RenderScene clears the screen itself (with the renderer's draw color), so don't clear before it.
+// Call InvalidateDirtyRects after drawing anything else into the surface or changing a mesh.
+void SetDirtyRectRedraw(RenderContext* ctx, bool enabled);
+bool GetDirtyRectRedraw(const RenderContext* ctx);
+void InvalidateDirtyRects(RenderContext* ctx);
+
+// Pipelined frames (off by default): in the mesh and z-buffer modes RenderScene builds the triangles of
+// the next frame on a worker thread while the current one is drawn. That hides most of the geometry work
+// on machines with more than one core, but what's on screen is one frame behind the scene.
+// Meshes must not be changed or freed while it's on, turning it off waits for the worker to finish.
+void SetFramePipelining(RenderContext* ctx, bool enabled);
+bool GetFramePipelining(const RenderContext* ctx);
+
+// Dynamic resolution (see DynamicResolution). Init sets the budget from program.FPS and starts at full size.
+void InitDynamicResolution(DynamicResolution* res, WindowInfo program);
+// Call with the time the last frame took to draw (without any waiting), returns true when the scale changed
+bool UpdateDynamicResolution(DynamicResolution* res, double frameMs);
+// Size of the surface to draw into for a window of this size (the window size when it's off)
+void GetDynamicResolutionSize(const DynamicResolution* res, WindowInfo window, int* width, int* height);
+// Copies the drawn surface to the window surface, scaling it up if it's smaller
+bool PresentDynamicResolution(const DynamicResolution* res, SDL_Surface* surface, SDL_Surface* windowSurface);
+
+// Zero-copy presentation: true when a frame can be drawn straight into the window surface (in its own
+// pixel format), so showing it is only SDL_UpdateWindowSurface with no copy or format conversion.
+// Dirty rectangles then count on the window surface keeping its pixels between updates.
+bool CanDrawToWindowSurface(SDL_Surface* windowSurface);
+
+// Clears a rectangle of the surface the renderer draws to (NULL is all of it) to the renderer's draw color,
+// with the rasterizer's fill kernels when it's a 32 bit surface. Also a drop in for SDL_RenderClear.
+void ClearRenderSurface(SDL_Renderer* renderer, SDL_Surface* surface, const SDL_Rect* rect);
+
+// Object and face (within its mesh) at a pixel of the last frame drawn in the visibility buffer mode,
+// false when nothing was drawn there. x and y are in the surface that frame was drawn into.
+bool PickVisibilityBuffer(const RenderContext* ctx, int x, int y, int* objectIndex, int* faceIndex);
 
 // Full render function to encapsulate all settings
-void RenderScene(SDL_Renderer* renderer, WindowInfo program, Scene* scene, Vector3 lightDirCamera, bool Wireframe);
+// The surface is only needed for the native rasterizer modes (it should be the surface the renderer draws to)
+// The renderer is only needed for the mesh and wireframe modes and for dirty rectangles, so the native rasterizer
+// modes (z-buffer, tiled, spans, visibility) can draw with a NULL renderer, e.g. on threads other than the main one
+void RenderScene(RenderContext* ctx, SDL_Renderer* renderer, SDL_Surface* surface, WindowInfo program, Scene* scene, Vector3 lightDirCamera, int renderMode);
 int ClipLineZ(Vector3* p1, Vector3* p2);
 void RenderDebugRays(SDL_Renderer* renderer, WindowInfo program, Camera* cam, Ray* GlobalRays, int rayCount);
 
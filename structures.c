@@ -37,6 +37,8 @@ Object CreateObject(char* name)
     obj.transform = objTransform;
     obj.name = name;
     obj.mesh = NULL;
+    obj.isStatic = false;
+    obj.dirty = true;
 
     return obj;
 }
@@ -65,11 +67,199 @@ Mesh* CreateMesh(Vector3* verts, int vertexCount, int (*faces)[3], int faceCount
     memcpy(objMesh->faces, faces, faceCount * sizeof(*objMesh->faces));
     memcpy(objMesh->vertices, verts, vertexCount * sizeof(Vector3));
 
+    BuildMeshEdges(objMesh);
+    BuildMeshNormals(objMesh);
+
     return objMesh;
 }
 
 
 
+static int CompareEdgeKeys(const void* a, const void* b)
+{
+    unsigned long long ka = *(const unsigned long long*)a;
+    unsigned long long kb = *(const unsigned long long*)b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+
+
+//
+// Finds the unique edges of a mesh and chains them into strips for the wireframe renderer.
+// Each strip is a walk along unused edges, so connected edges can be drawn as one polyline.
+//
+void BuildMeshEdges(Mesh* mesh)
+{
+    mesh->edgeCount = 0;
+    mesh->edgeStrips = NULL;
+    mesh->edgeStripsLength = 0;
+
+    if (mesh->facesCount <= 0 || mesh->vertexCount <= 0)
+        return;
+
+    // Every face edge as a (smaller index, bigger index) key, sorted so duplicates end up next to each other
+    unsigned long long* keys = malloc(sizeof(unsigned long long) * mesh->facesCount * 3);
+    if (!keys) return;
+
+    int keyCount = 0;
+    for (int i = 0; i < mesh->facesCount; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            int a = mesh->faces[i][j];
+            int b = mesh->faces[i][(j + 1) % 3];
+
+            if (a == b || a < 0 || b < 0 || a >= mesh->vertexCount || b >= mesh->vertexCount)
+                continue;
+
+            if (a > b) { int t = a; a = b; b = t; }
+            keys[keyCount++] = ((unsigned long long)a << 32) | (unsigned int)b;
+        }
+    }
+
+    qsort(keys, keyCount, sizeof(unsigned long long), CompareEdgeKeys);
+
+    int edgeCount = 0;
+    for (int i = 0; i < keyCount; ++i)
+    {
+        if (i == 0 || keys[i] != keys[i - 1])
+            keys[edgeCount++] = keys[i];
+    }
+
+    // Adjacency lists: for every vertex, the edges that touch it
+    int* firstEdge = calloc(mesh->vertexCount + 1, sizeof(int));
+    int* nextEdge = calloc(mesh->vertexCount, sizeof(int));
+    int* adjacent = malloc(sizeof(int) * edgeCount * 2);
+    bool* used = calloc(edgeCount, sizeof(bool));
+    int* strips = malloc(sizeof(int) * edgeCount * 3);
+
+    if (!firstEdge || !nextEdge || !adjacent || !used || !strips)
+    {
+        free(keys); free(firstEdge); free(nextEdge); free(adjacent); free(used); free(strips);
+        return;
+    }
+
+    for (int e = 0; e < edgeCount; ++e)
+    {
+        firstEdge[(int)(keys[e] >> 32) + 1]++;
+        firstEdge[(int)(keys[e] & 0xFFFFFFFF) + 1]++;
+    }
+    for (int v = 0; v < mesh->vertexCount; ++v)
+    {
+        firstEdge[v + 1] += firstEdge[v];
+        nextEdge[v] = firstEdge[v];
+    }
+    for (int e = 0; e < edgeCount; ++e)
+    {
+        adjacent[nextEdge[(int)(keys[e] >> 32)]++] = e;
+        adjacent[nextEdge[(int)(keys[e] & 0xFFFFFFFF)]++] = e;
+    }
+
+    // nextEdge now walks each list, skipping edges that were already put in a strip
+    for (int v = 0; v < mesh->vertexCount; ++v)
+        nextEdge[v] = firstEdge[v];
+
+    // Start at vertices with an odd number of edges first, those are where strips have to end anyway
+    int length = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (int start = 0; start < mesh->vertexCount; ++start)
+        {
+            if (pass == 0 && (firstEdge[start + 1] - firstEdge[start]) % 2 == 0)
+                continue;
+
+            // Keep starting strips here until all of this vertex's edges are used
+            while (true)
+            {
+                int v = start;
+                int stripStart = length;
+
+                while (true)
+                {
+                    while (nextEdge[v] < firstEdge[v + 1] && used[adjacent[nextEdge[v]]])
+                        nextEdge[v]++;
+
+                    if (nextEdge[v] == firstEdge[v + 1])
+                        break;
+
+                    int e = adjacent[nextEdge[v]];
+                    used[e] = true;
+
+                    if (length == stripStart)
+                        strips[length++] = v;
+
+                    int a = (int)(keys[e] >> 32);
+                    int b = (int)(keys[e] & 0xFFFFFFFF);
+                    v = (v == a) ? b : a;
+                    strips[length++] = v;
+                }
+
+                if (length == stripStart)
+                    break;
+
+                strips[length++] = -1;
+
+                if (pass == 0)
+                    break;
+            }
+        }
+    }
+
+    free(keys);
+    free(firstEdge);
+    free(nextEdge);
+    free(adjacent);
+    free(used);
+
+    mesh->edgeCount = edgeCount;
+    mesh->edgeStrips = strips;
+    mesh->edgeStripsLength = length;
+}
+
+
+
+//
+// Smooth normals for every vertex: the sum of the normals of the faces around it, weighted by their area.
+// Same as CalculateNormals in the GL renderer, done once at load so the software renderer can light vertices.
+//
+void BuildMeshNormals(Mesh* mesh)
+{
+    mesh->normals = NULL;
+
+    if (mesh->vertexCount <= 0)
+        return;
+
+    Vector3* normals = calloc(mesh->vertexCount, sizeof(Vector3));
+    if (!normals)
+        return;
+
+    for (int i = 0; i < mesh->facesCount; ++i)
+    {
+        int* face = mesh->faces[i];
+        if (face[0] < 0 || face[1] < 0 || face[2] < 0 ||
+            face[0] >= mesh->vertexCount || face[1] >= mesh->vertexCount || face[2] >= mesh->vertexCount)
+            continue;
+
+        Vector3 v0 = mesh->vertices[face[0]];
+        Vector3 normal = Vector3Cross(Vector3Subtract(mesh->vertices[face[1]], v0), Vector3Subtract(mesh->vertices[face[2]], v0));
+
+        for (int k = 0; k < 3; ++k)
+            normals[face[k]] = Vector3Add(normals[face[k]], normal);
+    }
+
+    // Vertices no face uses keep a zero normal
+    for (int i = 0; i < mesh->vertexCount; ++i)
+    {
+        if (Vector3Dot(normals[i], normals[i]) > 0.0f)
+            normals[i] = Vector3Normalize(normals[i]);
+    }
+
+    mesh->normals = normals;
+}
+
+
+
 
 
 
@@ -493,6 +683,9 @@ void Camera_Move(Camera* cam, int forward, int right, int up, float speed)
     cam->transform.position.x += worldUp.x * speed * up;
     cam->transform.position.y += worldUp.y * speed * up;
     cam->transform.position.z += worldUp.z * speed * up;
+
+    if ((forward != 0 || right != 0 || up != 0) && speed != 0.0f)
+        cam->dirty = true;
 }
 
 
@@ -524,6 +717,9 @@ void Camera_MouseLook(Camera* cam, float dx, float dy, float sensitivity)
     cam->rotation = QuaternionMultiply(yawQ, pitchQ);
 
     cam->rotation = QuaternionNormalize(cam->rotation);
+
+    if (dx != 0.0f || dy != 0.0f)
+        cam->dirty = true;
 }
 
 
@@ -552,6 +748,9 @@ void RotateObjectX(Object* obj, float angle)
     
     // Normalize occasionally to keep it clean
     obj->transform.rotation = QuaternionNormalize(obj->transform.rotation);
+
+    if (angle != 0.0f)
+        obj->dirty = true;
 }
 
 
@@ -566,6 +765,9 @@ void RotateObjectY(Object* obj, float angle)
     
     obj->transform.rotation = QuaternionMultiply(obj->transform.rotation, rotStep);
     obj->transform.rotation = QuaternionNormalize(obj->transform.rotation);
+
+    if (angle != 0.0f)
+        obj->dirty = true;
 }
 
 
@@ -580,6 +782,9 @@ void RotateObjectZ(Object* obj, float angle)
     
     obj->transform.rotation = QuaternionMultiply(obj->transform.rotation, rotStep);
     obj->transform.rotation = QuaternionNormalize(obj->transform.rotation);
+
+    if (angle != 0.0f)
+        obj->dirty = true;
 }
 
 
@@ -747,6 +952,10 @@ Mesh *load_obj_mesh(const char *filename, Color color)
     }
 
     fclose(file);
+
+    BuildMeshEdges(mesh);
+    BuildMeshNormals(mesh);
+
     return mesh;
 }
 
@@ -780,6 +989,39 @@ void AddObjectToScene(Scene* scene, Object* obj)
     }
 
     scene->objects[scene->objectCount++] = *obj;
+    scene->dirty = true;
+}
+
+
+
+//
+// Check if anything in the scene changed since it was last drawn.
+//
+bool IsSceneDirty(const Scene* scene)
+{
+    if (scene->dirty == true || (scene->mainCam != NULL && scene->mainCam->dirty == true))
+        return true;
+
+    for (int i = 0; i < scene->objectCount; i++)
+        if (scene->objects[i].dirty == true)
+            return true;
+
+    return false;
+}
+
+
+
+//
+// Mark the scene as drawn, called after a frame of it was shown.
+//
+void ClearSceneDirty(Scene* scene)
+{
+    scene->dirty = false;
+    if (scene->mainCam != NULL)
+        scene->mainCam->dirty = false;
+
+    for (int i = 0; i < scene->objectCount; i++)
+        scene->objects[i].dirty = false;
 }
 
 
@@ -1081,6 +1323,22 @@ Matrix4 Mat4RotateX(float r)
 
 
 
+//
+// Transform a point by a matrix (w = 1, no perspective divide).
+//
+Vector3 Mat4TransformPoint(Matrix4 m, Vector3 v)
+{
+    Vector3 out = {
+        m.m0 * v.x + m.m4 * v.y + m.m8  * v.z + m.m12,
+        m.m1 * v.x + m.m5 * v.y + m.m9  * v.z + m.m13,
+        m.m2 * v.x + m.m6 * v.y + m.m10 * v.z + m.m14
+    };
+
+    return out;
+}
+
+
+
 //
 // Get the array representation of a matrix.
 //
@@ -2,6 +2,7 @@
 #define STRUCTURES_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -83,6 +84,7 @@ typedef struct RenderTriangle
     Vector3 v[3];
     float depth;
     Color color;
+    Color vertexColors[3];  // Lit color at every vertex for smooth shading (all the same as color when flat)
 } RenderTriangle;
 
 
@@ -94,6 +96,10 @@ typedef struct Mesh
     Color color;
     GPUMesh* gpuMesh;
     int (*faces)[3];
+    int edgeCount;          // Unique edges (an edge shared by two faces only counts once)
+    int* edgeStrips;        // The edges chained into strips of vertex indices, each strip ends with -1
+    int edgeStripsLength;
+    Vector3* normals;       // Smooth normal of every vertex (unit length, object space), NULL if they couldn't be made
     Vector3 vertices[];
 } Mesh;
 
@@ -113,6 +119,8 @@ typedef struct Object
     Transform transform;
     char* name;
     Mesh* mesh;
+    bool isStatic;      // Never moves or changes its mesh (the software renderer can put it in its static BSP tree)
+    bool dirty;         // Moved since the scene was last drawn (set by RotateObject*, cleared by ClearSceneDirty)
 } Object;
 
 
@@ -121,6 +129,7 @@ typedef struct Camera
 {
     Transform transform;
     Quaternion rotation;
+    bool dirty;         // Moved or turned since the scene was last drawn (set by Camera_Move and Camera_MouseLook)
 } Camera;
 
 
@@ -131,6 +140,7 @@ typedef struct Scene
     int objectCount;
     int objectCapacity;
     Object* objects;
+    bool dirty;         // Objects were added since the scene was last drawn
 } Scene;
 
 
@@ -165,6 +175,8 @@ Object CreateObject(char* name);
 
 // Creating a mesh
 Mesh* CreateMesh(Vector3* verts, int vertexCount, int (*faces)[3], int faceCount, Color color);
+void BuildMeshEdges(Mesh* mesh);
+void BuildMeshNormals(Mesh* mesh);
 
 
 // Quaternion operations
@@ -226,6 +238,11 @@ Mesh* load_obj_mesh(const char *filename, Color color);
 // Scene functions
 void AddObjectToScene(Scene* scene, Object* obj);
 
+// Change tracking for drawing on demand: true if an object or the camera moved or an object was added since
+// the last ClearSceneDirty. Code that writes a transform directly has to set its dirty flag itself.
+bool IsSceneDirty(const Scene* scene);
+void ClearSceneDirty(Scene* scene);
+
 
 // Matrix4 operations
 Matrix4 Mat4Identity();
@@ -241,6 +258,7 @@ Matrix4 Mat4Inverse(Matrix4 m);
 Matrix4 Mat4Translate(Vector3 t);
 Matrix4 Mat4Scale(Vector3 s);
 Matrix4 Mat4RotateX(float r);
+Vector3 Mat4TransformPoint(Matrix4 m, Vector3 v);
 void Mat4ToArray(Matrix4 m, float out[16]);
 
 